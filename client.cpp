@@ -1,11 +1,18 @@
 #include <set>
 #include <array>
+#include <climits>
+#include <cstdint>
+#include <mutex>
 #include <atomic>
+#include <coroutine>
 #include <vector>
 #include <cstdio>
+#include <memory>
 #include <thread>
+#include <random>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <functional>
 
@@ -14,20 +21,133 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <stropts.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
 
 #include "common.h"
 
+// size of per fd tables, RLIM_INFINITY is possible here
+size_t fd_table_size() {
+    rlimit limit;
+    if (0 != getrlimit(RLIMIT_NOFILE, &limit)) {
+        std::perror("getrlimit(RLIMIT_NOFILE)");
+        return 0;
+    }
+    const rlim_t max_fds = 4 * 1024 * 1024;
+    return std::min(limit.rlim_cur, max_fds);
+}
+
+// per connection pipes for echo=splice, indexed by socket fd.
+// Table is sized by RLIMIT_NOFILE once, so thread per connection engines
+// can use it while main thread still accepts. Pipe is created on first
+// message by the thread, which owns the socket.
+class EchoPipes {
+protected:
+    std::vector<std::array<int, 2>> pipes;
+
+public:
+    bool init() {
+        if (not pipes.empty())
+            return true;
+
+        size_t size = fd_table_size();
+        pipes.assign(size, std::array<int, 2>{{-1, -1}});
+        return 0 != size;
+    }
+
+    bool open(int sockfd, int msize) {
+        if (sockfd >= (int)pipes.size()) {
+            std::cerr << "fd " << sockfd << " is out of EchoPipes table\n";
+            return false;
+        }
+
+        auto & fds = pipes[sockfd];
+        if (0 != pipe2(&fds[0], O_NONBLOCK)) {
+            std::perror("pipe2(...)");
+            return false;
+        }
+
+        // whole message should fit into pipe
+        if (msize > 64 * 1024 and 0 > fcntl(fds[0], F_SETPIPE_SZ, msize)) {
+            std::perror("fcntl(pipe, F_SETPIPE_SZ, msize)");
+            return false;
+        }
+        return true;
+    }
+
+    void close(int sockfd) {
+        if (sockfd >= (int)pipes.size() or -1 == pipes[sockfd][0])
+            return;
+        ::close(pipes[sockfd][0]);
+        ::close(pipes[sockfd][1]);
+        pipes[sockfd][0] = pipes[sockfd][1] = -1;
+    }
+
+    bool is_open(int sockfd) const { return -1 != pipes[sockfd][0]; }
+    const std::array<int, 2> & get(int sockfd) const { return pipes[sockfd]; }
+};
+
+EchoPipes echo_pipes;
+
+// per connection state, indexed by socket fd. calloc-ed, so pages of the
+// table are only touched for used fds, unless it is created in rt mode,
+// which prefaults it. T must be valid when zeroed.
+template<class T>
+class FDStateTable {
+protected:
+    T * items;
+    size_t size;
+
+public:
+    FDStateTable(): items(nullptr), size(0) {}
+
+    bool init() {
+        if (nullptr != items)
+            return true;
+
+        size = fd_table_size();
+        items = (T *)alloc_table(size * sizeof(T));
+        if (nullptr == items) {
+            std::perror("alloc_table(FDStateTable)");
+            return false;
+        }
+        return true;
+    }
+
+    // state must be clean for new connection, which reuses fd
+    void reset(int sockfd) {
+        if (sockfd < (int)size)
+            std::memset(&items[sockfd], 0, sizeof(T));
+    }
+
+    T * get(int sockfd) {
+        return sockfd < (int)size ? &items[sockfd] : nullptr;
+    }
+};
+
+// framing=lp parsers
+FDStateTable<FrameParser> frame_parsers;
+
+// pipeline > 1: bytes of incomplete raw request
+FDStateTable<uint32_t> raw_partial;
+
 class FDList {
 public:
     std::vector<int> fds;
     ~FDList() {
-        for(int fd: fds)
+        for(int fd: fds) {
+            echo_pipes.close(fd);
             close(fd);
+        }
     }
 };
 
@@ -38,7 +158,7 @@ public:
     ~FDCloser() { close(fd); }
 };
 
-class PollRSelector: public RSelector {
+class PollRSelector final: public RSelector {
 protected:
     std::vector<pollfd> fds;
     std::vector<pollfd>::iterator current_free;
@@ -66,9 +186,15 @@ public:
     bool wait(long int=-1) {
         int rv = poll(&fds[0], current_free - fds.begin(), -1);
         if (-1 == rv) {
+            if (EINTR == errno) {
+                ++stats.eintr;
+                current_ready = fds.end();
+                return true;
+            }
             std::perror("poll(fds, ..., -1) fails");
             return false;
         }
+        stats.on_wakeup(rv);
         current_ready = fds.begin();
         return true;
     }
@@ -90,6 +216,219 @@ public:
     }
 };
 
+// stats of last finished run_test_* call, see get_last_stats
+StatsList last_run_stats;
+
+// options for following run_test_* calls, see set_test_options
+// what responder sends back:
+//   const - constant message of the same size, historical behaviour
+//   copy - received bytes, via user space buffer
+//   splice - received bytes, socket -> pipe -> socket, bytes never reach user space
+enum EchoMode {
+    ECHO_CONST,
+    ECHO_COPY,
+    ECHO_SPLICE
+};
+
+// synthetic request handling: busy spin for service_ns (service_dist=const),
+// exponentially distributed time with this mean (exp) or uniform in
+// [0, 2 * service_ns] (uniform), after touching service_kb KB working set.
+// service_workers=N moves it from I/O thread to pool of N threads,
+// supported by run_test (cpp_epoll, cpp_poll), other engines serve inline.
+enum ServiceDist {
+    SERVICE_CONST,
+    SERVICE_EXP,
+    SERVICE_UNIFORM
+};
+
+struct ServiceModel {
+    unsigned long ns;
+    ServiceDist dist;
+    size_t working_set;
+    int workers;
+
+    ServiceModel(): ns(0), dist(SERVICE_CONST), working_set(0), workers(0) {}
+
+    bool enabled() const {
+        return 0 != ns or 0 != working_set;
+    }
+};
+
+struct TestOptions {
+    Transport transport;
+    EchoMode echo;
+    bool framed;
+    int pipeline;
+    ServiceModel service;
+    TcpInfoOptions tcp_info;
+    int nodelay;    // -1 - not set, socket default
+    RtOptions rt;
+    bool owd;       // stamp replies with OwdStamp
+    ConnOptions conn;
+    OptionsMap opts;
+
+    TestOptions(): transport(TRANSPORT_TCP), echo(ECHO_CONST), framed(false), pipeline(1), nodelay(-1),
+                   owd(false) {}
+
+    bool pipelined_raw() const {
+        return pipeline > 1 and not framed;
+    }
+};
+
+TestOptions test_options;
+
+// tcp_info_ms, started by wait_for_conn
+TcpInfoSampler tcp_info_sampler;
+
+// wait_for_conn accept cost, reported by add_run_stats
+ConnMemProbe conn_mem;
+long conn_mem_count = 0;
+
+// rt=1, set up by init_conn_state, reported by add_run_stats and undone by
+// RtScope of run_test_* on any return. Policy is per thread, relay sets it
+// in its in-process responder thread too.
+thread_local RtThreadSched rt_sched;
+thread_local bool rt_sched_ok = false;
+bool rt_active = false;
+size_t rt_thread_stack = RT_THREAD_STACK;
+
+// run_test_th threads keep a message sized buffer on their stacks
+struct RtScope {
+    RtScope(int msize) {
+        rt_thread_stack = std::max(RT_THREAD_STACK, (size_t)msize + 64 * 1024);
+    }
+    ~RtScope() {
+        if (rt_active) {
+            rt_sched.restore();
+            rt_memory_disable();
+        }
+        rt_active = false;
+        rt_thread_stack = RT_THREAD_STACK;
+    }
+};
+
+extern "C"
+int set_test_options(const char * spec) {
+    TestOptions new_opts;
+    if (not parse_options(spec, new_opts.opts))
+        return 1;
+
+    if (not opt_transport(new_opts.opts, new_opts.transport))
+        return 1;
+
+    std::string echo = "const";
+    opt_str(new_opts.opts, "echo", echo);
+    if ("const" == echo)
+        new_opts.echo = ECHO_CONST;
+    else if ("copy" == echo)
+        new_opts.echo = ECHO_COPY;
+    else if ("splice" == echo)
+        new_opts.echo = ECHO_SPLICE;
+    else {
+        std::cerr << "Unknown echo mode '" << echo << "'\n";
+        return 1;
+    }
+
+    if (not opt_framing(new_opts.opts, new_opts.framed))
+        return 1;
+
+    // reply size is requested by the loader, nothing to echo
+    if (new_opts.framed and ECHO_CONST != new_opts.echo) {
+        std::cerr << "framing=lp doesn't support echo=" << echo << "\n";
+        return 1;
+    }
+
+    if (not opt_pipeline(new_opts.opts, new_opts.pipeline))
+        return 1;
+
+    // requests boundaries are lost in pipelined stream
+    if (new_opts.pipeline > 1 and ECHO_CONST != new_opts.echo) {
+        std::cerr << "pipeline doesn't support echo=" << echo << "\n";
+        return 1;
+    }
+
+    if (new_opts.pipeline > 1 and
+            (TRANSPORT_UDP == new_opts.transport or TRANSPORT_UNIX_SEQPACKET == new_opts.transport)) {
+        std::cerr << "pipeline requires stream transport\n";
+        return 1;
+    }
+
+    long service_ns = 0, service_kb = 0, service_workers = 0;
+    std::string service_dist = "const";
+    if (not opt_long(new_opts.opts, "service_ns", service_ns) or
+            not opt_long(new_opts.opts, "service_kb", service_kb) or
+            not opt_long(new_opts.opts, "service_workers", service_workers))
+        return 1;
+    opt_str(new_opts.opts, "service_dist", service_dist);
+
+    if (service_ns < 0 or service_kb < 0 or service_workers < 0 or service_workers > 1024) {
+        std::cerr << "service_ns, service_kb and service_workers should be >= 0, ";
+        std::cerr << "service_workers <= 1024\n";
+        return 1;
+    }
+
+    new_opts.service.ns = service_ns;
+    new_opts.service.working_set = service_kb * 1024;
+    new_opts.service.workers = service_workers;
+    if ("const" == service_dist)
+        new_opts.service.dist = SERVICE_CONST;
+    else if ("exp" == service_dist)
+        new_opts.service.dist = SERVICE_EXP;
+    else if ("uniform" == service_dist)
+        new_opts.service.dist = SERVICE_UNIFORM;
+    else {
+        std::cerr << "Unknown service_dist '" << service_dist << "'\n";
+        return 1;
+    }
+
+    // worker answers with constant message, one request in flight per socket
+    if (0 != service_workers and (new_opts.framed or new_opts.pipeline > 1 or ECHO_CONST != new_opts.echo)) {
+        std::cerr << "service_workers requires framing=raw, pipeline=1 and echo=const\n";
+        return 1;
+    }
+
+    if (not opt_tcp_info(new_opts.opts, new_opts.transport, new_opts.tcp_info))
+        return 1;
+
+    long nodelay = -1;
+    if (not opt_long(new_opts.opts, "nodelay", nodelay))
+        return 1;
+    if (-1 != nodelay and TRANSPORT_TCP != new_opts.transport) {
+        std::cerr << "nodelay requires tcp transport\n";
+        return 1;
+    }
+    new_opts.nodelay = (-1 == nodelay ? -1 : (0 != nodelay));
+
+    if (not opt_rt(new_opts.opts, new_opts.rt))
+        return 1;
+
+    if (not opt_conn(new_opts.opts, new_opts.transport, new_opts.conn))
+        return 1;
+    raise_fd_limit();
+
+    long owd = 0;
+    if (not opt_long(new_opts.opts, "owd", owd))
+        return 1;
+    new_opts.owd = (0 != owd);
+    if (new_opts.owd and (new_opts.framed or new_opts.pipeline > 1 or ECHO_SPLICE == new_opts.echo or
+                          0 != service_workers or TRANSPORT_UDP == new_opts.transport)) {
+        std::cerr << "owd requires stream transport, raw framing, pipeline=1, no splice and no service_workers\n";
+        return 1;
+    }
+
+    test_options = new_opts;
+    return 0;
+}
+
+extern "C"
+int get_last_stats(char * buff, int buff_size) {
+    std::string out;
+    last_run_stats.serialize(out);
+    if ((int)out.size() < buff_size)
+        std::memcpy(buff, out.c_str(), out.size() + 1);
+    return out.size();
+}
+
 const unsigned long NS_TO_S = 1000 * 1000 * 1000;
 unsigned long time_ns() {
     struct timespec spec;
@@ -98,6 +437,96 @@ unsigned long time_ns() {
 }
 
 
+// listening socket for test_options.transport, -1 on error
+int listen_socket(const int port, const int listen_queue) {
+    const Transport transport = test_options.transport;
+    if (TRANSPORT_UDP == transport) {
+        std::cerr << "transport=udp is supported by run_test_udp only\n";
+        return -1;
+    }
+
+    const int family = (TRANSPORT_TCP == transport ? AF_INET : AF_UNIX);
+
+    int master_sock = socket(family, transport_socktype(transport), 0);
+    if (-1 == master_sock){
+        perror("Could not create socket");
+        return -1;
+    }
+
+    FDCloser _master_sock(master_sock);
+
+    sockaddr_in server;
+    sockaddr_un unix_server;
+    sockaddr * server_addr = (sockaddr *)&server;
+    socklen_t server_addr_len = sizeof(server);
+
+    if (TRANSPORT_TCP == transport) {
+        int enable = 1;
+        if (setsockopt(master_sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+            perror("setsockopt(SO_REUSEADDR) failed");
+
+        // accepted sockets inherit buffer sizes
+        if (0 != test_options.conn.sock_buf)
+            set_sock_buffers(master_sock, test_options.conn.sock_buf);
+
+        server.sin_family = AF_INET;
+        server.sin_addr.s_addr = INADDR_ANY;
+        server.sin_port = htons(port);
+    } else {
+        server_addr = (sockaddr *)&unix_server;
+        server_addr_len = make_unix_addr(port, unix_server);
+    }
+
+    if( 0 > bind(master_sock, server_addr, server_addr_len)) {
+        perror("bind failed. Error");
+        return -1;
+    }
+
+    listen(master_sock, listen_queue);
+
+    _master_sock.fd = -1;
+    return master_sock;
+}
+
+// per connection state tables for test_options
+bool init_conn_state() {
+    // before tables, so they are prefaulted. Threads, started by engines
+    // after connections are accepted, inherit scheduling of this one.
+    if (test_options.rt.enabled) {
+        rt_active = true;
+        rt_memory_enable(rt_thread_stack);
+        rt_sched_ok = rt_sched.set(pthread_self(), test_options.rt);
+    }
+
+    const bool need_pipes = (ECHO_SPLICE == test_options.echo);
+    if (need_pipes and not echo_pipes.init())
+        return false;
+
+    if (test_options.framed and not frame_parsers.init())
+        return false;
+
+    if (test_options.pipelined_raw() and not raw_partial.init())
+        return false;
+    return true;
+}
+
+bool on_conn_accepted(int sockfd) {
+    if (test_options.framed)
+        frame_parsers.reset(sockfd);
+    if (test_options.pipelined_raw())
+        raw_partial.reset(sockfd);
+    return -1 == test_options.nodelay or set_nodelay(sockfd, test_options.nodelay);
+}
+
+// relay's in-process responder calls back when it listens, wait_for_conn
+// keeps its listener, so run_test_relay can shut it down to stop accept
+std::atomic<bool> relay_upstream_listening(false);
+std::atomic<int> relay_upstream_listener(-1);
+
+void on_relay_upstream_listen() {
+    relay_upstream_listening = true;
+}
+
 bool wait_for_conn(int sock_count,
                    std::vector<int> & sockets,
                    const char * ip,
@@ -109,66 +538,137 @@ bool wait_for_conn(int sock_count,
 {
     (void)ip;
 
-    sockaddr_in server, client;
-    int master_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (-1 == master_sock){
-        perror("Could not create socket");
+    // ports=N: one listener per port, non blocking ones are polled
+    const int ports = test_options.conn.ports;
+    if (not test_options.conn.fits(port))
         return false;
-    }
-
-    FDCloser _master_sock(master_sock);
-    int enable = 1;
-    if (setsockopt(master_sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
-        perror("setsockopt(SO_REUSEADDR) failed");
 
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(port);
+    // loader connects as soon as it gets the spec and starts the test as soon
+    // as its side of connects completes, so connection, dropped by full accept
+    // queue, may never reach accept
+    FDList listeners;
+    std::vector<pollfd> pfds;
+    for(int i = 0; i < ports; ++i) {
+        int master_sock = listen_socket(port + i, std::max(listen_queue, sock_count));
+        if (-1 == master_sock)
+            return false;
+        listeners.fds.push_back(master_sock);
+        pfds.push_back(pollfd{master_sock, POLLIN, 0});
 
-    if( 0 > bind(master_sock, (sockaddr *)&server , sizeof(server))) {
-        perror("bind failed. Error");
-        return 1;
+        if (ports > 1 and 0 > fcntl(master_sock, F_SETFL, fcntl(master_sock, F_GETFL, 0) | O_NONBLOCK)) {
+            std::perror("fcntl(master_sock, F_SETFL, O_NONBLOCK)");
+            return false;
+        }
     }
 
-    listen(master_sock, listen_queue);
-    socklen_t sock_data_len = sizeof(client);
+    if (not init_conn_state())
+        return false;
 
+    if (on_relay_upstream_listen == ready_for_connect)
+        relay_upstream_listener = listeners.fds[0];
     if (nullptr != ready_for_connect)
         ready_for_connect();
 
-    for(int i = 0; i < sock_count; ++i){
-        int client_sock = accept(master_sock, (sockaddr *)&client, &sock_data_len);
-        if (client_sock < 0) {
-            perror("accept failed");
+    conn_mem.start();
+    sockets.reserve(sockets.size() + sock_count);
+
+    int accepted = 0;
+    while(accepted < sock_count) {
+        if (ports > 1 and 0 > poll(&pfds[0], pfds.size(), -1)) {
+            std::perror("poll(listeners)");
             return false;
         }
 
-        if(async) {
-            int flags = fcntl(client_sock, F_GETFL, 0);
-            if (flags < 0) {
-                std::perror("fcntl(client_sock, F_GETFL, 0)");
-                return false;
-            }
+        for(auto & pfd: pfds) {
+            if (ports > 1 and not (pfd.revents & POLLIN))
+                continue;
 
-            if (fcntl(client_sock, F_SETFL, flags | O_NONBLOCK) < 0) {
-                std::perror("fcntl(client_sock, F_SETFL, flags | O_NONBLOCK)");
-                return false;
+            // blocking listener gives one socket per accept
+            while(accepted < sock_count) {
+                int client_sock = accept4(pfd.fd, nullptr, nullptr, async ? SOCK_NONBLOCK : 0);
+                if (client_sock < 0 and ports > 1 and (EAGAIN == errno or EWOULDBLOCK == errno))
+                    break;
+                if (client_sock < 0) {
+                    perror("accept failed");
+                    return false;
+                }
+
+                ++accepted;
+                sockets.push_back(client_sock);
+                if (not on_conn_accepted(client_sock))
+                    return false;
+
+                if (nullptr != on_sock_cb) {
+                    (*on_sock_cb)(client_sock);
+                }
+                if (1 == ports)
+                    break;
             }
         }
-        sockets.push_back(client_sock);
-        if (nullptr != on_sock_cb) {
-            (*on_sock_cb)(client_sock);
-        }
     }
+
+    conn_mem.done();
+    conn_mem_count = sock_count;
+
+    // stopped by add_run_stats
+    if (test_options.tcp_info.enabled() and not tcp_info_sampler.start(sockets, test_options.tcp_info, "responder"))
+        return false;
     return true;
 }
 
-bool process_message(int sockfd, const char * message, int message_len) {
-    char buffer[message_len];
-    int bc = recv(sockfd, buffer, message_len, 0);
+// run synthetic request handling, returns spent time
+unsigned long serve_request(const ServiceModel & model) {
+    thread_local std::mt19937 rand_gen(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    thread_local std::vector<char> working_set;
+
+    unsigned long start = get_fast_time();
+
+    if (0 != model.working_set) {
+        if (working_set.size() != model.working_set)
+            working_set.assign(model.working_set, 0);
+        // one write per cache line
+        for(size_t offset = 0; offset < working_set.size(); offset += 64)
+            ++working_set[offset];
+    }
+
+    unsigned long duration = model.ns;
+    if (SERVICE_EXP == model.dist) {
+        std::exponential_distribution<double> dist(1.0 / model.ns);
+        duration = dist(rand_gen);
+    } else if (SERVICE_UNIFORM == model.dist) {
+        std::uniform_int_distribution<unsigned long> dist(0, 2 * model.ns);
+        duration = dist(rand_gen);
+    }
+
+    unsigned long curr = get_fast_time();
+    while(curr - start < duration)
+        curr = get_fast_time();
+    return curr - start;
+}
+
+inline void serve_inline(SelectorStats & stats, int count=1) {
+    if (not test_options.service.enabled())
+        return;
+    for(int i = 0; i < count; ++i)
+        stats.service_ns += serve_request(test_options.service);
+}
+
+bool splice_message(int sockfd, int message_len, SelectorStats & stats) {
+    if (not echo_pipes.is_open(sockfd) and not echo_pipes.open(sockfd, message_len))
+        return false;
+
+    const auto & pipe_fds = echo_pipes.get(sockfd);
+
+    int bc = splice(sockfd, nullptr, pipe_fds[1], nullptr, message_len,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    ++stats.syscalls;
     if (0 > bc) {
+        if (EAGAIN == errno or EWOULDBLOCK == errno) {
+            ++stats.recv_eagain;
+            return true;
+        }
         if (ECONNRESET != errno)
-            std::perror("recv(sockfd, buffer.begin(), buffer.size(), 0)");
+            std::perror("splice(sockfd, ..., pipe, ...)");
         return false;
     } else if (0 == bc) {
         return false;
@@ -176,65 +676,708 @@ bool process_message(int sockfd, const char * message, int message_len) {
         std::perror("partial message");
         return false;
     }
+    stats.bytes_in += bc;
 
-    if (message_len != write(sockfd, message, message_len)) {
-        std::perror("write(sockfd, message, std::strlen(message))");
-        return false;
-    }
+    serve_inline(stats);
 
+    while(bc > 0) {
+        int sent = splice(pipe_fds[0], nullptr, sockfd, nullptr, bc,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        ++stats.syscalls;
+        if (0 > sent) {
+            if (EAGAIN == errno or EWOULDBLOCK == errno)
+                ++stats.write_eagain;
+            std::perror("splice(pipe, ..., sockfd, ...)");
+            return false;
+        }
+        stats.bytes_out += sent;
+        bc -= sent;
+    }
     return true;
 }
 
-void th_func(int sockfd, const char * message, int msize) {
-    while(process_message(sockfd, message, msize));
-}
+// framing=lp: answer every complete frame with frame of requested size.
+// Replies to all frames, read in one wakeup, are coalesced.
+bool process_frames(int sockfd, int message_len, SelectorStats & stats, bool can_block) {
+    FrameParser * parser = frame_parsers.get(sockfd);
+    if (nullptr == parser) {
+        std::cerr << "fd " << sockfd << " is out of FrameParsers table\n";
+        return false;
+    }
 
-extern "C"
-int run_test_th(const char * ip,
-                const int port,
-                const int th_count,
-                int msize,
-                int listen_queue,
-                void (*ready_for_connect)(),
-                void (*preparation_done)(),
-                void (*test_done)())
-{
-    char message[msize];
-    std::memset(message, 'X', msize);
+    // bodies are skipped in place, buffer size only limits bytes per recv
+    char buffer[std::min(std::max(message_len, 1024), 64 * 1024)];
 
-    FDList sockets;
-    std::vector<std::thread> threads;
-    std::function<void(int)> cb = [&](int sock){
-        threads.emplace_back(th_func, sock, &message[0], msize);
+    const int MAX_REPLIES = 64;
+    FrameHeader replies[MAX_REPLIES];
+    int reply_count = 0;
+
+    auto reply = [&](const FrameHeader & request) {
+        serve_inline(stats);
+        replies[reply_count++] = FrameHeader{request.reply_len, 0};
+        if (MAX_REPLIES != reply_count)
+            return true;
+        reply_count = 0;
+        return send_frames(sockfd, replies, MAX_REPLIES, stats);
     };
 
-    if (not wait_for_conn(th_count,
-                          sockets.fds,
-                          ip,
-                          port,
-                          listen_queue,
-                          ready_for_connect,
-                          &cb,
-                          false))
-        return 1;
+    if (0 > read_frames(sockfd, *parser, buffer, sizeof(buffer), stats, can_block, 0, reply))
+        return false;
+    return 0 == reply_count or send_frames(sockfd, replies, reply_count, stats);
+}
 
-    if (nullptr != preparation_done)
-        preparation_done();
+// pipeline > 1, raw messages: socket may hold many requests. Drain it and
+// answer all complete ones with one writev, incomplete tail is counted
+// in raw_partial.
+bool process_pipelined(int sockfd, const char * message, int message_len, SelectorStats & stats,
+                       bool can_block) {
+    uint32_t * partial = raw_partial.get(sockfd);
+    if (nullptr == partial) {
+        std::cerr << "fd " << sockfd << " is out of raw_partial table\n";
+        return false;
+    }
 
-    for(auto & th: threads)
-        th.join();
+    // data is dropped, buffer size only limits bytes per recv
+    thread_local std::vector<char> buffer;
+    size_t buffer_size = std::max(std::min((size_t)test_options.pipeline * message_len, (size_t)1024 * 1024),
+                                  (size_t)message_len);
+    if (buffer.size() < buffer_size)
+        buffer.resize(buffer_size);
 
-    if (nullptr != test_done)
-        test_done();
+    long bc = recv_available(sockfd, &buffer[0], buffer_size, stats, can_block);
+    if (0 > bc)
+        return false;
 
-    return 0;
+    unsigned long total = *partial + bc;
+    *partial = total % message_len;
+    int count = total / message_len;
+    serve_inline(stats, count);
+    return 0 == count or send_copies(sockfd, message, message_len, count, stats);
 }
 
-int run_test(RSelector & selector,
-             const char * ip,
-             const int port,
-             const int th_count,
-             const int msize,
+// read one raw request. Returns 1 if got it, 0 on spurious wakeup, -1 on EOF/error
+int recv_message(int sockfd, char * buffer, int message_len, SelectorStats & stats) {
+    int bc = recv(sockfd, buffer, message_len, 0);
+    ++stats.syscalls;
+    if (0 > bc) {
+        if (EAGAIN == errno or EWOULDBLOCK == errno) {
+            ++stats.recv_eagain;
+            return 0;
+        }
+        if (ECONNRESET != errno)
+            std::perror("recv(sockfd, buffer.begin(), buffer.size(), 0)");
+        return -1;
+    } else if (0 == bc) {
+        return -1;
+    } else if (message_len != bc){
+        std::perror("partial message");
+        return -1;
+    }
+    stats.bytes_in += bc;
+    return 1;
+}
+
+bool send_message(int sockfd, const char * message, int message_len, SelectorStats & stats) {
+    ++stats.syscalls;
+    if (message_len != write(sockfd, message, message_len)) {
+        if (EAGAIN == errno or EWOULDBLOCK == errno)
+            ++stats.write_eagain;
+        std::perror("write(sockfd, message, std::strlen(message))");
+        return false;
+    }
+    stats.bytes_out += message_len;
+    return true;
+}
+
+// can_block - socket is served by own thread, so recv may wait for data
+bool process_message(int sockfd, const char * message, int message_len, SelectorStats & stats,
+                     bool can_block=false) {
+    if (test_options.framed)
+        return process_frames(sockfd, message_len, stats, can_block);
+
+    if (test_options.pipelined_raw())
+        return process_pipelined(sockfd, message, message_len, stats, can_block);
+
+    if (ECHO_SPLICE == test_options.echo)
+        return splice_message(sockfd, message_len, stats);
+
+    char buffer[message_len];
+    int got = recv_message(sockfd, buffer, message_len, stats);
+    if (0 >= got)
+        return 0 == got;
+
+    OwdStamp stamp;
+    if (test_options.owd)
+        stamp.recv_ns = get_mono_time();
+
+    serve_inline(stats);
+
+    if (ECHO_COPY == test_options.echo)
+        message = buffer;
+
+    // loader checks that message holds the stamp
+    if (test_options.owd and message_len >= (int)sizeof(stamp)) {
+        if (message != buffer)
+            std::memcpy(buffer, message, message_len);
+        stamp.send_ns = get_mono_time();
+        std::memcpy(buffer, &stamp, sizeof(stamp));
+        message = buffer;
+    }
+
+    return send_message(sockfd, message, message_len, stats);
+}
+
+void th_func(int sockfd, const char * message, int msize,
+             std::mutex * stats_lock, SelectorStats * total_stats) {
+    SelectorStats stats;
+    do
+        stats.on_blocking_wakeup();
+    while(process_message(sockfd, message, msize, stats, true));
+
+    std::lock_guard<std::mutex> lock(*stats_lock);
+    *total_stats += stats;
+}
+
+void add_run_stats(const SelectorStats & sel_stats, const ThreadCounters & counters, int msize) {
+    unsigned long messages = test_options.framed ? sel_stats.frames : sel_stats.bytes_out / msize;
+    last_run_stats = StatsList();
+    last_run_stats.add("messages", messages);
+    sel_stats.add_to(last_run_stats, "sel_");
+    counters.add_to(last_run_stats, "perf_", messages);
+    if (0 != messages)
+        last_run_stats.add("sel_syscalls_per_msg", (double)sel_stats.syscalls / messages);
+    // idle connections show up here: poll scans all of them per wakeup
+    if (0 != sel_stats.wait_calls)
+        last_run_stats.add("sel_cpu_ns_per_wakeup",
+                           (double)(counters.utime_us + counters.stime_us) * 1000 / sel_stats.wait_calls);
+    if (0 != messages and 0 != sel_stats.service_ns)
+        last_run_stats.add("service_avg_ns", sel_stats.service_ns / messages);
+
+    if (tcp_info_sampler.running()) {
+        tcp_info_sampler.stop();
+        tcp_info_sampler.add_to(last_run_stats);
+    }
+
+    conn_mem.add_to(last_run_stats, conn_mem_count);
+    conn_mem_count = 0;
+
+    if (test_options.rt.enabled)
+        add_rt_report(last_run_stats, rt_sched_ok);
+}
+
+// memory cost of thread per connection engines. Kernel values are
+// system wide, so they are only meaningful on otherwise idle host.
+struct ThreadsMemProbe {
+    long rss_start, kstack_start, slab_start;
+    long rss_ready, kstack_ready, slab_ready;
+    long rss_done;
+
+    void start() {
+        rss_start = process_rss_bytes();
+        kstack_start = meminfo_bytes("KernelStack");
+        slab_start = meminfo_bytes("SUnreclaim");
+    }
+
+    // all threads are created
+    void ready() {
+        rss_ready = process_rss_bytes();
+        kstack_ready = meminfo_bytes("KernelStack");
+        slab_ready = meminfo_bytes("SUnreclaim");
+    }
+
+    void done() {
+        rss_done = process_rss_bytes();
+    }
+
+    void add_to(StatsList & stats, long count) const {
+        if (0 == count)
+            return;
+        stats.add("mem_rss_per_conn", (double)(rss_ready - rss_start) / count);
+        stats.add("mem_rss_after_run_per_conn", (double)(rss_done - rss_start) / count);
+        stats.add("mem_kernel_stack_per_conn", (double)(kstack_ready - kstack_start) / count);
+        stats.add("mem_kernel_slab_per_conn", (double)(slab_ready - slab_start) / count);
+    }
+};
+
+extern "C"
+int run_test_th(const char * ip,
+                const int port,
+                const int th_count,
+                int msize,
+                int listen_queue,
+                void (*ready_for_connect)(),
+                void (*preparation_done)(),
+                void (*test_done)())
+{
+    RtScope rt_scope(msize);
+    char message[msize];
+    std::memset(message, 'X', msize);
+
+    FDList sockets;
+    std::vector<std::thread> threads;
+    std::mutex stats_lock;
+    SelectorStats total_stats;
+    std::function<void(int)> cb = [&](int sock){
+        threads.emplace_back(th_func, sock, &message[0], msize,
+                             &stats_lock, &total_stats);
+    };
+
+    // threads are blocked in recv until loader starts the test,
+    // so they add next to nothing to counters before preparation_done
+    ThreadCounters counters;
+    PerfCounters perf(&counters, true);
+    ThreadsMemProbe mem;
+    mem.start();
+
+    if (not wait_for_conn(th_count,
+                          sockets.fds,
+                          ip,
+                          port,
+                          listen_queue,
+                          ready_for_connect,
+                          &cb,
+                          false))
+        return 1;
+
+    mem.ready();
+
+    if (nullptr != preparation_done)
+        preparation_done();
+
+    perf.start();
+
+    for(auto & th: threads)
+        th.join();
+
+    perf.stop();
+    mem.done();
+
+    if (nullptr != test_done)
+        test_done();
+
+    add_run_stats(total_stats, counters, msize);
+    mem.add_to(last_run_stats, th_count);
+    return 0;
+}
+
+// stacks for all threads in one mmap, each stack has PROT_NONE guard page below
+class ThreadStacksArena {
+protected:
+    char * base;
+    size_t slot_size, map_size;
+
+private:
+    ThreadStacksArena(const ThreadStacksArena &);
+
+public:
+    size_t stack_size, page_size;
+
+    ThreadStacksArena(): base(nullptr), slot_size(0), map_size(0), stack_size(0), page_size(0) {}
+    ~ThreadStacksArena() {
+        if (nullptr != base)
+            munmap(base, map_size);
+    }
+
+    bool alloc(size_t count, size_t _stack_size, bool guard) {
+        page_size = sysconf(_SC_PAGESIZE);
+        stack_size = (_stack_size + page_size - 1) / page_size * page_size;
+        slot_size = stack_size + (guard ? page_size : 0);
+        map_size = slot_size * count;
+
+        // every guard page splits mapping into one more VMA
+        if (guard) {
+            long max_map_count = 65530;
+            std::ifstream("/proc/sys/vm/max_map_count") >> max_map_count;
+            if ((long)count * 2 + 1000 > max_map_count) {
+                std::cerr << "vm.max_map_count = " << max_map_count << " is too small for ";
+                std::cerr << count << " guard pages, raise it or use th_guard=0\n";
+                return false;
+            }
+        }
+
+        void * mem = mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (MAP_FAILED == mem) {
+            std::perror("mmap(stacks arena)");
+            return false;
+        }
+        base = (char *)mem;
+
+        if (guard)
+            for(size_t i = 0; i < count; ++i)
+                if (0 != mprotect(base + i * slot_size, page_size, PROT_NONE)) {
+                    std::perror("mprotect(guard page)");
+                    return false;
+                }
+        return true;
+    }
+
+    // lowest address of stack #idx
+    void * stack(size_t idx) const {
+        return base + idx * slot_size + (slot_size - stack_size);
+    }
+};
+
+struct SmallThreadArgs {
+    int sockfd;
+    const char * message;
+    int msize;
+    std::mutex * stats_lock;
+    SelectorStats * total_stats;
+};
+
+void * small_th_func(void * arg) {
+    auto args = (SmallThreadArgs *)arg;
+    th_func(args->sockfd, args->message, args->msize, args->stats_lock, args->total_stats);
+    return nullptr;
+}
+
+// thread per connection with small preallocated stacks, to get past
+// ~30k threads of run_test_th, where every thread has default multi-MB stack.
+// Options: th_stack_kb=32 - stack size, extended to fit message buffer,
+//          th_guard=1 - guard page below every stack
+extern "C"
+int run_test_th_small(const char * ip,
+                      const int port,
+                      const int th_count,
+                      int msize,
+                      int listen_queue,
+                      void (*ready_for_connect)(),
+                      void (*preparation_done)(),
+                      void (*test_done)())
+{
+    RtScope rt_scope(msize);
+    long stack_kb = 32, guard = 1;
+    if (not opt_long(test_options.opts, "th_stack_kb", stack_kb) or
+        not opt_long(test_options.opts, "th_guard", guard))
+        return 1;
+
+    // process_message keeps message on stack
+    size_t stack_size = std::max((size_t)stack_kb * 1024, (size_t)msize + 16 * 1024);
+    stack_size = std::max(stack_size, (size_t)PTHREAD_STACK_MIN);
+
+    char message[msize];
+    std::memset(message, 'X', msize);
+
+    ThreadCounters counters;
+    PerfCounters perf(&counters, true);
+    ThreadsMemProbe mem;
+    mem.start();
+
+    ThreadStacksArena arena;
+    if (not arena.alloc(th_count, stack_size, 0 != guard))
+        return 1;
+
+    FDList sockets;
+    std::vector<pthread_t> threads;
+    std::vector<SmallThreadArgs> args;
+    threads.reserve(th_count);
+    args.reserve(th_count);
+
+    std::mutex stats_lock;
+    SelectorStats total_stats;
+    bool failed = false;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    std::function<void(int)> cb = [&](int sock){
+        if (failed)
+            return;
+
+        if (0 != pthread_attr_setstack(&attr, arena.stack(threads.size()), arena.stack_size)) {
+            std::perror("pthread_attr_setstack");
+            failed = true;
+            return;
+        }
+
+        args.push_back(SmallThreadArgs{sock, &message[0], msize, &stats_lock, &total_stats});
+        pthread_t th;
+        int err = pthread_create(&th, &attr, small_th_func, &args.back());
+        if (0 != err) {
+            std::cerr << "pthread_create failed after " << threads.size();
+            std::cerr << " threads: " << std::strerror(err) << "\n";
+            failed = true;
+            return;
+        }
+        threads.push_back(th);
+    };
+
+    bool connected = wait_for_conn(th_count, sockets.fds, ip, port, listen_queue,
+                                   ready_for_connect, &cb, false);
+    pthread_attr_destroy(&attr);
+
+    // threads exit when their sockets are closed
+    if (not connected or failed) {
+        for(int fd: sockets.fds)
+            shutdown(fd, SHUT_RDWR);
+        for(auto th: threads)
+            pthread_join(th, nullptr);
+        return 1;
+    }
+
+    mem.ready();
+
+    if (nullptr != preparation_done)
+        preparation_done();
+
+    perf.start();
+
+    for(auto th: threads)
+        pthread_join(th, nullptr);
+
+    perf.stop();
+    mem.done();
+
+    if (nullptr != test_done)
+        test_done();
+
+    add_run_stats(total_stats, counters, msize);
+    last_run_stats.add("th_stack_size", (unsigned long)arena.stack_size);
+    last_run_stats.add("th_guard", (unsigned long)guard);
+    mem.add_to(last_run_stats, th_count);
+    return 0;
+}
+
+// bounded lock-free multi producer multi consumer queue (D. Vyukov).
+// Every cell has sequence number, which tells whether the cell is free for
+// producer of position pos (seq == pos) or ready for consumer (seq == pos + 1).
+template<class T>
+class MPMCQueue {
+protected:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) std::atomic<size_t> dequeue_pos;
+
+public:
+    MPMCQueue(size_t min_size): enqueue_pos(0), dequeue_pos(0) {
+        size_t size = 2;
+        while(size < min_size)
+            size *= 2;
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for(size_t i = 0; i < size; ++i)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const T & data) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for(;;) {
+            Cell & cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (0 == diff) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = data;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T & data) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        for(;;) {
+            Cell & cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (0 == diff) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    data = cell.data;
+                    cell.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // empty
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// service_workers=N: I/O thread reads requests and pushes them to workers,
+// workers push served requests back and wake I/O thread via eventfd, I/O
+// thread sends replies. work_efd is a semaphore with one token per queued
+// request, so idle workers sleep in read(2). Queues hold one request per
+// connection, so they never overflow.
+struct ServiceRequest {
+    int sockfd;
+    unsigned long queued_at, done_at;
+};
+
+struct alignas(64) ServiceWorkerStats {
+    unsigned long requests;
+    unsigned long queue_ns, queue_max_ns;
+    unsigned long service_ns;
+};
+
+class ServicePool {
+protected:
+    MPMCQueue<ServiceRequest> requests, replies;
+    int work_efd, done_efd;
+    int pending;
+    std::atomic_bool stopped;
+    std::vector<std::thread> threads;
+    std::vector<ServiceWorkerStats> worker_stats;
+    unsigned long reply_count, reply_ns;
+
+    void worker(ServiceWorkerStats * wstats, ServiceModel model) {
+        for(;;) {
+            uint64_t token;
+            if (sizeof(token) != read(work_efd, &token, sizeof(token))) {
+                if (EINTR == errno)
+                    continue;
+                std::perror("read(work_efd, ...)");
+                return;
+            }
+
+            if (stopped.load())
+                return;
+
+            ServiceRequest req;
+            if (not requests.pop(req))
+                continue;
+
+            unsigned long started_at = get_fast_time();
+            unsigned long queue_ns = started_at - req.queued_at;
+            wstats->queue_ns += queue_ns;
+            wstats->queue_max_ns = std::max(wstats->queue_max_ns, queue_ns);
+            wstats->service_ns += serve_request(model);
+            ++wstats->requests;
+
+            req.done_at = get_fast_time();
+            replies.push(req);
+
+            uint64_t one = 1;
+            if (sizeof(one) != write(done_efd, &one, sizeof(one)))
+                std::perror("write(done_efd, ...)");
+        }
+    }
+
+public:
+    ServicePool(size_t max_requests):
+        requests(max_requests), replies(max_requests), work_efd(-1), done_efd(-1),
+        pending(0), stopped(false), reply_count(0), reply_ns(0) {}
+
+    ~ServicePool() {
+        stop();
+        if (-1 != work_efd)
+            close(work_efd);
+        if (-1 != done_efd)
+            close(done_efd);
+    }
+
+    bool start(const ServiceModel & model) {
+        work_efd = eventfd(0, EFD_SEMAPHORE);
+        done_efd = eventfd(0, EFD_NONBLOCK);
+        if (-1 == work_efd or -1 == done_efd) {
+            std::perror("eventfd(...)");
+            return false;
+        }
+
+        worker_stats.resize(model.workers, ServiceWorkerStats());
+        for(int i = 0; i < model.workers; ++i)
+            threads.emplace_back(&ServicePool::worker, this, &worker_stats[i], model);
+        return true;
+    }
+
+    void stop() {
+        if (threads.empty())
+            return;
+        stopped.store(true);
+        uint64_t tokens = threads.size();
+        if (sizeof(tokens) != write(work_efd, &tokens, sizeof(tokens)))
+            std::perror("write(work_efd, ...)");
+        for(auto & th: threads)
+            th.join();
+        threads.clear();
+    }
+
+    int done_fd() const {
+        return done_efd;
+    }
+
+    bool submit(int sockfd) {
+        if (not requests.push(ServiceRequest{sockfd, get_fast_time(), 0})) {
+            std::cerr << "Service queue overflow\n";
+            return false;
+        }
+        ++pending;
+        return true;
+    }
+
+    // wake workers for all requests, submitted since last call
+    bool notify() {
+        if (0 == pending)
+            return true;
+        uint64_t tokens = pending;
+        pending = 0;
+        if (sizeof(tokens) != write(work_efd, &tokens, sizeof(tokens))) {
+            std::perror("write(work_efd, ...)");
+            return false;
+        }
+        return true;
+    }
+
+    // on_reply(sockfd) for every served request
+    template<class F>
+    void collect(F && on_reply) {
+        uint64_t count;
+        if (sizeof(count) != read(done_efd, &count, sizeof(count)) and EAGAIN != errno)
+            std::perror("read(done_efd, ...)");
+
+        ServiceRequest req;
+        while(replies.pop(req)) {
+            on_reply(req.sockfd);
+            reply_ns += get_fast_time() - req.done_at;
+            ++reply_count;
+        }
+    }
+
+    ServiceWorkerStats total() const {
+        ServiceWorkerStats res = ServiceWorkerStats();
+        for(auto & wstats: worker_stats) {
+            res.requests += wstats.requests;
+            res.queue_ns += wstats.queue_ns;
+            res.queue_max_ns = std::max(res.queue_max_ns, wstats.queue_max_ns);
+            res.service_ns += wstats.service_ns;
+        }
+        return res;
+    }
+
+    // service time itself is in SelectorStats::service_ns, as for inline mode
+    void add_to(StatsList & res) const {
+        ServiceWorkerStats total = this->total();
+        res.add("service_workers", (unsigned long)worker_stats.size());
+        if (0 != total.requests) {
+            res.add("service_queue_avg_ns", total.queue_ns / total.requests);
+            res.add("service_queue_max_ns", total.queue_max_ns);
+        }
+        if (0 != reply_count)
+            res.add("service_reply_avg_ns", reply_ns / reply_count);
+    }
+};
+
+// Selector is EPollRSelector or PollRSelector, both are final, so per event
+// calls aren't virtual. Instantiations for run_test_* are listed below.
+template<class Selector>
+int run_test(Selector & selector,
+             const char * ip,
+             const int port,
+             const int th_count,
+             const int msize,
              const int listen_queue,
              void (*ready_for_connect)(),
              void (*preparation_done)(),
@@ -243,6 +1386,7 @@ int run_test(RSelector & selector,
     int fd_left = th_count;
     char message[msize];
     std::memset(message, 'X', msize);
+    char buffer[msize];
     FDList sockets;
 
     if (not wait_for_conn(th_count, sockets.fds, ip, port, listen_queue, ready_for_connect, nullptr, false))
@@ -252,9 +1396,20 @@ int run_test(RSelector & selector,
         if (not selector.add_fd(sockfd))
             return 1;
 
+    const bool offload = 0 != test_options.service.workers;
+    ServicePool pool(th_count);
+    if (offload and (not pool.start(test_options.service) or not selector.add_fd(pool.done_fd())))
+        return 1;
+
+    ThreadCounters counters;
+    PerfCounters perf(&counters);
+
     if (nullptr != preparation_done)
         preparation_done();
 
+    selector.stats.clear();
+    perf.start();
+
     while(fd_left > 0) {
         if (not selector.wait())
             return 1;
@@ -264,14 +1419,25 @@ int run_test(RSelector & selector,
         while(selector.next(sockfd, events)) {
             bool close_sock = false;
 
+            if (offload and pool.done_fd() == sockfd) {
+                // closed socket is found by POLLHUP/recv, so errors are ignored
+                pool.collect([&](int reply_fd) {
+                    send_message(reply_fd, message, msize, selector.stats);
+                });
+                continue;
+            }
+
             if ((events & POLLHUP) or (events & POLLERR)) {
                 close_sock = true;
             } else if (events & POLLNVAL) {
                 std::cerr << "Poll - POLLNVAL for fd " << sockfd;
                 std::cerr << " val " << events << "\n";
                 close_sock = true;
+            } else if (events & POLLIN and offload) {
+                int got = recv_message(sockfd, buffer, msize, selector.stats);
+                close_sock = (0 > got) or (0 < got and not pool.submit(sockfd));
             } else if (events & POLLIN) {
-                close_sock = not process_message(sockfd, message, msize);
+                close_sock = not process_message(sockfd, message, msize, selector.stats);
             } else if (0 != events) {
                 std::cerr << "Poll - ??? for fd " << sockfd;
                 std::cerr << " val " << events << "\n";
@@ -283,14 +1449,29 @@ int run_test(RSelector & selector,
                 --fd_left;
             }
         }
+
+        if (offload and not pool.notify())
+            return 1;
     }
 
+    perf.stop();
+    pool.stop();
+
     if (nullptr != test_done)
         test_done();
 
+    selector.stats.service_ns += pool.total().service_ns;
+    add_run_stats(selector.stats, counters, msize);
+    if (offload)
+        pool.add_to(last_run_stats);
     return 0;
 }
 
+template int run_test<EPollRSelector>(EPollRSelector &, const char *, const int, const int, const int,
+                                      const int, void (*)(), void (*)(), void (*)());
+template int run_test<PollRSelector>(PollRSelector &, const char *, const int, const int, const int,
+                                     const int, void (*)(), void (*)(), void (*)());
+
 extern "C"
 int run_test_epoll(const char * ip,
                    const int port,
@@ -301,6 +1482,7 @@ int run_test_epoll(const char * ip,
                    void (*preparation_done)(),
                    void (*test_done)())
 {
+    RtScope rt_scope(msize);
     EPollRSelector eps(th_count);
     if (not eps.ok())
         return 1;
@@ -319,10 +1501,1313 @@ int run_test_poll(const char * ip,
                   void (*preparation_done)(),
                   void (*test_done)())
 {
-    PollRSelector eps(th_count);
+    RtScope rt_scope(msize);
+    PollRSelector eps(th_count + 1); // + service pool eventfd
     return run_test(eps, ip, port, th_count, msize, listen_queue, ready_for_connect, preparation_done, test_done);
 }
 
+// main.py --sweep: loader keeps connections between sweep steps and only
+// adds or closes the difference, so the responder accepts connections for
+// the whole run. Control thread calls sweep_step between steps, when loader
+// is idle, to take stats of the finished step and set message size and
+// TCP_NODELAY of the next one. Run ends when the last connection is closed.
+struct SweepControl {
+    std::mutex lock;
+    std::condition_variable step_done;
+    std::atomic_bool requested, aborted;
+    bool done;
+    int next_msize, next_nodelay;
+    std::string stats;
+
+    SweepControl(): requested(false), aborted(false), done(false), next_msize(0), next_nodelay(-1) {}
+};
+
+SweepControl sweep_control;
+
+// control session failed, stop run_test_sweep without waiting for loader
+extern "C"
+void sweep_abort() {
+    sweep_control.aborted.store(true);
+}
+
+extern "C"
+int sweep_step(int next_msize, int next_nodelay, char * buff, int buff_size) {
+    std::unique_lock<std::mutex> guard(sweep_control.lock);
+    sweep_control.next_msize = next_msize;
+    sweep_control.next_nodelay = next_nodelay;
+    sweep_control.done = false;
+    sweep_control.requested.store(true);
+
+    if (not sweep_control.step_done.wait_for(guard, std::chrono::seconds(10), [] { return sweep_control.done; })) {
+        std::cerr << "sweep_step: responder doesn't answer\n";
+        return -1;
+    }
+
+    const std::string & out = sweep_control.stats;
+    if ((int)out.size() < buff_size)
+        std::memcpy(buff, out.c_str(), out.size() + 1);
+    return out.size();
+}
+
+extern "C"
+int run_test_sweep(const char * ip,
+                   const int port,
+                   const int th_count,
+                   int msize,
+                   int listen_queue,
+                   void (*ready_for_connect)(),
+                   void (*preparation_done)(),
+                   void (*test_done)())
+{
+    RtScope rt_scope(msize);
+    (void)ip;
+
+    if (0 != test_options.service.workers or 1 != test_options.conn.ports) {
+        std::cerr << "sweep doesn't support service_workers and ports\n";
+        return 1;
+    }
+
+    int master_sock = listen_socket(port, listen_queue);
+    if (-1 == master_sock)
+        return 1;
+
+    FDCloser _master_sock(master_sock);
+    if (not init_conn_state())
+        return 1;
+
+    EPollRSelector selector(th_count + 1);
+    if (not selector.ok() or not selector.add_fd(master_sock, EPOLLIN))
+        return 1;
+
+    std::vector<char> message(msize, 'X');
+    std::set<int> conns;
+    bool had_conns = false;
+    sweep_control.requested.store(false);
+    sweep_control.aborted.store(false);
+
+    ThreadCounters counters;
+    std::unique_ptr<PerfCounters> perf(new PerfCounters(&counters));
+
+    if (nullptr != ready_for_connect)
+        ready_for_connect();
+    if (nullptr != preparation_done)
+        preparation_done();
+
+    selector.stats.clear();
+    perf->start();
+
+    while((not had_conns or not conns.empty()) and not sweep_control.aborted.load()) {
+        if (not selector.wait(50L * 1000 * 1000))
+            return 1;
+
+        uint32_t events;
+        int sockfd;
+        while(selector.next(sockfd, events)) {
+            if (master_sock == sockfd) {
+                int client_sock = accept4(master_sock, nullptr, nullptr, SOCK_NONBLOCK);
+                if (client_sock < 0) {
+                    if (EAGAIN != errno and EWOULDBLOCK != errno) {
+                        perror("accept failed");
+                        return 1;
+                    }
+                    continue;
+                }
+                if (not on_conn_accepted(client_sock) or not selector.add_fd(client_sock)) {
+                    close(client_sock);
+                    return 1;
+                }
+                conns.insert(client_sock);
+                had_conns = true;
+                continue;
+            }
+
+            bool close_sock = false;
+            if ((events & EPOLLHUP) or (events & EPOLLERR))
+                close_sock = true;
+            else if (events & EPOLLIN)
+                close_sock = not process_message(sockfd, &message[0], message.size(), selector.stats);
+
+            if (close_sock) {
+                selector.remove_current_ready();
+                conns.erase(sockfd);
+                close(sockfd);
+            }
+        }
+
+        if (sweep_control.requested.load()) {
+            std::lock_guard<std::mutex> guard(sweep_control.lock);
+            perf.reset();
+            add_run_stats(selector.stats, counters, message.size());
+            last_run_stats.add("connections", (unsigned long)conns.size());
+            sweep_control.stats.clear();
+            last_run_stats.serialize(sweep_control.stats);
+
+            message.assign(sweep_control.next_msize, 'X');
+            test_options.nodelay = sweep_control.next_nodelay;
+            if (-1 != test_options.nodelay)
+                for(int fd: conns)
+                    set_nodelay(fd, test_options.nodelay);
+
+            selector.stats.clear();
+            counters.clear();
+            perf.reset(new PerfCounters(&counters));
+            perf->start();
+
+            sweep_control.done = true;
+            sweep_control.requested.store(false);
+            sweep_control.step_done.notify_one();
+        }
+    }
+
+    perf.reset();
+    if (nullptr != test_done)
+        test_done();
+
+    add_run_stats(selector.stats, counters, message.size());
+    return 0;
+}
+
+// L4 relay: loader <-> relay <-> responder. Every loader connection gets own
+// upstream connection, bytes are forwarded as they come, without message
+// framing - via user space buffer (relay_mode=copy) or socket -> pipe -> socket
+// with splice(2) (relay_mode=splice). Sockets are non blocking and splice gets
+// SPLICE_F_NONBLOCK, so drained socket gives EAGAIN and 0 is EOF only.
+// Without relay_upstream=IP:PORT epoll responder is started in a separated
+// thread on BIND_PORT + 1, so whole chain runs on loopback.
+// Bytes, which peer doesn't accept, stay pending - in the pipe for splice, in
+// pending_data for copy. Source isn't read till they are written on peer's
+// EPOLLOUT, so one slow direction never blocks the loop.
+struct RelayState {
+    bool use_splice;
+    int chunk;
+    std::vector<char> buffer;
+    // indexed by fd
+    std::vector<int> peers;
+    std::vector<char> is_upstream;
+    // time, when request was forwarded upstream, 0 if there is no request in flight
+    std::vector<unsigned long> sent_at;
+    // bytes read from fd, not written to its peer yet
+    std::vector<int> pending;
+    std::vector<std::vector<char>> pending_data;
+    std::vector<char> closed;
+    // sources to read again: pending bytes are written or dropped
+    std::vector<int> resume;
+    // upstreams of closed clients, closed with RST
+    std::vector<int> aborts;
+
+    unsigned long upstream_rtt_sum_ns, upstream_rtt_count, upstream_rtt_max_ns;
+    SelectorStats stats;
+
+    RelayState(bool _use_splice, int _chunk):
+        use_splice(_use_splice), chunk(_chunk), buffer(_chunk),
+        upstream_rtt_sum_ns(0), upstream_rtt_count(0), upstream_rtt_max_ns(0) {}
+
+    void add_pair(int client, int upstream) {
+        int max_fd = std::max(client, upstream);
+        if (max_fd >= (int)peers.size()) {
+            peers.resize(max_fd + 1, -1);
+            is_upstream.resize(max_fd + 1, 0);
+            sent_at.resize(max_fd + 1, 0);
+            pending.resize(max_fd + 1, 0);
+            pending_data.resize(max_fd + 1);
+            closed.resize(max_fd + 1, 0);
+        }
+        peers[client] = upstream;
+        peers[upstream] = client;
+        is_upstream[upstream] = 1;
+    }
+
+    // loader FIN must be seen while its reads are paused on pending bytes
+    int events(int sockfd) const {
+        return EPOLLIN | EPOLLET | (is_upstream[sockfd] ? 0 : (int)EPOLLRDHUP);
+    }
+
+    void on_forwarded(int from) {
+        if (is_upstream[from]) {
+            int client = peers[from];
+            if (-1 == client or 0 == sent_at[client])
+                return;
+            unsigned long rtt = get_fast_time() - sent_at[client];
+            upstream_rtt_sum_ns += rtt;
+            upstream_rtt_max_ns = std::max(upstream_rtt_max_ns, rtt);
+            ++upstream_rtt_count;
+            sent_at[client] = 0;
+        } else if (0 == sent_at[from]) {
+            sent_at[from] = get_fast_time();
+        }
+    }
+
+    // write up to left bytes of from to its peer - from pipe of from with
+    // splice, else from data. Returns written count, -1 on error
+    int write_to_peer(int from, const char * data, int left) {
+        const int peer = peers[from];
+        int written = 0;
+        while(written < left) {
+            int sent;
+            if (use_splice)
+                sent = splice(echo_pipes.get(from)[0], nullptr, peer, nullptr, left - written,
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            else
+                sent = write(peer, data + written, left - written);
+
+            ++stats.syscalls;
+            if (0 > sent and (EAGAIN == errno or EWOULDBLOCK == errno)) {
+                ++stats.write_eagain;
+                break;
+            }
+            if (0 >= sent) {
+                if (EPIPE != errno and ECONNRESET != errno)
+                    std::perror("relay: write to peer");
+                return -1;
+            }
+            stats.bytes_out += sent;
+            written += sent;
+        }
+        return written;
+    }
+
+    // forward all available bytes from sockfd to its peer, false on EOF or error
+    bool forward(int sockfd, EPollRSelector & selector) {
+        // read again, when peer takes pending bytes
+        if (0 != pending[sockfd])
+            return true;
+
+        for(;;) {
+            const int peer = peers[sockfd];
+            // data for closed peer is dropped, pipe is not used for it
+            const bool splice_it = use_splice and -1 != peer;
+
+            int bc;
+            if (splice_it)
+                bc = splice(sockfd, nullptr, echo_pipes.get(sockfd)[1], nullptr, chunk,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            else
+                bc = recv(sockfd, &buffer[0], chunk, MSG_DONTWAIT);
+
+            ++stats.syscalls;
+            if (0 > bc) {
+                if (EAGAIN == errno or EWOULDBLOCK == errno) {
+                    ++stats.recv_eagain;
+                    return true;
+                }
+                if (ECONNRESET != errno)
+                    std::perror("relay: read from socket");
+                return false;
+            } else if (0 == bc) {
+                return false;
+            }
+            stats.bytes_in += bc;
+
+            if (-1 == peer)
+                continue;
+
+            on_forwarded(sockfd);
+
+            int sent = write_to_peer(sockfd, &buffer[0], bc);
+            if (0 > sent)
+                return false;
+            if (sent < bc) {
+                if (not use_splice)
+                    pending_data[sockfd].assign(buffer.begin() + sent, buffer.begin() + bc);
+                pending[sockfd] = bc - sent;
+                return selector.modify_fd(peer, events(peer) | EPOLLOUT);
+            }
+        }
+    }
+
+    // EPOLLOUT on sockfd - write pending bytes of its source, false on error
+    bool on_writable(int sockfd, EPollRSelector & selector) {
+        const int from = peers[sockfd];
+        if (-1 == from or 0 == pending[from])
+            return true;
+
+        const auto & data = pending_data[from];
+        int sent = write_to_peer(from, use_splice ? nullptr : &data[data.size() - pending[from]], pending[from]);
+        if (0 > sent)
+            return false;
+        pending[from] -= sent;
+        if (0 != pending[from])
+            return true;
+
+        resume.push_back(from);
+        return selector.modify_fd(sockfd, events(sockfd));
+    }
+
+    // connection is done from sockfd side. Responder gets RST, as loader
+    // close gives it on direct connection: responders read one message per
+    // EPOLLET edge, so FIN after pipelined requests would never be seen.
+    // Loader gets FIN.
+    void close_side(int sockfd) {
+        int peer = peers[sockfd];
+        if (-1 != peer) {
+            if (is_upstream[sockfd])
+                shutdown(peer, SHUT_WR);
+            else
+                aborts.push_back(peer);
+            peers[peer] = -1;
+
+            // bytes for sockfd are dropped, peer is read again
+            if (0 != pending[peer]) {
+                pending[peer] = 0;
+                resume.push_back(peer);
+            }
+        }
+        peers[sockfd] = -1;
+        pending[sockfd] = 0;
+        closed[sockfd] = 1;
+    }
+};
+
+bool relay_connect_upstream(const sockaddr_in & addr, int count, std::vector<int> & sockets) {
+    for(int i = 0; i < count; ++i) {
+        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (-1 == sockfd) {
+            std::perror("socket(AF_INET, SOCK_STREAM, 0)");
+            return false;
+        }
+        sockets.push_back(sockfd);
+
+        if (0 != connect(sockfd, (const sockaddr *)&addr, sizeof(addr))) {
+            std::perror("relay: connect to upstream");
+            return false;
+        }
+
+        if (not set_nodelay(sockfd))
+            return false;
+
+        if (0 > fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK)) {
+            std::perror("fcntl(sockfd, F_SETFL, O_NONBLOCK)");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parse_ip_port(const std::string & addr, sockaddr_in & res) {
+    auto pos = addr.rfind(':');
+    std::memset(&res, 0, sizeof(res));
+    res.sin_family = AF_INET;
+
+    if (std::string::npos == pos or
+            1 != inet_pton(AF_INET, addr.substr(0, pos).c_str(), &res.sin_addr)) {
+        std::cerr << "Can't parse '" << addr << "' as IP:PORT\n";
+        return false;
+    }
+    res.sin_port = htons(std::atoi(addr.c_str() + pos + 1));
+    return true;
+}
+
+extern "C"
+int run_test_relay(const char * ip,
+                   const int port,
+                   const int th_count,
+                   int msize,
+                   int listen_queue,
+                   void (*ready_for_connect)(),
+                   void (*preparation_done)(),
+                   void (*test_done)())
+{
+    RtScope rt_scope(msize);
+    if (TRANSPORT_TCP != test_options.transport) {
+        std::cerr << "relay supports only transport=tcp\n";
+        return 1;
+    }
+
+    std::string mode = "copy";
+    std::string upstream;
+    opt_str(test_options.opts, "relay_mode", mode);
+    opt_str(test_options.opts, "relay_upstream", upstream);
+
+    if ("copy" != mode and "splice" != mode) {
+        std::cerr << "Unknown relay_mode '" << mode << "'\n";
+        return 1;
+    }
+
+    const bool use_splice = ("splice" == mode);
+    RelayState relay(use_splice, std::max(msize, 64 * 1024));
+
+    sockaddr_in upstream_addr;
+    std::thread responder;
+    std::atomic<int> responder_rv(0);
+    std::atomic<bool> responder_done(false);
+
+    if (upstream.empty()) {
+        upstream = "127.0.0.1:" + std::to_string(port + 1);
+        relay_upstream_listening = false;
+        relay_upstream_listener = -1;
+        responder = std::thread([&]() {
+            EPollRSelector eps(th_count);
+            responder_rv = eps.ok() ? run_test(eps, ip, port + 1, th_count, msize, listen_queue,
+                                               on_relay_upstream_listen, nullptr, nullptr) : 1;
+            responder_done = true;
+        });
+
+        while(not relay_upstream_listening and not responder_done)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // responder thread must not outlive this frame
+    struct Joiner {
+        std::thread & th;
+        ~Joiner() { if (th.joinable()) th.join(); }
+    } _joiner{responder};
+
+    FDList upstream_socks, client_socks;
+
+    if (0 != responder_rv or not parse_ip_port(upstream, upstream_addr) or
+            not relay_connect_upstream(upstream_addr, th_count, upstream_socks.fds)) {
+        // in-process responder still waits in accept for the rest of upstream
+        // connections, shutdown wakes it up, so Joiner doesn't hang
+        if (responder.joinable() and not responder_done)
+            shutdown(relay_upstream_listener, SHUT_RDWR);
+        return 1;
+    }
+
+    if (not wait_for_conn(th_count, client_socks.fds, ip, port, listen_queue,
+                          ready_for_connect, nullptr, true))
+        return 1;
+
+    if (use_splice and not echo_pipes.init())
+        return 1;
+
+    EPollRSelector selector(th_count * 2);
+    if (not selector.ok())
+        return 1;
+
+    for(int i = 0; i < th_count; ++i) {
+        int client = client_socks.fds[i], up = upstream_socks.fds[i];
+        relay.add_pair(client, up);
+        for(int sockfd: {client, up}) {
+            if (not set_nodelay(sockfd) or not selector.add_fd(sockfd, relay.events(sockfd)))
+                return 1;
+            if (use_splice and not echo_pipes.open(sockfd, relay.chunk))
+                return 1;
+        }
+    }
+
+    ThreadCounters counters;
+    PerfCounters perf(&counters);
+
+    if (nullptr != preparation_done)
+        preparation_done();
+
+    selector.stats.clear();
+    perf.start();
+
+    // upstreams are closed at once with RST: responder thread is joined
+    // below and exits only when all its connections are gone
+    int fd_left = th_count * 2;
+    std::vector<char> closed_up(relay.peers.size(), 0);
+    auto close_fd = [&](int sockfd) {
+        selector.remove_fd(sockfd);
+        bool upstream = relay.is_upstream[sockfd];
+        relay.close_side(sockfd);
+        --fd_left;
+        if (upstream) {
+            linger abort = {1, 0};
+            setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+            echo_pipes.close(sockfd);
+            close(sockfd);
+            closed_up[sockfd] = 1;
+        }
+    };
+
+    while(fd_left > 0) {
+        if (not selector.wait())
+            return 1;
+
+        uint32_t events;
+        int sockfd;
+        while(selector.next(sockfd, events)) {
+            if (relay.closed[sockfd])
+                continue;
+
+            bool close_sock = (events & (EPOLLERR | EPOLLRDHUP)) or
+                              ((events & EPOLLOUT) and not relay.on_writable(sockfd, selector));
+            if (not close_sock and (events & EPOLLIN))
+                close_sock = not relay.forward(sockfd, selector);
+            else if (events & EPOLLHUP)
+                close_sock = true;
+
+            if (close_sock)
+                close_fd(sockfd);
+        }
+
+        while(not relay.resume.empty() or not relay.aborts.empty()) {
+            if (not relay.aborts.empty()) {
+                sockfd = relay.aborts.back();
+                relay.aborts.pop_back();
+                if (not relay.closed[sockfd])
+                    close_fd(sockfd);
+                continue;
+            }
+
+            sockfd = relay.resume.back();
+            relay.resume.pop_back();
+            if (not relay.closed[sockfd] and not relay.forward(sockfd, selector))
+                close_fd(sockfd);
+        }
+    }
+
+    auto & ups = upstream_socks.fds;
+    ups.erase(std::remove_if(ups.begin(), ups.end(), [&](int sockfd) { return closed_up[sockfd]; }), ups.end());
+
+    perf.stop();
+
+    if (nullptr != test_done)
+        test_done();
+
+    if (responder.joinable())
+        responder.join();
+
+    // run_test of the responder leaves own stats in last_run_stats
+    StatsList upstream_stats;
+    std::swap(upstream_stats, last_run_stats);
+
+    // every message is forwarded twice - request and reply
+    relay.stats += selector.stats;
+    relay.stats.frames = relay.upstream_rtt_count;
+    add_run_stats(relay.stats, counters, msize * 2);
+
+    unsigned long messages = relay.upstream_rtt_count;
+    last_run_stats.add("relay_splice", (unsigned long)use_splice);
+    if (0 != messages)
+        last_run_stats.add("relay_upstream_rtt_avg_ns", (double)relay.upstream_rtt_sum_ns / messages);
+    last_run_stats.add("relay_upstream_rtt_max_ns", relay.upstream_rtt_max_ns);
+
+    // relay runs in one thread, so this is forwarding capacity of one core
+    double cpu_s = (counters.utime_us + counters.stime_us) / 1E6;
+    if (cpu_s > 0) {
+        last_run_stats.add("relay_bytes_per_cpu_s", relay.stats.bytes_out / cpu_s);
+        last_run_stats.add("relay_msgs_per_cpu_s", messages / cpu_s);
+    }
+
+    for(const auto & item: upstream_stats.items)
+        last_run_stats.items.emplace_back("upstream_" + item.first, item.second);
+
+    return responder_rv;
+}
+
+// echo engine for udp mode: batch of datagrams per recvmmsg/sendmmsg.
+// udp_gso=1 - consecutive full size datagrams from same peer are echoed by
+//             one UDP_SEGMENT send
+// udp_gro=1 - kernel may coalesce datagrams on receive, they are echoed
+//             back with UDP_SEGMENT of the received segment size
+extern "C"
+int run_test_udp(const char * ip,
+                 const int port,
+                 const int th_count,
+                 int msize,
+                 int listen_queue,
+                 void (*ready_for_connect)(),
+                 void (*preparation_done)(),
+                 void (*test_done)())
+{
+    RtScope rt_scope(msize);
+    (void)ip;
+    (void)th_count;
+    (void)listen_queue;
+
+    long batch = 64, use_gso = 0, use_gro = 0, sock_buff = 4 * 1024 * 1024, idle_ms = 10000;
+    if (not opt_long(test_options.opts, "udp_batch", batch) or
+        not opt_long(test_options.opts, "udp_gso", use_gso) or
+        not opt_long(test_options.opts, "udp_gro", use_gro) or
+        not opt_long(test_options.opts, "udp_sock_buf", sock_buff) or
+        not opt_long(test_options.opts, "udp_idle_timeout_ms", idle_ms))
+        return 1;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (-1 == sock) {
+        perror("Could not create socket");
+        return 1;
+    }
+    FDCloser _sock(sock);
+
+    int enable = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+        perror("setsockopt(SO_REUSEADDR) failed");
+    set_udp_buffers(sock, sock_buff);
+
+    // end datagrams may be lost or loader may die, so silence ends the run too
+    if (idle_ms > 0) {
+        timeval idle = {idle_ms / 1000, (idle_ms % 1000) * 1000};
+        if (0 > setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle))) {
+            perror("setsockopt(SO_RCVTIMEO) failed");
+            return 1;
+        }
+    }
+
+    if (use_gro and 0 > setsockopt(sock, IPPROTO_UDP, UDP_GRO, &enable, sizeof(enable))) {
+        perror("setsockopt(UDP_GRO) failed");
+        return 1;
+    }
+
+    sockaddr_in server;
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = INADDR_ANY;
+    server.sin_port = htons(port);
+
+    if( 0 > bind(sock, (sockaddr *)&server , sizeof(server))) {
+        perror("bind failed. Error");
+        return 1;
+    }
+
+    // rt mode, before buffers are allocated
+    if (not init_conn_state())
+        return 1;
+
+    // coalesced GRO datagram may be up to 64k
+    const int slot_size = use_gro ? 64 * 1024 : msize;
+    const int ctrl_size = CMSG_SPACE(sizeof(int));
+
+    std::vector<char> buff(batch * slot_size);
+    std::vector<char> rctrl(batch * ctrl_size), sctrl(batch * ctrl_size);
+    std::vector<sockaddr_in> peers(batch);
+    std::vector<iovec> riovs(batch), siovs(batch);
+    std::vector<mmsghdr> rmsgs(batch), smsgs(batch);
+
+    std::memset(&rmsgs[0], 0, sizeof(rmsgs[0]) * batch);
+    std::memset(&smsgs[0], 0, sizeof(smsgs[0]) * batch);
+    for(int i = 0; i < batch; ++i) {
+        riovs[i].iov_base = &buff[i * slot_size];
+        riovs[i].iov_len = slot_size;
+        rmsgs[i].msg_hdr.msg_iov = &riovs[i];
+        rmsgs[i].msg_hdr.msg_iovlen = 1;
+        rmsgs[i].msg_hdr.msg_name = &peers[i];
+        smsgs[i].msg_hdr.msg_iov = &siovs[i];
+        smsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    SelectorStats stats;
+    ThreadCounters counters;
+    PerfCounters perf(&counters);
+    unsigned long segments_sent = 0, gso_sends = 0, idle_timeout = 0;
+
+    if (nullptr != ready_for_connect)
+        ready_for_connect();
+
+    if (nullptr != preparation_done)
+        preparation_done();
+
+    perf.start();
+
+    bool done = false;
+    while(not done) {
+        for(int i = 0; i < batch; ++i) {
+            rmsgs[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+            rmsgs[i].msg_hdr.msg_control = use_gro ? &rctrl[i * ctrl_size] : nullptr;
+            rmsgs[i].msg_hdr.msg_controllen = use_gro ? ctrl_size : 0;
+        }
+
+        int count = recvmmsg(sock, &rmsgs[0], batch, MSG_WAITFORONE, nullptr);
+        if (0 > count) {
+            if (EINTR == errno) {
+                ++stats.eintr;
+                continue;
+            }
+            if (EAGAIN == errno or EWOULDBLOCK == errno) {
+                std::cerr << "No datagrams for " << idle_ms << "ms, end of run\n";
+                idle_timeout = 1;
+                break;
+            }
+            std::perror("recvmmsg(sock, ...)");
+            return 1;
+        }
+        stats.on_wakeup(count);
+
+        int to_send = 0;
+        for(int i = 0; i < count; ++i) {
+            const msghdr & hdr = rmsgs[i].msg_hdr;
+            unsigned int len = rmsgs[i].msg_len;
+            stats.bytes_in += len;
+
+            if (len >= sizeof(UdpHeader)) {
+                UdpHeader uhdr;
+                std::memcpy(&uhdr, riovs[i].iov_base, sizeof(uhdr));
+                if (UDP_END_FLOW == uhdr.flow) {
+                    done = true;
+                    continue;
+                }
+            }
+
+            int segment = len;
+            if (use_gro)
+                for(cmsghdr * cmsg = CMSG_FIRSTHDR(&hdr); nullptr != cmsg; cmsg = CMSG_NXTHDR((msghdr *)&hdr, cmsg))
+                    if (SOL_UDP == cmsg->cmsg_level and UDP_GRO == cmsg->cmsg_type)
+                        std::memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+
+            // slots are contiguous when GRO is off, so next datagrams
+            // from the same peer can be glued into one GSO send
+            int segments = 1;
+            if (use_gso and not use_gro and (int)len == msize)
+                while(i + segments < count and
+                      segments < UDP_MAX_SEGMENTS and
+                      (int)rmsgs[i + segments].msg_len == msize and
+                      0 == std::memcmp(&peers[i], &peers[i + segments], sizeof(peers[i])))
+                    ++segments;
+
+            iovec & iov = siovs[to_send];
+            msghdr & shdr = smsgs[to_send].msg_hdr;
+            iov.iov_base = riovs[i].iov_base;
+            iov.iov_len = len;
+            shdr.msg_name = &peers[i];
+            shdr.msg_namelen = rmsgs[i].msg_hdr.msg_namelen;
+            shdr.msg_control = nullptr;
+            shdr.msg_controllen = 0;
+
+            if (segments > 1) {
+                iov.iov_len = segments * msize;
+                for(int j = 1; j < segments; ++j)
+                    stats.bytes_in += rmsgs[i + j].msg_len;
+                i += segments - 1;
+            } else if (segment < (int)len) {
+                segments = (len + segment - 1) / segment;
+            }
+
+            if (segments > 1) {
+                shdr.msg_control = &sctrl[to_send * ctrl_size];
+                shdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                cmsghdr * cmsg = CMSG_FIRSTHDR(&shdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t gso_size = (segment < (int)len ? segment : msize);
+                std::memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+                ++gso_sends;
+            }
+
+            segments_sent += segments;
+            ++to_send;
+        }
+
+        for(int sent = 0; sent < to_send;) {
+            int rv = sendmmsg(sock, &smsgs[sent], to_send - sent, 0);
+            ++stats.syscalls;
+            if (0 > rv) {
+                if (EINTR == errno) {
+                    ++stats.eintr;
+                    continue;
+                }
+                // datagram is lost, loader would notice it
+                if (EAGAIN == errno or EWOULDBLOCK == errno or ENOBUFS == errno) {
+                    ++stats.write_eagain;
+                    ++sent;
+                    continue;
+                }
+                std::perror("sendmmsg(sock, ...)");
+                return 1;
+            }
+            for(int i = sent; i < sent + rv; ++i)
+                stats.bytes_out += siovs[i].iov_len;
+            sent += rv;
+        }
+    }
+
+    perf.stop();
+
+    if (nullptr != test_done)
+        test_done();
+
+    add_run_stats(stats, counters, msize);
+    last_run_stats.add("udp_datagrams_out", segments_sent);
+    last_run_stats.add("udp_gso_sends", gso_sends);
+    last_run_stats.add("udp_idle_timeout", idle_timeout);
+    return 0;
+}
+
+// free list allocator for coroutine frames, all echo coroutines have the
+// same frame size, so after warm up no frame touches the heap
+class FramePool;
+
+// run_test_coro is single threaded, but keep pool per thread anyway
+thread_local FramePool * frame_pool = nullptr;
+
+class FramePool {
+protected:
+    struct FreeBlock { FreeBlock * next; };
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    FreeBlock * free_list;
+    size_t block_size;
+    static const size_t CHUNK_BLOCKS = 1024;
+
+public:
+    unsigned long in_use, heap_allocs;
+
+    FramePool(): free_list(nullptr), block_size(0), in_use(0), heap_allocs(0) {}
+    ~FramePool() {
+        if (this == frame_pool)
+            frame_pool = nullptr;
+    }
+
+    size_t frame_size() const { return block_size; }
+
+    void * alloc(size_t size) {
+        if (0 == block_size)
+            block_size = (std::max(size, sizeof(FreeBlock)) + 15) / 16 * 16;
+
+        if (size > block_size) {
+            ++heap_allocs;
+            return ::operator new(size);
+        }
+
+        if (nullptr == free_list) {
+            chunks.emplace_back(new char[block_size * CHUNK_BLOCKS]);
+            char * chunk = chunks.back().get();
+            for(size_t i = 0; i < CHUNK_BLOCKS; ++i) {
+                auto block = (FreeBlock *)(chunk + i * block_size);
+                block->next = free_list;
+                free_list = block;
+            }
+        }
+
+        FreeBlock * block = free_list;
+        free_list = block->next;
+        ++in_use;
+        return block;
+    }
+
+    void free(void * ptr, size_t size) {
+        if (size > block_size) {
+            ::operator delete(ptr);
+            return;
+        }
+        auto block = (FreeBlock *)ptr;
+        block->next = free_list;
+        free_list = block;
+        --in_use;
+    }
+};
+
+
+// fire and forget coroutine, frame is released when body finishes
+struct EchoTask {
+    struct promise_type {
+        EchoTask get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void * operator new(size_t size) {
+            if (nullptr == frame_pool)
+                return ::operator new(size);
+            return frame_pool->alloc(size);
+        }
+
+        static void operator delete(void * ptr, size_t size) {
+            if (nullptr == frame_pool)
+                ::operator delete(ptr);
+            else
+                frame_pool->free(ptr, size);
+        }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// EPollRSelector driven scheduler: coroutine co_awaits readiness of its fd
+// and is resumed from run() with the event flags
+class CoroLoop {
+public:
+    EPollRSelector selector;
+    std::vector<std::coroutine_handle<>> waiters;
+    std::vector<uint32_t> fd_events;
+    int active;
+
+    struct Readable {
+        CoroLoop & loop;
+        int fd;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) noexcept { loop.waiters[fd] = handle; }
+        uint32_t await_resume() const noexcept { return loop.fd_events[fd]; }
+    };
+
+    CoroLoop(int sock_count): selector(sock_count), active(0) {}
+
+    // destroy coroutines, which are still suspended after failure
+    ~CoroLoop() {
+        for(auto & handle: waiters)
+            if (handle)
+                handle.destroy();
+    }
+
+    bool add_fd(int fd) {
+        if ((int)waiters.size() <= fd) {
+            waiters.resize(fd + 1);
+            fd_events.resize(fd + 1);
+        }
+        ++active;
+        return selector.add_fd(fd);
+    }
+
+    // called by coroutine before it returns
+    void remove_fd(int fd) {
+        selector.remove_fd(fd);
+        --active;
+    }
+
+    Readable readable(int fd) { return Readable{*this, fd}; }
+
+    bool run() {
+        while(active > 0) {
+            if (not selector.wait())
+                return false;
+
+            int fd;
+            uint32_t events;
+            while(selector.next(fd, events)) {
+                fd_events[fd] = events;
+                std::coroutine_handle<> handle = waiters[fd];
+                waiters[fd] = nullptr;
+                if (handle)
+                    handle.resume();
+            }
+        }
+        return true;
+    }
+};
+
+// same work per message as run_test callback loop: one edge,
+// one recv, one write - only control flow differs
+EchoTask echo_coro(CoroLoop & loop, int sockfd, const char * message, int msize) {
+    for(;;) {
+        uint32_t events = co_await loop.readable(sockfd);
+
+        if ((events & EPOLLHUP) or (events & EPOLLERR))
+            break;
+
+        if (not process_message(sockfd, message, msize, loop.selector.stats))
+            break;
+    }
+    loop.remove_fd(sockfd);
+}
+
+// one C++20 coroutine per connection on top of EPollRSelector,
+// frames come from FramePool
+extern "C"
+int run_test_coro(const char * ip,
+                  const int port,
+                  const int th_count,
+                  int msize,
+                  int listen_queue,
+                  void (*ready_for_connect)(),
+                  void (*preparation_done)(),
+                  void (*test_done)())
+{
+    RtScope rt_scope(msize);
+    char message[msize];
+    std::memset(message, 'X', msize);
+    FDList sockets;
+
+    // loop is destroyed first, so suspended frames go back to pool
+    FramePool pool;
+    frame_pool = &pool;
+    std::unique_ptr<CoroLoop> loop(new CoroLoop(th_count));
+    if (not loop->selector.ok())
+        return 1;
+
+    if (not wait_for_conn(th_count, sockets.fds, ip, port, listen_queue, ready_for_connect, nullptr, false))
+        return 1;
+
+    for(int sockfd: sockets.fds) {
+        if (not loop->add_fd(sockfd))
+            return 1;
+        echo_coro(*loop, sockfd, message, msize);
+    }
+
+    ThreadCounters counters;
+    PerfCounters perf(&counters);
+
+    if (nullptr != preparation_done)
+        preparation_done();
+
+    loop->selector.stats.clear();
+    perf.start();
+
+    bool ok = loop->run();
+
+    perf.stop();
+
+    if (nullptr != test_done)
+        test_done();
+
+    add_run_stats(loop->selector.stats, counters, msize);
+    last_run_stats.add("coro_frame_size", (unsigned long)pool.frame_size());
+    last_run_stats.add("coro_frame_heap_allocs", pool.heap_allocs);
+    return ok ? 0 : 1;
+}
+
+#if defined(__x86_64__)
+// fiber_switch(save_sp, load_sp) - save callee-saved registers on current
+// stack, store stack pointer to *save_sp, switch to load_sp and restore
+// registers from there. Unlike swapcontext it doesn't touch signal mask,
+// so no syscall per switch. MXCSR/x87 control words are not preserved,
+// nothing here changes them.
+asm(R"(
+    .text
+    .p2align 4
+    .hidden fiber_switch
+    .type fiber_switch, @function
+fiber_switch:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size fiber_switch, .-fiber_switch
+
+    .p2align 4
+    .hidden fiber_start
+    .type fiber_start, @function
+fiber_start:
+    movq %r12, %rdi
+    callq *%r13
+    ud2
+    .size fiber_start, .-fiber_start
+)");
+
+extern "C" void fiber_switch(void ** save_sp, void * load_sp);
+extern "C" void fiber_start();
+
+const bool FIBERS_SUPPORTED = true;
+
+// prepare stack, so first switch to it "returns" into fiber_start,
+// which calls func(arg) with ABI-aligned stack
+void * fiber_init_stack(void * stack_base, size_t stack_size, void (*func)(void *), void * arg) {
+    uintptr_t top = ((uintptr_t)stack_base + stack_size) & ~(uintptr_t)15;
+    void ** sp = (void **)(top - 72);
+    sp[0] = nullptr;            // r15
+    sp[1] = nullptr;            // r14
+    sp[2] = (void *)func;       // r13
+    sp[3] = arg;                // r12
+    sp[4] = nullptr;            // rbx
+    sp[5] = nullptr;            // rbp
+    sp[6] = (void *)fiber_start;
+    return sp;
+}
+#else
+const bool FIBERS_SUPPORTED = false;
+
+void fiber_switch(void **, void *) {}
+void * fiber_init_stack(void *, size_t, void (*)(void *), void *) { return nullptr; }
+#endif
+
+class FiberScheduler;
+
+struct Fiber {
+    void * sp;
+    int sockfd;
+    uint32_t events;
+    FiberScheduler * sched;
+    const char * message;
+    int msize;
+};
+
+// runs fibers from EPollRSelector readiness, fiber parks itself
+// in wait_readable and is switched back in by run()
+class FiberScheduler {
+public:
+    EPollRSelector selector;
+    std::vector<Fiber *> waiters;
+    void * main_sp;
+    Fiber * current;
+    int active;
+
+    FiberScheduler(int sock_count): selector(sock_count), main_sp(nullptr), current(nullptr), active(0) {}
+
+    bool add(Fiber * fiber) {
+        if ((int)waiters.size() <= fiber->sockfd)
+            waiters.resize(fiber->sockfd + 1, nullptr);
+        ++active;
+        return selector.add_fd(fiber->sockfd);
+    }
+
+    // called from fiber
+    uint32_t wait_readable() {
+        Fiber * fiber = current;
+        waiters[fiber->sockfd] = fiber;
+        fiber_switch(&fiber->sp, main_sp);
+        return fiber->events;
+    }
+
+    // called from fiber, never returns
+    void exit() {
+        Fiber * fiber = current;
+        selector.remove_fd(fiber->sockfd);
+        --active;
+        fiber_switch(&fiber->sp, main_sp);
+    }
+
+    void resume(Fiber * fiber) {
+        current = fiber;
+        fiber_switch(&main_sp, fiber->sp);
+        current = nullptr;
+    }
+
+    bool run() {
+        while(active > 0) {
+            if (not selector.wait())
+                return false;
+
+            int fd;
+            uint32_t events;
+            while(selector.next(fd, events)) {
+                Fiber * fiber = waiters[fd];
+                if (nullptr == fiber)
+                    continue;
+                waiters[fd] = nullptr;
+                fiber->events = events;
+                resume(fiber);
+            }
+        }
+        return true;
+    }
+};
+
+// blocking style echo, same work per message as run_test
+void echo_fiber(void * arg) {
+    auto fiber = (Fiber *)arg;
+    for(;;) {
+        uint32_t events = fiber->sched->wait_readable();
+
+        if ((events & EPOLLHUP) or (events & EPOLLERR))
+            break;
+
+        if (not process_message(fiber->sockfd, fiber->message, fiber->msize,
+                                fiber->sched->selector.stats))
+            break;
+    }
+    fiber->sched->exit();
+}
+
+struct SwitchBench {
+    void * main_sp;
+    void * fiber_sp;
+    long count;
+};
+
+void switch_bench_fiber(void * arg) {
+    auto bench = (SwitchBench *)arg;
+    for(;;)
+        fiber_switch(&bench->fiber_sp, bench->main_sp);
+}
+
+// average cost of one fiber_switch call in ns
+double measure_switch_ns(void * stack, size_t stack_size) {
+    SwitchBench bench{nullptr, nullptr, 1000 * 1000};
+    bench.fiber_sp = fiber_init_stack(stack, stack_size, switch_bench_fiber, &bench);
+
+    auto start = get_fast_time();
+    for(long i = 0; i < bench.count; ++i)
+        fiber_switch(&bench.main_sp, bench.fiber_sp);
+    auto spent = get_fast_time() - start;
+
+    // two switches per iteration
+    return (double)spent / (2 * bench.count);
+}
+
+// one stackful fiber per connection with hand-written context switch.
+// Options: fiber_stack_kb=16 - stack size, extended to fit message buffer,
+//          fiber_guard=1 - guard page below every stack
+extern "C"
+int run_test_fiber(const char * ip,
+                   const int port,
+                   const int th_count,
+                   int msize,
+                   int listen_queue,
+                   void (*ready_for_connect)(),
+                   void (*preparation_done)(),
+                   void (*test_done)())
+{
+    RtScope rt_scope(msize);
+    if (not FIBERS_SUPPORTED) {
+        std::cerr << "run_test_fiber supports only x86_64\n";
+        return 1;
+    }
+
+    long stack_kb = 16, guard = 1;
+    if (not opt_long(test_options.opts, "fiber_stack_kb", stack_kb) or
+        not opt_long(test_options.opts, "fiber_guard", guard))
+        return 1;
+
+    // process_message keeps message on stack
+    size_t stack_size = std::max((size_t)stack_kb * 1024, (size_t)msize + 8 * 1024);
+
+    char message[msize];
+    std::memset(message, 'X', msize);
+    FDList sockets;
+
+    ThreadsMemProbe mem;
+    mem.start();
+
+    // one extra stack for switch benchmark
+    ThreadStacksArena arena;
+    if (not arena.alloc(th_count + 1, stack_size, 0 != guard))
+        return 1;
+
+    FiberScheduler sched(th_count);
+    if (not sched.selector.ok())
+        return 1;
+
+    if (not wait_for_conn(th_count, sockets.fds, ip, port, listen_queue, ready_for_connect, nullptr, false))
+        return 1;
+
+    std::vector<Fiber> fibers(sockets.fds.size());
+    for(size_t i = 0; i < sockets.fds.size(); ++i) {
+        Fiber & fiber = fibers[i];
+        fiber.sockfd = sockets.fds[i];
+        fiber.events = 0;
+        fiber.sched = &sched;
+        fiber.message = message;
+        fiber.msize = msize;
+        fiber.sp = fiber_init_stack(arena.stack(i), arena.stack_size, echo_fiber, &fiber);
+
+        if (not sched.add(&fiber))
+            return 1;
+
+        // run till first wait_readable
+        sched.resume(&fiber);
+    }
+
+    double switch_ns = measure_switch_ns(arena.stack(th_count), arena.stack_size);
+    mem.ready();
+
+    ThreadCounters counters;
+    PerfCounters perf(&counters);
+
+    if (nullptr != preparation_done)
+        preparation_done();
+
+    sched.selector.stats.clear();
+    perf.start();
+
+    bool ok = sched.run();
+
+    perf.stop();
+    mem.done();
+
+    if (nullptr != test_done)
+        test_done();
+
+    add_run_stats(sched.selector.stats, counters, msize);
+    last_run_stats.add("fiber_switch_ns", switch_ns);
+    last_run_stats.add("fiber_stack_size", (unsigned long)arena.stack_size);
+    mem.add_to(last_run_stats, th_count);
+    return ok ? 0 : 1;
+}
+
 extern "C"
 int set_rr_prio() {
     int policy;
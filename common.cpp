@@ -1,22 +1,35 @@
+#include <cmath>
+#include <chrono>
 #include <cstdio>
+#include <climits>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
 #include <iostream>
 
 #include <time.h>
+#include <poll.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/tcp.h>
+#include <linux/perf_event.h>
 
 #include "common.h"
 
 EPollRSelector::EPollRSelector(int sock_count) {
-#ifdef EPOLL_CALL_STATS
-    sock_activation_count = 0;
-    wait_count = 0;
-#endif
     efd = epoll_create1(0);
     if (-1 == efd) {
         perror("epoll_create");
@@ -28,22 +41,12 @@ EPollRSelector::EPollRSelector(int sock_count) {
 EPollRSelector::EPollRSelector(EPollRSelector && rsel) {
     efd = rsel.efd;
     rsel.efd = -1;
-
-    #ifdef EPOLL_CALL_STATS
-    sock_activation_count = rsel.sock_activation_count;
-    wait_count = rsel.wait_count;
-    #endif
-
+    stats = rsel.stats;
+    events.events = std::move(rsel.events.events);
     current_ready = end_of_ready = events.events.begin();
 }
 
 EPollRSelector::~EPollRSelector() {
-#ifdef EPOLL_CALL_STATS
-    if (0 != wait_count) {
-        std::cout << "Avg socket per wait = ";
-        std::cout << sock_activation_count / wait_count << "\n";
-    }
-#endif
     if (-1 != efd)
         close(efd);
 }
@@ -60,52 +63,41 @@ bool EPollRSelector::add_fd(int sockfd, int event_mask) {
     return true;
 }
 
-bool EPollRSelector::wait(long int timeout_ns) {
-    if (not epoll_wait_ex(efd, events, timeout_ns))
-        return false;
-
-    current_ready = events.events.begin();
-    end_of_ready = current_ready + events.num_ready;
+bool EPollRSelector::modify_fd(int sockfd, int event_mask) {
+    epoll_event event;
 
-#ifdef EPOLL_CALL_STATS
-    wait_count += 1;
-    sock_activation_count += n;
-#endif
+    event.data.fd = sockfd;
+    event.events = event_mask;
+    if (-1 == epoll_ctl(efd, EPOLL_CTL_MOD, sockfd, &event)) {
+        perror("epoll_ctl(EPOLL_CTL_MOD)");
+        return false;
+    }
     return true;
 }
 
-bool EPollRSelector::next(int & sockfd, uint32_t & flags) {
-    if(end_of_ready == current_ready)
+bool EPollRSelector::wait(long int timeout_ns) {
+    if (not epoll_wait_ex(efd, events, timeout_ns, &stats))
         return false;
 
-    sockfd = current_ready->data.fd;
-    flags = current_ready->events;
-    ++current_ready;
+    current_ready = events.events.begin();
+    end_of_ready = current_ready + events.num_ready;
     return true;
 }
 
-bool EPollRSelector::next(int & sockfd) {
-    if(end_of_ready == current_ready)
-        return false;
-
-    sockfd = current_ready->data.fd;
-    ++current_ready;
-    return true;
+void EPollRSelector::remove_fd(int sockfd) {
+    epoll_ctl(efd, EPOLL_CTL_DEL, sockfd, nullptr);
 }
 
 void EPollRSelector::remove_current_ready() {
     epoll_ctl(efd, EPOLL_CTL_DEL, (current_ready - 1)->data.fd, nullptr);
 }
 
-int EPollRSelector::ready_count() const {
-    return end_of_ready - current_ready;
-}
-
 // epoll_wait support timeout only with ms granularity
 // while we need at least us presicion
 bool epoll_wait_ex(int epollfd,
                    EventsList & ready,
-                   const long int timeout_ns)
+                   const long int timeout_ns,
+                   SelectorStats * stats)
 {
     bool already_polled = false;
 
@@ -132,6 +124,9 @@ bool epoll_wait_ex(int epollfd,
                                      poll_timeout);
         already_polled = true;
 
+        if (nullptr != stats and 0 <= ready.num_ready)
+            stats->on_wakeup(ready.num_ready);
+
         curr_time = get_fast_time();
 
         if (ready.num_ready == 0) {
@@ -140,6 +135,8 @@ bool epoll_wait_ex(int epollfd,
             continue;
         } else if ( 0 > ready.num_ready ) {
             if (errno == EINTR) {
+                if (nullptr != stats)
+                    ++stats->eintr;
                 ready.num_ready = 0;
                 continue;
             } else {
@@ -148,14 +145,1134 @@ bool epoll_wait_ex(int epollfd,
             }
         }
 
-        #ifdef EPOLL_CALL_STATS
-        if (0 != ready.num_ready) {
-            socket_count_from_wait += ready.num_ready;
-            epoll_wait_calls += 1;
+        ready.recv_time = curr_time;
+        return true;
+    }
+}
+
+
+void StatsList::add(const std::string & name, unsigned long value) {
+    items.emplace_back(name, std::to_string(value));
+}
+
+void StatsList::add(const std::string & name, double value) {
+    std::ostringstream val;
+    val << std::setprecision(6) << value;
+    items.emplace_back(name, val.str());
+}
+
+void StatsList::serialize(std::string & out) const {
+    out += ' ';
+    out += std::to_string(items.size());
+    for(const auto & item: items) {
+        out += ' ';
+        out += item.first;
+        out += ' ';
+        out += item.second;
+    }
+}
+
+void SelectorStats::clear() {
+    wait_calls = empty_wakeups = events = eintr = 0;
+    recv_eagain = write_eagain = bytes_in = bytes_out = syscalls = frames = service_ns = 0;
+    events_hist.fill(0);
+}
+
+SelectorStats & SelectorStats::operator+=(const SelectorStats & other) {
+    wait_calls += other.wait_calls;
+    empty_wakeups += other.empty_wakeups;
+    events += other.events;
+    eintr += other.eintr;
+    recv_eagain += other.recv_eagain;
+    write_eagain += other.write_eagain;
+    bytes_in += other.bytes_in;
+    bytes_out += other.bytes_out;
+    syscalls += other.syscalls;
+    frames += other.frames;
+    service_ns += other.service_ns;
+    for(int i = 0; i < WAKEUP_HIST_SIZE; ++i)
+        events_hist[i] += other.events_hist[i];
+    return *this;
+}
+
+void SelectorStats::add_to(StatsList & stats, const std::string & prefix) const {
+    stats.add(prefix + "wait_calls", wait_calls);
+    stats.add(prefix + "empty_wakeups", empty_wakeups);
+    stats.add(prefix + "events", events);
+    stats.add(prefix + "eintr", eintr);
+    stats.add(prefix + "recv_eagain", recv_eagain);
+    stats.add(prefix + "write_eagain", write_eagain);
+    stats.add(prefix + "bytes_in", bytes_in);
+    stats.add(prefix + "bytes_out", bytes_out);
+    stats.add(prefix + "syscalls", syscalls);
+    if (0 != frames)
+        stats.add(prefix + "frames", frames);
+    if (0 != service_ns)
+        stats.add(prefix + "service_ns", service_ns);
+
+    if (wait_calls != empty_wakeups)
+        stats.add(prefix + "avg_events_per_wakeup",
+                  (double)events / (wait_calls - empty_wakeups));
+
+    // bucket I holds wakeups with [2 ** (I - 1), 2 ** I) events
+    for(int i = 0; i < WAKEUP_HIST_SIZE; ++i)
+        if (0 != events_hist[i])
+            stats.add(prefix + "wakeup_hist_" + std::to_string(i), events_hist[i]);
+}
+
+void ThreadCounters::clear() {
+    values.fill(0);
+    valid.fill(true);
+    user_only = false;
+    utime_us = stime_us = 0;
+    minflt = majflt = nvcsw = nivcsw = 0;
+    runq_wait_ns = 0;
+    runq_valid = true;
+    threads = 0;
+}
+
+ThreadCounters & ThreadCounters::operator+=(const ThreadCounters & other) {
+    if (0 == other.threads)
+        return *this;
+
+    for(int i = 0; i < PC_COUNT; ++i) {
+        values[i] += other.values[i];
+        valid[i] = valid[i] and other.valid[i];
+    }
+    user_only = user_only or other.user_only;
+    utime_us += other.utime_us;
+    stime_us += other.stime_us;
+    minflt += other.minflt;
+    majflt += other.majflt;
+    nvcsw += other.nvcsw;
+    nivcsw += other.nivcsw;
+    runq_wait_ns += other.runq_wait_ns;
+    runq_valid = runq_valid and other.runq_valid;
+    threads += other.threads;
+    return *this;
+}
+
+static const char * perf_counter_names[PC_COUNT] = {
+    "task_clock_ns", "context_switches", "page_faults",
+    "cycles", "instructions", "cache_misses", "syscalls"};
+
+void ThreadCounters::add_to(StatsList & stats, const std::string & prefix, unsigned long messages) const {
+    if (0 == threads)
+        return;
+
+    stats.add(prefix + "threads", (unsigned long)threads);
+    stats.add(prefix + "user_only", (unsigned long)user_only);
+    for(int i = 0; i < PC_COUNT; ++i)
+        if (valid[i])
+            stats.add(prefix + perf_counter_names[i], values[i]);
+
+    stats.add(prefix + "ru_utime_us", utime_us);
+    stats.add(prefix + "ru_stime_us", stime_us);
+    stats.add(prefix + "ru_minflt", minflt);
+    stats.add(prefix + "ru_majflt", majflt);
+    stats.add(prefix + "ru_nvcsw", nvcsw);
+    stats.add(prefix + "ru_nivcsw", nivcsw);
+    if (runq_valid)
+        stats.add(prefix + "runq_wait_us", runq_wait_ns / 1000);
+
+    if (0 == messages)
+        return;
+
+    if (valid[PC_CYCLES])
+        stats.add(prefix + "cycles_per_msg", (double)values[PC_CYCLES] / messages);
+    if (valid[PC_INSTRUCTIONS])
+        stats.add(prefix + "instructions_per_msg", (double)values[PC_INSTRUCTIONS] / messages);
+    if (valid[PC_SYSCALLS])
+        stats.add(prefix + "syscalls_per_msg", (double)values[PC_SYSCALLS] / messages);
+    if (valid[PC_TASK_CLOCK])
+        stats.add(prefix + "task_clock_ns_per_msg", (double)values[PC_TASK_CLOCK] / messages);
+    stats.add(prefix + "cpu_us_per_msg", (double)(utime_us + stime_us) / messages);
+}
+
+// second field of schedstat - time spent on run queue waiting for CPU
+static bool thread_runq_wait(unsigned long & wait_ns) {
+    std::ifstream fd("/proc/thread-self/schedstat");
+    unsigned long run_ns;
+    return (bool)(fd >> run_ns >> wait_ns);
+}
+
+// tracepoint id of raw_syscalls:sys_enter, -1 if tracefs isn't available
+static long syscalls_tracepoint_id() {
+    const char * paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+
+    for(auto path: paths) {
+        std::ifstream fd(path);
+        long id = -1;
+        if (fd >> id)
+            return id;
+    }
+    return -1;
+}
+
+static int open_thread_counter(uint32_t type, uint64_t config, bool user_only, bool inherit) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = not inherit;
+    attr.inherit = inherit;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void thread_rusage(bool whole_process,
+                          unsigned long & utime_us, unsigned long & stime_us,
+                          unsigned long & minflt, unsigned long & majflt,
+                          unsigned long & nvcsw, unsigned long & nivcsw) {
+    rusage usage;
+    if (0 != getrusage(whole_process ? RUSAGE_SELF : RUSAGE_THREAD, &usage)) {
+        perror("getrusage");
+        std::memset(&usage, 0, sizeof(usage));
+    }
+    utime_us = usage.ru_utime.tv_sec * MICRO + usage.ru_utime.tv_usec;
+    stime_us = usage.ru_stime.tv_sec * MICRO + usage.ru_stime.tv_usec;
+    minflt = usage.ru_minflt;
+    majflt = usage.ru_majflt;
+    nvcsw = usage.ru_nvcsw;
+    nivcsw = usage.ru_nivcsw;
+}
+
+// value, time_enabled, time_running, scaled if counter was multiplexed
+static bool read_counter(int fd, uint64_t & value) {
+    uint64_t data[3];
+    if (sizeof(data) != read(fd, data, sizeof(data)))
+        return false;
+
+    if (0 == data[2]) {
+        value = 0;
+        return 0 == data[1];
+    }
+
+    value = data[0];
+    if (data[1] != data[2])
+        value = (uint64_t)((double)data[0] * data[1] / data[2]);
+    return true;
+}
+
+PerfCounters::PerfCounters(ThreadCounters * _out, bool _inherit):
+    out(_out), started(false), user_only(false), inherit(_inherit)
+{
+    const uint32_t types[PC_COUNT] = {
+        PERF_TYPE_SOFTWARE, PERF_TYPE_SOFTWARE, PERF_TYPE_SOFTWARE,
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+        PERF_TYPE_TRACEPOINT};
+    uint64_t configs[PC_COUNT] = {
+        PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_CONTEXT_SWITCHES, PERF_COUNT_SW_PAGE_FAULTS,
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+        0};
+
+    fds.fill(-1);
+    base.fill(0);
+    long tp_id = syscalls_tracepoint_id();
+    configs[PC_SYSCALLS] = (uint64_t)tp_id;
+
+    for(int i = 0; i < PC_COUNT; ++i) {
+        if (PC_SYSCALLS == i and -1 == tp_id)
+            continue;
+
+        fds[i] = open_thread_counter(types[i], configs[i], user_only, inherit);
+
+        // perf_event_paranoid >= 2 allows only user space counting. All
+        // counters are reopened, so they don't mix kernel inclusive and
+        // user only values
+        if (-1 == fds[i] and (EACCES == errno or EPERM == errno) and not user_only) {
+            user_only = true;
+            for(int j = 0; j < i; ++j)
+                if (-1 != fds[j]) {
+                    close(fds[j]);
+                    fds[j] = -1;
+                }
+            i = -1;
         }
-        #endif
+    }
+}
 
-        ready.recv_time = curr_time;
+void PerfCounters::start() {
+    for(int i = 0; i < PC_COUNT; ++i) {
+        if (-1 == fds[i])
+            continue;
+
+        // inherited counters are already running in child threads,
+        // so only a baseline can be taken
+        if (inherit) {
+            if (not read_counter(fds[i], base[i])) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        } else {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    thread_rusage(inherit, utime_us, stime_us, minflt, majflt, nvcsw, nivcsw);
+    runq_valid = not inherit and thread_runq_wait(runq_wait_ns);
+    started = true;
+}
+
+void PerfCounters::stop() {
+    if (not started)
+        return;
+    started = false;
+
+    ThreadCounters res;
+    res.threads = 1;
+    res.user_only = user_only;
+
+    for(int i = 0; i < PC_COUNT; ++i) {
+        if (-1 == fds[i]) {
+            res.valid[i] = false;
+            continue;
+        }
+
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+        uint64_t value;
+        if (not read_counter(fds[i], value)) {
+            res.valid[i] = false;
+            continue;
+        }
+        res.values[i] = value - base[i];
+    }
+
+    unsigned long utime_end, stime_end, minflt_end, majflt_end, nvcsw_end, nivcsw_end;
+    thread_rusage(inherit, utime_end, stime_end, minflt_end, majflt_end, nvcsw_end, nivcsw_end);
+    res.utime_us = utime_end - utime_us;
+    res.stime_us = stime_end - stime_us;
+    res.minflt = minflt_end - minflt;
+    res.majflt = majflt_end - majflt;
+    res.nvcsw = nvcsw_end - nvcsw;
+    res.nivcsw = nivcsw_end - nivcsw;
+
+    unsigned long runq_wait_end;
+    res.runq_valid = runq_valid and thread_runq_wait(runq_wait_end);
+    if (res.runq_valid)
+        res.runq_wait_ns = runq_wait_end - runq_wait_ns;
+
+    if (nullptr != out)
+        *out += res;
+}
+
+PerfCounters::~PerfCounters() {
+    stop();
+    for(int fd: fds)
+        if (-1 != fd)
+            close(fd);
+}
+
+bool parse_options(const char * spec, OptionsMap & opts) {
+    std::istringstream tokens(spec);
+    std::string token;
+    while(tokens >> token) {
+        auto pos = token.find('=');
+        if (std::string::npos == pos or 0 == pos) {
+            std::cerr << "Broken option '" << token << "', KEY=VALUE expected\n";
+            return false;
+        }
+        opts[token.substr(0, pos)] = token.substr(pos + 1);
+    }
+    return true;
+}
+
+bool opt_long(const OptionsMap & opts, const std::string & key, long & val) {
+    auto item = opts.find(key);
+    if (opts.end() == item)
         return true;
+
+    char * end = nullptr;
+    long res = std::strtol(item->second.c_str(), &end, 0);
+    if (item->second.empty() or '\0' != *end) {
+        std::cerr << "Option " << key << " should be integer, not '" << item->second << "'\n";
+        return false;
+    }
+    val = res;
+    return true;
+}
+
+bool opt_double(const OptionsMap & opts, const std::string & key, double & val) {
+    auto item = opts.find(key);
+    if (opts.end() == item)
+        return true;
+
+    char * end = nullptr;
+    double res = std::strtod(item->second.c_str(), &end);
+    if (item->second.empty() or '\0' != *end) {
+        std::cerr << "Option " << key << " should be number, not '" << item->second << "'\n";
+        return false;
+    }
+    val = res;
+    return true;
+}
+
+void opt_str(const OptionsMap & opts, const std::string & key, std::string & val) {
+    auto item = opts.find(key);
+    if (opts.end() != item)
+        val = item->second;
+}
+
+bool opt_transport(const OptionsMap & opts, Transport & transport) {
+    std::string name = "tcp";
+    opt_str(opts, "transport", name);
+
+    if ("tcp" == name)
+        transport = TRANSPORT_TCP;
+    else if ("unix" == name)
+        transport = TRANSPORT_UNIX_STREAM;
+    else if ("unix_seqpacket" == name)
+        transport = TRANSPORT_UNIX_SEQPACKET;
+    else if ("udp" == name)
+        transport = TRANSPORT_UDP;
+    else {
+        std::cerr << "Unknown transport '" << name << "'\n";
+        return false;
+    }
+    return true;
+}
+
+int transport_socktype(Transport transport) {
+    if (TRANSPORT_UNIX_SEQPACKET == transport)
+        return SOCK_SEQPACKET;
+    if (TRANSPORT_UDP == transport)
+        return SOCK_DGRAM;
+    return SOCK_STREAM;
+}
+
+void set_udp_buffers(int sockfd, int size) {
+    // *BUFFORCE ignores rmem_max/wmem_max, but requires CAP_NET_ADMIN
+    if (0 > setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+        if (0 > setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)))
+            perror("setsockopt(SO_RCVBUF) failed");
+
+    if (0 > setsockopt(sockfd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)))
+        if (0 > setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)))
+            perror("setsockopt(SO_SNDBUF) failed");
+}
+
+bool ConnOptions::fits(int port) const {
+    if (port + ports - 1 > 65535) {
+        std::cerr << "ports=" << ports << " starting from " << port << " don't fit in 65535\n";
+        return false;
+    }
+    return true;
+}
+
+bool opt_conn(const OptionsMap & opts, Transport transport, ConnOptions & conn) {
+    long ports = 1, sock_buf = 0;
+    if (not opt_long(opts, "ports", ports) or not opt_long(opts, "sock_buf", sock_buf))
+        return false;
+
+    if (ports < 1 or ports > 65535) {
+        std::cerr << "ports should be in [1, 65535]\n";
+        return false;
+    }
+    if (sock_buf < 0 or sock_buf > INT_MAX) {
+        std::cerr << "sock_buf should be >= 0\n";
+        return false;
+    }
+    if ((ports > 1 or sock_buf > 0) and TRANSPORT_TCP != transport) {
+        std::cerr << "ports and sock_buf require tcp transport\n";
+        return false;
+    }
+
+    conn.ports = ports;
+    conn.sock_buf = sock_buf;
+    return true;
+}
+
+// kernel doubles the value and clamps it by rmem_max/wmem_max
+void set_sock_buffers(int sockfd, int size) {
+    if (0 > setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)))
+        perror("setsockopt(SO_RCVBUF) failed");
+    if (0 > setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)))
+        perror("setsockopt(SO_SNDBUF) failed");
+}
+
+void raise_fd_limit() {
+    rlimit limit;
+    if (0 != getrlimit(RLIMIT_NOFILE, &limit)) {
+        std::perror("getrlimit(RLIMIT_NOFILE)");
+        return;
+    }
+    if (limit.rlim_cur == limit.rlim_max)
+        return;
+    limit.rlim_cur = limit.rlim_max;
+    if (0 != setrlimit(RLIMIT_NOFILE, &limit))
+        std::perror("setrlimit(RLIMIT_NOFILE)");
+}
+
+bool opt_framing(const OptionsMap & opts, bool & framed) {
+    std::string name = "raw";
+    opt_str(opts, "framing", name);
+
+    if ("raw" == name)
+        framed = false;
+    else if ("lp" == name)
+        framed = true;
+    else {
+        std::cerr << "Unknown framing '" << name << "'\n";
+        return false;
+    }
+    return true;
+}
+
+// body bytes of frames
+static const std::string frame_filler(64 * 1024, 'X');
+
+bool writev_all(int sockfd, iovec * iov, int iov_count, SelectorStats & stats) {
+    while(iov_count > 0) {
+        ssize_t bc = writev(sockfd, iov, std::min(iov_count, IOV_MAX));
+        ++stats.syscalls;
+        if (0 > bc) {
+            if (EAGAIN == errno or EWOULDBLOCK == errno) {
+                ++stats.write_eagain;
+                pollfd pfd = {sockfd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if (EPIPE != errno and ECONNRESET != errno)
+                std::perror("writev(sockfd, ...)");
+            return false;
+        }
+        stats.bytes_out += bc;
+
+        // skip written buffers
+        while(iov_count > 0 and (size_t)bc >= iov->iov_len) {
+            bc -= iov->iov_len;
+            ++iov;
+            --iov_count;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (char *)iov->iov_base + bc;
+            iov->iov_len -= bc;
+        }
+    }
+    return true;
+}
+
+bool send_frames(int sockfd, const FrameHeader * headers, int count, SelectorStats & stats) {
+    const int MAX_IOV = 64;
+    iovec iov[MAX_IOV];
+    int iov_count = 0;
+
+    for(int i = 0; i < count; ++i) {
+        iov[iov_count].iov_base = (void *)&headers[i];
+        iov[iov_count].iov_len = sizeof(FrameHeader);
+        ++iov_count;
+
+        // large bodies are sent as several filler chunks
+        size_t body_left = headers[i].body_len;
+        for(;;) {
+            if (MAX_IOV == iov_count) {
+                if (not writev_all(sockfd, iov, iov_count, stats))
+                    return false;
+                iov_count = 0;
+            }
+
+            if (0 == body_left)
+                break;
+
+            size_t chunk = std::min(frame_filler.size(), body_left);
+            iov[iov_count].iov_base = (void *)frame_filler.data();
+            iov[iov_count].iov_len = chunk;
+            ++iov_count;
+            body_left -= chunk;
+        }
+    }
+    return writev_all(sockfd, iov, iov_count, stats);
+}
+
+bool send_copies(int sockfd, const char * message, size_t message_len, int count, SelectorStats & stats) {
+    const int MAX_IOV = 64;
+    iovec iov[MAX_IOV];
+
+    while(count > 0) {
+        int iov_count = std::min(count, MAX_IOV);
+        for(int i = 0; i < iov_count; ++i) {
+            iov[i].iov_base = (void *)message;
+            iov[i].iov_len = message_len;
+        }
+        if (not writev_all(sockfd, iov, iov_count, stats))
+            return false;
+        count -= iov_count;
+    }
+    return true;
+}
+
+void SendQueue::add_frames(const FrameHeader * headers, int count) {
+    if (head == frames.size()) {
+        frames.clear();
+        head = 0;
+    }
+    frames.insert(frames.end(), headers, headers + count);
+}
+
+void SendQueue::add_copies(const char * _message, size_t _message_len, int count) {
+    message = _message;
+    message_len = _message_len;
+    raw_left += (unsigned long)count * message_len;
+}
+
+bool SendQueue::flush(int sockfd, EPollRSelector & sel, SelectorStats & stats) {
+    const int MAX_IOV = 64;
+    iovec iov[MAX_IOV];
+
+    while(not empty()) {
+        int iov_count = 0;
+        if (0 != raw_left) {
+            size_t off = message_off;
+            for(unsigned long left = raw_left; left > 0 and iov_count < MAX_IOV; off = 0) {
+                size_t chunk = std::min((unsigned long)(message_len - off), left);
+                iov[iov_count++] = iovec{(void *)(message + off), chunk};
+                left -= chunk;
+            }
+        } else {
+            unsigned long skip = sent;
+            for(size_t i = head; i < frames.size() and iov_count < MAX_IOV; ++i, skip = 0) {
+                if (skip < sizeof(FrameHeader))
+                    iov[iov_count++] = iovec{(char *)&frames[i] + skip, sizeof(FrameHeader) - skip};
+                size_t body_left = frames[i].body_len - (skip > sizeof(FrameHeader) ? skip - sizeof(FrameHeader) : 0);
+                while(body_left > 0 and iov_count < MAX_IOV) {
+                    size_t chunk = std::min(frame_filler.size(), body_left);
+                    iov[iov_count++] = iovec{(void *)frame_filler.data(), chunk};
+                    body_left -= chunk;
+                }
+            }
+        }
+
+        ssize_t bc = writev(sockfd, iov, iov_count);
+        ++stats.syscalls;
+        if (0 > bc) {
+            if (EAGAIN != errno and EWOULDBLOCK != errno) {
+                if (EPIPE != errno and ECONNRESET != errno)
+                    std::perror("writev(sockfd, ...)");
+                return false;
+            }
+            ++stats.write_eagain;
+            break;
+        }
+        stats.bytes_out += bc;
+
+        if (0 != raw_left) {
+            raw_left -= bc;
+            message_off = (message_off + bc) % message_len;
+            continue;
+        }
+        for(unsigned long left = bc; left > 0;) {
+            unsigned long rest = sizeof(FrameHeader) + frames[head].body_len - sent;
+            if (left < rest) {
+                sent += left;
+                break;
+            }
+            left -= rest;
+            sent = 0;
+            ++head;
+        }
+    }
+
+    if (out_enabled == empty()) {
+        out_enabled = not empty();
+        return sel.modify_fd(sockfd, EPOLLIN | EPOLLET | (out_enabled ? (int)EPOLLOUT : 0));
     }
+    return true;
+}
+
+long recv_available(int sockfd, char * buffer, size_t buffer_size, SelectorStats & stats, bool first_wait) {
+    long total = 0;
+    int flags = first_wait ? 0 : MSG_DONTWAIT;
+
+    for(;;) {
+        int bc = recv(sockfd, buffer, buffer_size, flags);
+        ++stats.syscalls;
+        if (0 > bc) {
+            if (EAGAIN == errno or EWOULDBLOCK == errno) {
+                ++stats.recv_eagain;
+                break;
+            }
+            if (ECONNRESET != errno)
+                std::perror("recv(sockfd, buffer, buffer_size, ...)");
+            return -1;
+        } else if (0 == bc) {
+            return -1;
+        }
+        stats.bytes_in += bc;
+        total += bc;
+
+        if (first_wait and (size_t)bc < buffer_size)
+            break;
+        flags = MSG_DONTWAIT;
+    }
+    return total;
+}
+
+bool set_nodelay(int sockfd, bool enable) {
+    int val = enable ? 1 : 0;
+    if (0 > setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val))) {
+        std::perror("setsockopt(TCP_NODELAY)");
+        return false;
+    }
+    return true;
+}
+
+bool opt_pipeline(const OptionsMap & opts, int & pipeline) {
+    long depth = 1;
+    if (not opt_long(opts, "pipeline", depth))
+        return false;
+
+    if (depth < 1 or depth > 4096) {
+        std::cerr << "pipeline should be in [1, 4096], got " << depth << "\n";
+        return false;
+    }
+    pipeline = depth;
+    return true;
+}
+
+bool opt_rt(const OptionsMap & opts, RtOptions & rt) {
+    rt = RtOptions();
+    long enabled = 0, prio = rt.prio;
+    std::string policy = "fifo";
+    if (not opt_long(opts, "rt", enabled) or not opt_long(opts, "rt_prio", prio))
+        return false;
+    opt_str(opts, "rt_policy", policy);
+
+    if ("fifo" == policy)
+        rt.policy = SCHED_FIFO;
+    else if ("rr" == policy)
+        rt.policy = SCHED_RR;
+    else {
+        std::cerr << "Unknown rt_policy '" << policy << "'\n";
+        return false;
+    }
+
+    if (prio < sched_get_priority_min(rt.policy) or prio > sched_get_priority_max(rt.policy)) {
+        std::cerr << "rt_prio " << prio << " is out of range for rt_policy=" << policy << "\n";
+        return false;
+    }
+    rt.enabled = (0 != enabled);
+    rt.prio = prio;
+    return true;
+}
+
+// tables below this size come from calloc, mlockall faults them in
+const size_t RT_MMAP_MIN = 64 * 1024;
+const size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+static std::mutex rt_lock;
+static bool rt_memory = false, rt_mlocked = false;
+static std::map<void *, size_t> rt_tables;   // mmap-ed table -> mapped size
+static size_t rt_table_bytes = 0, rt_hugetlb_bytes = 0;
+static size_t rt_old_stack = 0;     // default thread stack before rt, 0 - not changed
+
+// stack size for threads, created with default attributes
+static void set_default_stack(size_t size, size_t * old_size) {
+    pthread_attr_t attr;
+    if (0 != pthread_getattr_default_np(&attr))
+        return;
+    if (nullptr != old_size)
+        pthread_attr_getstacksize(&attr, old_size);
+    if (0 == pthread_attr_setstacksize(&attr, size))
+        pthread_setattr_default_np(&attr);
+    pthread_attr_destroy(&attr);
+}
+
+bool rt_memory_enable(size_t thread_stack) {
+    std::lock_guard<std::mutex> guard(rt_lock);
+    if (rt_memory)
+        return rt_mlocked;
+
+    rt_memory = true;
+    set_default_stack(std::max(thread_stack, (size_t)PTHREAD_STACK_MIN), &rt_old_stack);
+    rt_mlocked = (0 == mlockall(MCL_CURRENT | MCL_FUTURE));
+    if (not rt_mlocked)
+        std::perror("mlockall(MCL_CURRENT | MCL_FUTURE)");
+    return rt_mlocked;
+}
+
+void rt_memory_disable() {
+    std::lock_guard<std::mutex> guard(rt_lock);
+    if (rt_mlocked)
+        munlockall();
+    if (rt_memory and 0 != rt_old_stack)
+        set_default_stack(rt_old_stack, nullptr);
+    rt_memory = rt_mlocked = false;
+    rt_old_stack = 0;
+}
+
+void * alloc_table(size_t size) {
+    {
+        std::lock_guard<std::mutex> guard(rt_lock);
+        if (rt_memory and size >= RT_MMAP_MIN) {
+            size_t map_size = (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+
+            // explicit huge pages are prefaulted by MAP_POPULATE, THP ones
+            // only after madvise, so they are touched by memset
+            void * ptr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+            if (MAP_FAILED != ptr) {
+                rt_hugetlb_bytes += map_size;
+            } else {
+                ptr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (MAP_FAILED == ptr) {
+                    std::perror("mmap(table)");
+                    return nullptr;
+                }
+                madvise(ptr, map_size, MADV_HUGEPAGE);
+                std::memset(ptr, 0, map_size);
+            }
+            rt_tables[ptr] = map_size;
+            rt_table_bytes += map_size;
+            return ptr;
+        }
+    }
+    return std::calloc(1, std::max(size, (size_t)1));
+}
+
+void free_table(void * ptr, size_t) {
+    if (nullptr == ptr)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(rt_lock);
+        auto it = rt_tables.find(ptr);
+        if (rt_tables.end() != it) {
+            munmap(ptr, it->second);
+            rt_tables.erase(it);
+            return;
+        }
+    }
+    std::free(ptr);
+}
+
+bool RtThreadSched::set(pthread_t _thread, const RtOptions & rt) {
+    restore();
+    thread = _thread;
+    if (0 != pthread_getschedparam(thread, &old_policy, &old_param))
+        return false;
+
+    sched_param param;
+    param.sched_priority = rt.prio;
+    int err = pthread_setschedparam(thread, rt.policy, &param);
+    if (0 != err) {
+        std::cerr << "pthread_setschedparam: " << std::strerror(err) << "\n";
+        return false;
+    }
+    changed = true;
+    return true;
+}
+
+void RtThreadSched::restore() {
+    if (changed)
+        pthread_setschedparam(thread, old_policy, &old_param);
+    changed = false;
+}
+
+// cpu list in /sys format, like "1-3,8"
+static bool cpu_in_list(const std::string & fname, int cpu) {
+    std::ifstream fd(fname);
+    std::string list;
+    if (not (fd >> list))
+        return false;
+
+    std::stringstream items(list);
+    std::string item;
+    while(std::getline(items, item, ',')) {
+        int first = -1, last = -1;
+        if (2 == std::sscanf(item.c_str(), "%d-%d", &first, &last)) {
+            if (first <= cpu and cpu <= last)
+                return true;
+        } else if (1 == std::sscanf(item.c_str(), "%d", &first) and first == cpu)
+            return true;
+    }
+    return false;
+}
+
+void add_rt_report(StatsList & stats, bool sched_ok) {
+    {
+        std::lock_guard<std::mutex> guard(rt_lock);
+        stats.add("rt_mlock", (unsigned long)rt_mlocked);
+        stats.add("rt_table_kb", (unsigned long)(rt_table_bytes / 1024));
+        stats.add("rt_hugetlb_kb", (unsigned long)(rt_hugetlb_bytes / 1024));
+    }
+    stats.add("rt_sched", (unsigned long)sched_ok);
+
+    int cpu = sched_getcpu();
+    stats.add("env_cpu", (unsigned long)cpu);
+
+    cpu_set_t allowed;
+    if (0 == sched_getaffinity(0, sizeof(allowed), &allowed))
+        stats.add("env_cpus_allowed", (unsigned long)CPU_COUNT(&allowed));
+
+    std::ifstream gov_fd("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cpufreq/scaling_governor");
+    std::string governor;
+    if (gov_fd >> governor)
+        stats.add("env_governor_performance", (unsigned long)("performance" == governor));
+
+    stats.add("env_cpu_isolated", (unsigned long)cpu_in_list("/sys/devices/system/cpu/isolated", cpu));
+    stats.add("env_cpu_nohz_full", (unsigned long)cpu_in_list("/sys/devices/system/cpu/nohz_full", cpu));
+
+    std::ifstream thp_fd("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string thp;
+    if (std::getline(thp_fd, thp)) {
+        unsigned long mode = 0;
+        if (std::string::npos != thp.find("[always]"))
+            mode = 2;
+        else if (std::string::npos != thp.find("[madvise]"))
+            mode = 1;
+        stats.add("env_thp", mode);
+    }
+}
+
+bool opt_tcp_info(const OptionsMap & opts, Transport transport, TcpInfoOptions & tcp_info) {
+    tcp_info = TcpInfoOptions();
+    if (not opt_long(opts, "tcp_info_ms", tcp_info.interval_ms))
+        return false;
+    opt_str(opts, "tcp_info_log", tcp_info.log_prefix);
+
+    if (tcp_info.interval_ms < 0 or tcp_info.interval_ms > 60 * 1000) {
+        std::cerr << "tcp_info_ms should be in [0, 60000], got " << tcp_info.interval_ms << "\n";
+        return false;
+    }
+    if (tcp_info.enabled() and TRANSPORT_TCP != transport) {
+        std::cerr << "tcp_info_ms requires tcp transport\n";
+        return false;
+    }
+    if (not tcp_info.log_prefix.empty() and not tcp_info.enabled()) {
+        std::cerr << "tcp_info_log requires tcp_info_ms\n";
+        return false;
+    }
+    return true;
+}
+
+static const char * tcp_info_names[TI_COUNT] = {
+    "srtt_us", "rttvar_us", "cwnd", "unacked", "notsent_bytes", "delivery_rate"
+};
+
+// 8 buckets per power of 2, 0 has own bucket
+static int tcp_info_bucket(uint64_t value) {
+    return 0 == value ? 0 : 1 + (int)std::lround(std::log2((double)value) * 8);
+}
+
+static uint64_t tcp_info_value(int bucket) {
+    return 0 == bucket ? 0 : (uint64_t)std::pow(2.0, (bucket - 1) / 8.0);
+}
+
+static uint64_t nth_value(std::vector<uint64_t> & values, size_t perc) {
+    if (values.empty())
+        return 0;
+    auto nth = values.begin() + std::min(values.size() - 1, values.size() * perc / 100);
+    std::nth_element(values.begin(), nth, values.end());
+    return *nth;
+}
+
+TcpInfoSampler::TcpInfoSampler(): log(nullptr), done(false), sweeps(0), samples(0),
+                                  errors(0), retrans_total(0), sweep_ns(0) {}
+
+TcpInfoSampler::~TcpInfoSampler() {
+    stop();
+}
+
+bool TcpInfoSampler::start(const std::vector<int> & sock_fds, const TcpInfoOptions & opts,
+                           const std::string & side) {
+    stop();
+    fds = sock_fds;
+    options = opts;
+    for(auto & item: hist)
+        item.clear();
+    retrans.assign(fds.size(), 0);
+    sweeps = samples = errors = retrans_total = sweep_ns = 0;
+
+    if (not options.log_prefix.empty()) {
+        std::string fname = options.log_prefix + "." + side;
+        log = std::fopen(fname.c_str(), "w");
+        if (nullptr == log) {
+            std::perror(("fopen('" + fname + "')").c_str());
+            return false;
+        }
+        std::fprintf(log, "# time_ns conns srtt_p50_us srtt_p99_us rttvar_p50_us cwnd_p50 "
+                          "unacked_p99 notsent_p99 delivery_rate_p50 retrans\n");
+    }
+
+    done = false;
+    thread = std::thread(&TcpInfoSampler::run, this);
+    return true;
+}
+
+void TcpInfoSampler::stop() {
+    if (thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done = true;
+        }
+        wakeup.notify_one();
+        thread.join();
+    }
+
+    if (nullptr != log) {
+        std::fclose(log);
+        log = nullptr;
+    }
+}
+
+void TcpInfoSampler::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    while(not wakeup.wait_for(guard, std::chrono::milliseconds(options.interval_ms), [this] { return done; })) {
+        guard.unlock();
+        sweep();
+        guard.lock();
+    }
+}
+
+void TcpInfoSampler::sweep() {
+    const size_t BATCH = 256;
+    unsigned long started = get_fast_time();
+    std::array<std::vector<uint64_t>, TI_COUNT> values;
+    unsigned long sweep_retrans = 0;
+
+    for(size_t i = 0; i < fds.size(); ++i) {
+        if (0 != i and 0 == i % BATCH)
+            std::this_thread::yield();
+
+        tcp_info info;
+        socklen_t len = sizeof(info);
+        std::memset(&info, 0, sizeof(info));
+        // closed connections give EBADF/ENOTCONN at the end of the test
+        if (0 != getsockopt(fds[i], IPPROTO_TCP, TCP_INFO, &info, &len)) {
+            ++errors;
+            continue;
+        }
+
+        uint64_t sample[TI_COUNT];
+        sample[TI_SRTT_US] = info.tcpi_rtt;
+        sample[TI_RTTVAR_US] = info.tcpi_rttvar;
+        sample[TI_CWND] = info.tcpi_snd_cwnd;
+        sample[TI_UNACKED] = info.tcpi_unacked;
+        // older kernels return shorter struct, missing fields stay zero
+        sample[TI_NOTSENT_BYTES] = info.tcpi_notsent_bytes;
+        sample[TI_DELIVERY_RATE] = info.tcpi_delivery_rate;
+
+        for(int m = 0; m < TI_COUNT; ++m) {
+            values[m].push_back(sample[m]);
+            hist[m].emplace(tcp_info_bucket(sample[m]), 0).first->second++;
+        }
+
+        // first sweep sets baseline
+        if (0 != sweeps)
+            sweep_retrans += info.tcpi_total_retrans - retrans[i];
+        retrans[i] = info.tcpi_total_retrans;
+        ++samples;
+    }
+
+    ++sweeps;
+    retrans_total += sweep_retrans;
+    sweep_ns += get_fast_time() - started;
+
+    if (nullptr != log)
+        std::fprintf(log, "%lu %zu %lu %lu %lu %lu %lu %lu %lu %lu\n", started, values[TI_SRTT_US].size(),
+                     nth_value(values[TI_SRTT_US], 50), nth_value(values[TI_SRTT_US], 99),
+                     nth_value(values[TI_RTTVAR_US], 50), nth_value(values[TI_CWND], 50),
+                     nth_value(values[TI_UNACKED], 99), nth_value(values[TI_NOTSENT_BYTES], 99),
+                     nth_value(values[TI_DELIVERY_RATE], 50), sweep_retrans);
+}
+
+void TcpInfoSampler::add_to(StatsList & stats) const {
+    if (0 == sweeps)
+        return;
+
+    stats.add("tcpi_sweeps", sweeps);
+    stats.add("tcpi_sweep_avg_us", sweep_ns / sweeps / 1000);
+    stats.add("tcpi_errors", errors);
+    stats.add("tcpi_retrans", retrans_total);
+    if (0 == samples)
+        return;
+
+    for(int m = 0; m < TI_COUNT; ++m) {
+        unsigned long seen = 0;
+        uint64_t p50 = 0, p99 = 0;
+        bool p50_found = false;
+        for(const auto & item: hist[m]) {
+            seen += item.second;
+            if (not p50_found and seen * 2 >= samples) {
+                p50 = tcp_info_value(item.first);
+                p50_found = true;
+            }
+            if (seen * 100 >= samples * 99) {
+                p99 = tcp_info_value(item.first);
+                break;
+            }
+        }
+        stats.add(std::string("tcpi_") + tcp_info_names[m] + "_p50", (unsigned long)p50);
+        stats.add(std::string("tcpi_") + tcp_info_names[m] + "_p99", (unsigned long)p99);
+    }
+}
+
+socklen_t make_unix_addr(int port, sockaddr_un & addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    // leading zero byte puts name to abstract namespace
+    std::string name = "network_ping_test." + std::to_string(port);
+    std::memcpy(addr.sun_path + 1, name.c_str(), name.size());
+    return offsetof(sockaddr_un, sun_path) + 1 + name.size();
+}
+
+long process_rss_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    long size = 0, resident = 0;
+    if (not (statm >> size >> resident))
+        return -1;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+long tcp_mem_bytes() {
+    std::ifstream sockstat("/proc/net/sockstat");
+    std::string line;
+    while(std::getline(sockstat, line)) {
+        if (0 != line.compare(0, 4, "TCP:"))
+            continue;
+        std::size_t pos = line.find(" mem ");
+        if (std::string::npos == pos)
+            return -1;
+        return std::atol(line.c_str() + pos + 5) * sysconf(_SC_PAGESIZE);
+    }
+    return -1;
+}
+
+void ConnMemProbe::start() {
+    rss_start = process_rss_bytes();
+    slab_start = meminfo_bytes("SUnreclaim");
+    tcp_start = tcp_mem_bytes();
+}
+
+void ConnMemProbe::done() {
+    rss_done = process_rss_bytes();
+    slab_done = meminfo_bytes("SUnreclaim");
+    tcp_done = tcp_mem_bytes();
+}
+
+void ConnMemProbe::add_to(StatsList & stats, long count) const {
+    if (0 >= count)
+        return;
+    stats.add("conn_mem_rss", (double)(rss_done - rss_start) / count);
+    if (-1 != slab_start and -1 != slab_done)
+        stats.add("conn_mem_slab", (double)(slab_done - slab_start) / count);
+    if (-1 != tcp_start and -1 != tcp_done)
+        stats.add("conn_mem_tcp", (double)(tcp_done - tcp_start) / count);
+}
+
+long meminfo_bytes(const std::string & name) {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    const std::string prefix = name + ":";
+    while(std::getline(meminfo, line))
+        if (0 == line.compare(0, prefix.size(), prefix))
+            return std::atol(line.c_str() + prefix.size()) * 1024;
+    return -1;
 }
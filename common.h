@@ -1,37 +1,530 @@
 #ifndef COMMON_H__
 #define COMMON_H__
+#include <map>
+#include <new>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
 #include <vector>
+#include <condition_variable>
+#include <functional>
+#include <utility>
+#include <algorithm>
 
+#include <sched.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 
 #define MICRO (1000 * 1000)
 #define BILLION (1000 * 1000 * 1000)
 
+// zeroed memory for per connection tables and event arrays. In rt mode big
+// tables are mmap-ed with MAP_HUGETLB or MADV_HUGEPAGE and prefaulted.
+void * alloc_table(size_t size);
+void free_table(void * ptr, size_t size);
+
+template<class T>
+struct TableAllocator {
+    typedef T value_type;
+
+    TableAllocator() {}
+    template<class U> TableAllocator(const TableAllocator<U> &) {}
+
+    T * allocate(size_t count) {
+        T * ptr = (T *)alloc_table(count * sizeof(T));
+        if (nullptr == ptr)
+            throw std::bad_alloc();
+        return ptr;
+    }
+
+    void deallocate(T * ptr, size_t count) {
+        free_table(ptr, count * sizeof(T));
+    }
+
+    template<class U> bool operator==(const TableAllocator<U> &) const { return true; }
+    template<class U> bool operator!=(const TableAllocator<U> &) const { return false; }
+};
+
+typedef std::vector<epoll_event, TableAllocator<epoll_event>> EventVector;
+
 struct EventsList {
-    std::vector<epoll_event> events;
+    EventVector events;
     int num_ready;
     unsigned long recv_time;
 };
 
+// extra test options, passed as whitespace separated KEY=VALUE tokens
+typedef std::map<std::string, std::string> OptionsMap;
+
+bool parse_options(const char * spec, OptionsMap & opts);
+
+// set val from opts[key] if present, false if value is malformed
+bool opt_long(const OptionsMap & opts, const std::string & key, long & val);
+bool opt_double(const OptionsMap & opts, const std::string & key, double & val);
+void opt_str(const OptionsMap & opts, const std::string & key, std::string & val);
+
+enum Transport {
+    TRANSPORT_TCP,
+    TRANSPORT_UNIX_STREAM,
+    TRANSPORT_UNIX_SEQPACKET,
+    TRANSPORT_UDP
+};
+
+// "transport" option: tcp, unix, unix_seqpacket or udp
+bool opt_transport(const OptionsMap & opts, Transport & transport);
+int transport_socktype(Transport transport);
+
+// both sides use abstract unix socket "@network_ping_test.PORT"
+socklen_t make_unix_addr(int port, sockaddr_un & addr);
+
+// ports=N - TCP connections are spread over ports PORT..PORT+N-1, responder
+// listens on all of them, so number of connections isn't limited by ~64k
+// ephemeral ports per loader IP. sock_buf=B - SO_RCVBUF/SO_SNDBUF of TCP
+// connections, small values keep kernel memory per connection low.
+struct ConnOptions {
+    int ports;
+    int sock_buf;   // 0 - system default
+
+    ConnOptions(): ports(1), sock_buf(0) {}
+
+    // PORT..PORT+N-1 are valid ports
+    bool fits(int port) const;
+};
+
+bool opt_conn(const OptionsMap & opts, Transport transport, ConnOptions & conn);
+void set_sock_buffers(int sockfd, int size);
+
+// soft RLIMIT_NOFILE up to the hard one, for many connections runs
+void raise_fd_limit();
+
+// udp mode datagram starts with this header, responder echoes it back as is
+struct UdpHeader {
+    uint32_t flow;
+    uint32_t seq;
+    uint64_t send_time;
+};
+
+// flow id of "test is over" datagram, sent by loader
+const uint32_t UDP_END_FLOW = 0xFFFFFFFF;
+
+// UDP_SEGMENT accepts up to 64 segments per send
+const int UDP_MAX_SEGMENTS = 64;
+
+// enlarge SO_RCVBUF/SO_SNDBUF, so burst of pings from all flows fits
+void set_udp_buffers(int sockfd, int size);
+
+// current process RSS, read from /proc/self/statm
+long process_rss_bytes();
+
+// field from /proc/meminfo in bytes, -1 if not found
+long meminfo_bytes(const std::string & name);
+
+// TCP socket buffers memory, "mem" pages of /proc/net/sockstat, -1 if unknown
+long tcp_mem_bytes();
+
+// named values, reported to the test driver as "NAME VALUE" pairs
+class StatsList {
+public:
+    std::vector<std::pair<std::string, std::string>> items;
+
+    void add(const std::string & name, unsigned long value);
+    void add(const std::string & name, double value);
+    void serialize(std::string & out) const;
+};
+
+// memory cost of connections: process RSS, kernel slab and TCP buffers
+// deltas over connect/accept. Kernel values are system wide, so they are
+// only meaningful on otherwise idle host.
+struct ConnMemProbe {
+    long rss_start, slab_start, tcp_start;
+    long rss_done, slab_done, tcp_done;
+
+    void start();
+    // all connections are established
+    void done();
+    // conn_mem_rss, conn_mem_slab and conn_mem_tcp bytes per connection
+    void add_to(StatsList & stats, long count) const;
+};
+
+// log2 buckets of events count per wakeup: 0, 1, 2-3, 4-7, ...
+const int WAKEUP_HIST_SIZE = 18;
+
+// cheap per-selector event loop counters, updated by the owner thread only
+struct SelectorStats {
+    unsigned long wait_calls;
+    unsigned long empty_wakeups;
+    unsigned long events;
+    unsigned long eintr;
+    unsigned long recv_eagain;
+    unsigned long write_eagain;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long syscalls;
+    // complete frames, framing=lp only
+    unsigned long frames;
+    // time spent in synthetic request handling, service_ns/service_kb only
+    unsigned long service_ns;
+    std::array<unsigned long, WAKEUP_HIST_SIZE> events_hist;
+
+    SelectorStats() { clear(); }
+    void clear();
+
+    void on_wakeup(int num_ready) {
+        ++wait_calls;
+        ++syscalls;
+        if (0 == num_ready) {
+            ++empty_wakeups;
+            ++events_hist[0];
+            return;
+        }
+        events += num_ready;
+        int bucket = 64 - __builtin_clzl((unsigned long)num_ready);
+        ++events_hist[bucket < WAKEUP_HIST_SIZE ? bucket : WAKEUP_HIST_SIZE - 1];
+    }
+
+    // thread per connection: blocking read of the own socket returned, the
+    // read itself is counted in syscalls by the caller
+    void on_blocking_wakeup() {
+        ++wait_calls;
+        ++events;
+        ++events_hist[1];
+    }
+
+    SelectorStats & operator+=(const SelectorStats & other);
+    void add_to(StatsList & stats, const std::string & prefix) const;
+};
+
+// framing=lp - length prefixed messages. Loader sends FrameHeader and body_len
+// bytes, responder answers with FrameHeader{reply_len, 0} and reply_len bytes.
+struct FrameHeader {
+    uint32_t body_len;
+    uint32_t reply_len;
+};
+
+// body_len and reply_len limit, loader doesn't accept larger sizes in options,
+// FrameParser stops on larger header
+const uint32_t MAX_FRAME_LEN = 1U << 30;
+
+// "framing" option: raw (default, fixed size messages) or lp
+bool opt_framing(const OptionsMap & opts, bool & framed);
+
+// incremental frame parser state for one connection. Data is read into
+// caller's buffer and bodies are skipped in place, so only partially
+// received header is kept here. Zeroed memory is a valid initial state.
+struct FrameParser {
+    FrameHeader header;
+    uint32_t header_got;
+    uint32_t body_left;
+    bool in_body;
+
+    // on_frame(header) is called for every frame, completed by data
+    template<class F>
+    bool feed(const char * data, size_t size, F && on_frame) {
+        for(;;) {
+            if (in_body) {
+                size_t chunk = std::min((size_t)body_left, size);
+                body_left -= chunk;
+                data += chunk;
+                size -= chunk;
+                if (0 != body_left)
+                    return true;
+                in_body = false;
+                if (not on_frame(header))
+                    return false;
+            } else {
+                if (0 == size)
+                    return true;
+                size_t chunk = std::min(sizeof(header) - header_got, size);
+                std::memcpy((char *)&header + header_got, data, chunk);
+                header_got += chunk;
+                data += chunk;
+                size -= chunk;
+                if (sizeof(header) != header_got)
+                    return true;
+                header_got = 0;
+                if (header.body_len > MAX_FRAME_LEN or header.reply_len > MAX_FRAME_LEN) {
+                    std::fprintf(stderr, "Frame size %u/%u is above %u\n",
+                                 header.body_len, header.reply_len, MAX_FRAME_LEN);
+                    return false;
+                }
+                body_left = header.body_len;
+                in_body = true;
+            }
+        }
+    }
+};
+
+// read all available data from sockfd into parser. Returns number of
+// completed frames or -1 on EOF/error. first_wait=true allows first recv
+// to block - for thread per connection engines. max_frames != 0 stops
+// reading after that many frames - for loader with one request in flight.
+template<class F>
+int read_frames(int sockfd, FrameParser & parser, char * buffer, size_t buffer_size,
+                SelectorStats & stats, bool first_wait, int max_frames, F && on_frame)
+{
+    int frames = 0;
+    int flags = first_wait ? 0 : MSG_DONTWAIT;
+    auto on_frame_counted = [&](const FrameHeader & header) {
+        ++frames;
+        return on_frame(header);
+    };
+
+    for(;;) {
+        int bc = recv(sockfd, buffer, buffer_size, flags);
+        ++stats.syscalls;
+        if (0 > bc) {
+            if (EAGAIN == errno or EWOULDBLOCK == errno) {
+                ++stats.recv_eagain;
+                break;
+            }
+            if (ECONNRESET != errno)
+                std::perror("recv(sockfd, buffer, buffer_size, ...)");
+            return -1;
+        } else if (0 == bc) {
+            return -1;
+        }
+        stats.bytes_in += bc;
+
+        if (not parser.feed(buffer, bc, on_frame_counted))
+            return -1;
+
+        // with EPOLLET socket must be drained till EAGAIN, or FIN, which came
+        // together with data, is lost. Blocking thread would see it on next call.
+        if (first_wait and (size_t)bc < buffer_size)
+            break;
+        if (0 != max_frames and frames >= max_frames)
+            break;
+        flags = MSG_DONTWAIT;
+    }
+
+    stats.frames += frames;
+    return frames;
+}
+
+// write all iov_count buffers, iov is modified. Waits for POLLOUT on non
+// blocking sockets, so it's for responders only: loader, which never
+// blocks, keeps reading replies, which peer is blocked on. Loader uses
+// SendQueue.
+bool writev_all(int sockfd, struct iovec * iov, int iov_count, SelectorStats & stats);
+
+// write count frames - headers and header.body_len filler bytes,
+// coalesced into as few writev calls as possible
+bool send_frames(int sockfd, const FrameHeader * headers, int count, SelectorStats & stats);
+
+inline bool send_frame(int sockfd, const FrameHeader & header, SelectorStats & stats) {
+    return send_frames(sockfd, &header, 1, stats);
+}
+
+// write count copies of message, coalesced like send_frames
+bool send_copies(int sockfd, const char * message, size_t message_len, int count, SelectorStats & stats);
+
+// read all available data from sockfd, buffer content is dropped. Returns
+// number of bytes read or -1 on EOF/error. first_wait is as for read_frames.
+long recv_available(int sockfd, char * buffer, size_t buffer_size, SelectorStats & stats, bool first_wait);
+
+bool set_nodelay(int sockfd, bool enable=true);
+
+// "pipeline" option - requests in flight per connection, default 1.
+// Raw messages are counted by size, so both sides must know the depth.
+bool opt_pipeline(const OptionsMap & opts, int & pipeline);
+
+// tcp_info_ms=N - background thread sweeps all TCP connections with
+// getsockopt(TCP_INFO) every N ms, both on loader and responder.
+// tcp_info_log=PREFIX - per sweep summary lines to PREFIX.loader and
+// PREFIX.responder, to put kernel RTT next to lat_log samples.
+struct TcpInfoOptions {
+    long interval_ms;
+    std::string log_prefix;
+
+    TcpInfoOptions(): interval_ms(0) {}
+
+    bool enabled() const {
+        return 0 != interval_ms;
+    }
+};
+
+bool opt_tcp_info(const OptionsMap & opts, Transport transport, TcpInfoOptions & tcp_info);
+
+enum TcpInfoMetric {
+    TI_SRTT_US,
+    TI_RTTVAR_US,
+    TI_CWND,
+    TI_UNACKED,
+    TI_NOTSENT_BYTES,
+    TI_DELIVERY_RATE,   // bytes per second
+    TI_COUNT
+};
+
+// Worker loops aren't touched, the only interference is socket lock,
+// taken by getsockopt for a moment. Sockets are swept in batches with
+// yield in between, to not hold the CPU shared with workers for the whole
+// sweep. Values of all sweeps go to log scale histograms, reported as
+// tcpi_METRIC_p50/p99, retransmits as delta of tcpi_total_retrans.
+class TcpInfoSampler {
+protected:
+    std::vector<int> fds;
+    TcpInfoOptions options;
+    FILE * log;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wakeup;
+    bool done;
+
+    // written by sampler thread, read after stop()
+    std::array<std::map<int, unsigned long>, TI_COUNT> hist;
+    std::vector<uint32_t> retrans;
+    unsigned long sweeps, samples, errors, retrans_total, sweep_ns;
+
+    void run();
+    void sweep();
+
+private:
+    TcpInfoSampler(const TcpInfoSampler &);
+
+public:
+    TcpInfoSampler();
+    ~TcpInfoSampler();
+
+    // side - log file suffix, "loader" or "responder"
+    bool start(const std::vector<int> & sock_fds, const TcpInfoOptions & opts, const std::string & side);
+    void stop();
+    bool running() const {
+        return thread.joinable();
+    }
+    void add_to(StatsList & stats) const;
+};
+
+// rt=1 - deterministic latency mode for loader and cpp_* responders.
+// Memory is locked with mlockall, per connection tables and selector event
+// arrays are prefaulted and backed by huge pages where possible, event loop
+// threads run with rt_policy=fifo|rr at rt_prio=N. Failures (no
+// CAP_SYS_NICE/CAP_IPC_LOCK) are reported in stats, the run goes on.
+struct RtOptions {
+    bool enabled;
+    int policy;
+    int prio;
+
+    RtOptions(): enabled(false), policy(SCHED_FIFO), prio(50) {}
+};
+
+bool opt_rt(const OptionsMap & opts, RtOptions & rt);
+
+// threads, created while rt memory is on, get stacks of this size instead
+// of the multi-MB default, which MCL_FUTURE would lock whole
+const size_t RT_THREAD_STACK = 256 * 1024;
+
+// process wide memory part of rt mode, repeated calls are no-op
+bool rt_memory_enable(size_t thread_stack = RT_THREAD_STACK);
+void rt_memory_disable();
+
+// SCHED_FIFO/RR for a thread, restore() puts back the previous policy
+class RtThreadSched {
+protected:
+    pthread_t thread;
+    int old_policy;
+    sched_param old_param;
+    bool changed;
+
+public:
+    RtThreadSched(): old_policy(SCHED_OTHER), changed(false) {}
+    bool set(pthread_t _thread, const RtOptions & rt);
+    void restore();
+};
+
+// rt_mlock, rt_sched, rt_table_kb, rt_hugetlb_kb and environment noise of
+// the calling thread CPU: env_cpu, env_cpus_allowed, env_governor_performance,
+// env_cpu_isolated (isolcpus), env_cpu_nohz_full, env_thp (0 - never,
+// 1 - madvise, 2 - always). CPU sharing shows up as perf_runq_wait_us.
+void add_rt_report(StatsList & stats, bool sched_ok);
+
+enum PerfCounterId {
+    PC_TASK_CLOCK,
+    PC_CONTEXT_SWITCHES,
+    PC_PAGE_FAULTS,
+    PC_CYCLES,
+    PC_INSTRUCTIONS,
+    PC_CACHE_MISSES,
+    PC_SYSCALLS,
+    PC_COUNT
+};
+
+// per-thread cost of a measurement window, summed over threads
+struct ThreadCounters {
+    std::array<unsigned long, PC_COUNT> values;
+    // counter was opened in every thread, summed into values
+    std::array<bool, PC_COUNT> valid;
+    bool user_only;
+    unsigned long utime_us, stime_us;
+    unsigned long minflt, majflt, nvcsw, nivcsw;
+    // time runnable, but waiting for CPU (schedstat), not for inherit mode
+    unsigned long runq_wait_ns;
+    bool runq_valid;
+    int threads;
+
+    ThreadCounters() { clear(); }
+    void clear();
+    ThreadCounters & operator+=(const ThreadCounters & other);
+
+    // messages - messages processed in window, used for per message costs
+    void add_to(StatsList & stats, const std::string & prefix, unsigned long messages) const;
+};
+
+// perf_event_open + getrusage(RUSAGE_THREAD) counters for the calling thread.
+// Counters are opened disabled in constructor, so the measurement window
+// is exactly [start(), destructor) - result is added to *out on destruction.
+// Hardware counters and syscalls tracepoint are optional and silently
+// skipped if kernel/permissions don't allow them. If kernel counting isn't
+// allowed, all counters are user space only, reported as user_only.
+// With inherit=true counters also count all threads, created by the calling
+// one after construction (kernel adds them up on thread exit), and
+// RUSAGE_SELF is used - for thread per connection engines, which can't
+// afford a set of perf fds per thread.
+class PerfCounters {
+protected:
+    std::array<int, PC_COUNT> fds;
+    std::array<uint64_t, PC_COUNT> base;
+    ThreadCounters * out;
+    bool started, user_only, inherit;
+    unsigned long utime_us, stime_us;
+    unsigned long minflt, majflt, nvcsw, nivcsw;
+    unsigned long runq_wait_ns;
+    bool runq_valid;
+
+private:
+    PerfCounters(const PerfCounters &);
+
+public:
+    PerfCounters(ThreadCounters * _out, bool _inherit=false);
+    ~PerfCounters();
+    void start();
+    void stop();
+};
+
 class RSelector {
 public:
+    SelectorStats stats;
+
     virtual bool add_fd(int sockfd) = 0;
     virtual void remove_current_ready() = 0;
     virtual bool wait(long int timeout_ns=-1) = 0;
     virtual bool next(int & sockfd, uint32_t & flags) = 0;
 };
 
-class EPollRSelector: public RSelector {
+class EPollRSelector final: public RSelector {
 protected:
     int efd;
     EventsList events;
-    std::vector<epoll_event>::iterator current_ready;
-    std::vector<epoll_event>::iterator end_of_ready;
-
-#ifdef EPOLL_CALL_STATS
-    unsigned long int sock_activation_count;
-    unsigned int wait_count;
-#endif
+    EventVector::iterator current_ready;
+    EventVector::iterator end_of_ready;
 
 private:
   EPollRSelector();
@@ -47,18 +540,74 @@ public:
     }
 
     bool add_fd(int sockfd, int events);
+    bool modify_fd(int sockfd, int events);
+    void remove_fd(int sockfd);
     bool wait(long int timeout_ns=-1);
     void remove_current_ready();
-    int ready_count() const;
-    bool next(int & sockfd, uint32_t & flags);
-    bool next(int & sockfd);
+
+    // per event calls are inline, loops templated on selector type
+    // call them without virtual dispatch
+    int ready_count() const {
+        return end_of_ready - current_ready;
+    }
+
+    bool next(int & sockfd, uint32_t & flags) {
+        if(end_of_ready == current_ready)
+            return false;
+
+        sockfd = current_ready->data.fd;
+        flags = current_ready->events;
+        ++current_ready;
+        return true;
+    }
+
+    bool next(int & sockfd) {
+        if(end_of_ready == current_ready)
+            return false;
+
+        sockfd = current_ready->data.fd;
+        ++current_ready;
+        return true;
+    }
+};
+
+// frames or raw message copies, which socket didn't accept yet. Loader
+// keeps them per connection and writes the rest on EPOLLOUT instead of
+// blocking: responder may be blocked on a large reply on other connection
+// of the same worker, which would never be read then. Bodies are filler,
+// so only headers and counters are kept.
+class SendQueue {
+protected:
+    std::vector<FrameHeader> frames;    // from head, frames[head] may be partially sent
+    size_t head;
+    unsigned long sent;                 // bytes of frames[head]
+    const char * message;               // raw copies, must outlive the queue
+    size_t message_len, message_off;
+    unsigned long raw_left;
+    bool out_enabled;                   // EPOLLOUT is on for the socket
+
+public:
+    SendQueue(): head(0), sent(0), message(nullptr), message_len(0), message_off(0),
+                 raw_left(0), out_enabled(false) {}
+
+    bool empty() const {
+        return head == frames.size() and 0 == raw_left;
+    }
+
+    void add_frames(const FrameHeader * headers, int count);
+    void add_copies(const char * _message, size_t _message_len, int count);
+
+    // write till EAGAIN, EPOLLOUT is on in sel while queue isn't empty.
+    // false on error
+    bool flush(int sockfd, EPollRSelector & sel, SelectorStats & stats);
 };
 
 // epoll_wait support timeout only with ms granularity
 // while we need at least us presicion
 bool epoll_wait_ex(int epollfd,
                    EventsList & ready,
-                   long int timeout_ns);
+                   long int timeout_ns,
+                   SelectorStats * stats=nullptr);
 
 inline unsigned long get_fast_time() {
    timespec curr_time;
@@ -74,4 +623,22 @@ inline unsigned long get_fast_time() {
    // return (unsigned long) duration_cast<nanoseconds>(curr_time).count();
 }
 
+// owd=1 clock: system wide on one host, so loader, responder and main.py
+// clock exchange agree on it, offset between hosts is estimated
+inline unsigned long get_mono_time() {
+   timespec curr_time;
+   if( -1 == clock_gettime( CLOCK_MONOTONIC, &curr_time)) {
+     perror( "clock gettime" );
+     return 0;
+   }
+   return curr_time.tv_nsec + ((unsigned long)curr_time.tv_sec) * BILLION;
+}
+
+// owd=1: responder puts receive and send time of the request at the start
+// of the reply, so reply should be at least sizeof(OwdStamp) bytes
+struct OwdStamp {
+    uint64_t recv_ns;
+    uint64_t send_ns;
+};
+
 #endif //COMMON_H__
@@ -0,0 +1,66 @@
+"""
+Read loader latency logs written with lat_log=PREFIX option.
+
+    lat_log.py PREFIX.*          - all samples merged by time: 'TIME_NS WORKER FD LAT_NS SIZE'
+    lat_log.py --top K PREFIX.*  - K slowest samples
+    lat_log.py --info PREFIX.*   - per file headers
+
+Format (little endian): header - magic 'NPLATLG1', u32 worker, u32 sample, u64 record_count,
+u64 dropped, then records - u64 time_ns, u64 lat_ns, u32 fd, u32 size. Records of one file
+are sorted by time.
+"""
+
+import sys
+import heapq
+import struct
+import argparse
+
+
+MAGIC = b'NPLATLG1'
+header_fmt = struct.Struct("<8sIIQQ")
+record_fmt = struct.Struct("<QQII")
+CHUNK = 4096
+
+
+def read_header(fd, fname):
+    magic, worker, sample, record_count, dropped = header_fmt.unpack(fd.read(header_fmt.size))
+    if magic != MAGIC:
+        raise ValueError("{!r} isn't a latency log".format(fname))
+    return worker, sample, record_count, dropped
+
+
+def records(fname):
+    with open(fname, "rb") as fd:
+        worker, _, record_count, _ = read_header(fd, fname)
+        while record_count:
+            count = min(record_count, CHUNK)
+            data = fd.read(count * record_fmt.size)
+            for time_ns, lat_ns, sockfd, size in record_fmt.iter_unpack(data):
+                yield time_ns, worker, sockfd, lat_ns, size
+            record_count -= count
+
+
+def main(argv):
+    parser = argparse.ArgumentParser()
+    parser.add_argument('files', nargs='+')
+    parser.add_argument('--top', type=int, default=0, help="print only K slowest samples")
+    parser.add_argument('--info', action='store_true', help="print file headers")
+    opts = parser.parse_args(argv[1:])
+
+    if opts.info:
+        for fname in opts.files:
+            with open(fname, "rb") as fd:
+                print("{}: worker={} sample={} records={} dropped={}".format(fname, *read_header(fd, fname)))
+        return 0
+
+    samples = heapq.merge(*map(records, opts.files))
+    if opts.top:
+        samples = heapq.nlargest(opts.top, samples, key=lambda rec: rec[3])
+
+    for rec in samples:
+        print("{} {} {} {} {}".format(*rec))
+    return 0
+
+
+if __name__ == "__main__":
+    exit(main(sys.argv))
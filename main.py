@@ -4,8 +4,10 @@ import time
 import queue
 import ctypes
 import socket
+import struct
 import asyncio
 import argparse
+import itertools
 import traceback
 import selectors
 import threading
@@ -27,6 +29,7 @@ class TestParams:
         self.runtime = None
         self.timeout = None
         self.local_addr = None
+        self.opts = {}
 
 
 def prepare_socket(sock, set_no_block=True):
@@ -360,8 +363,43 @@ def go_test(params, ready_to_connect, before_test, after_test):
          TIME_CB(after_test))
 
 
+def parse_stats(tokens):
+    "parse 'COUNT NAME VAL NAME VAL ...' stats section, returns (stats, rest_tokens)"
+    if not tokens:
+        return {}, tokens
+
+    count = int(tokens[0])
+    items = tokens[1: 1 + count * 2]
+    stats = {}
+    for name, val in zip(items[::2], items[1::2]):
+        if isinstance(name, bytes):
+            name, val = name.decode('ascii'), val.decode('ascii')
+        stats[name] = float(val) if ('.' in val or 'e' in val) else int(val)
+    return stats, tokens[1 + count * 2:]
+
+
+def get_c_stats(so):
+    func = getattr(so, "get_last_stats")
+    func.restype = ctypes.c_int
+    func.argtypes = [ctypes.c_char_p, ctypes.c_int]
+    size = func(None, 0)
+    buff = ctypes.create_string_buffer(size + 1)
+    func(buff, size + 1)
+    return parse_stats(buff.value.split())[0]
+
+
+def opts_to_str(opts):
+    return " ".join("{}={}".format(key, val) for key, val in sorted(opts.items()))
+
+
 def run_c_test(fname, params, ready_to_connect, before_test, after_test):
     so = ctypes.cdll.LoadLibrary("./bin/libclient.so")
+
+    set_opts = getattr(so, "set_test_options")
+    set_opts.restype = ctypes.c_int
+    set_opts.argtypes = [ctypes.c_char_p]
+    if 0 != set_opts(opts_to_str(params.opts).encode('ascii')):
+        raise ValueError("libclient.so rejects options {!r}".format(params.opts))
     func = getattr(so, fname)
     func.restype = ctypes.c_int
     func.argtypes = [ctypes.POINTER(ctypes.c_char),  # local ip
@@ -382,6 +420,8 @@ def run_c_test(fname, params, ready_to_connect, before_test, after_test):
          TIME_CB(before_test),
          TIME_CB(after_test))
 
+    return get_c_stats(so)
+
 
 @im_test
 def cpp_poll_test(*params):
@@ -398,40 +438,241 @@ def cpp_th_test(*params):
     return run_c_test("run_test_th", *params)
 
 
+@im_test
+def cpp_th_small_test(*params):
+    return run_c_test("run_test_th_small", *params)
+
+
+@im_test
+def cpp_coro_test(*params):
+    return run_c_test("run_test_coro", *params)
+
+
+@im_test
+def cpp_fiber_test(*params):
+    return run_c_test("run_test_fiber", *params)
+
+
+@im_test
+def cpp_udp_test(*params):
+    return run_c_test("run_test_udp", *params)
+
+
+@im_test
+def cpp_relay_test(*params):
+    return run_c_test("run_test_relay", *params)
+
+
+def monotonic_ns():
+    # time.clock_gettime_ns is python3.7+
+    return int(time.clock_gettime(time.CLOCK_MONOTONIC) * 1000000000)
+
+
+def answer_clock_probes(sock):
+    "owd=1: loader sends b'C' probes till b'E', answer is receive and send CLOCK_MONOTONIC time"
+    while True:
+        probe = sock.recv(1)
+        received = monotonic_ns()
+        if probe != b'C':
+            return
+        sock.sendall(struct.pack("<QQ", received, monotonic_ns()))
+
+
 def get_run_stats(func, params):
     times = []
     s = socket.socket()
     s.connect(params.loader_addr)
+    clock_thread = None
+    if params.opts.get('owd', '0') != '0':
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        clock_thread = threading.Thread(target=answer_clock_probes, args=(s,), daemon=True)
 
     def ready_func():
         s.send(("{0.local_addr[0]} {0.local_addr[1]} {0.count} " +
-                "{0.runtime} {0.timeout[0]} {0.timeout[1]} {0.msize}").format(params).encode('ascii'))
+                "{0.runtime} {0.timeout[0]} {0.timeout[1]} {0.msize} ").format(params).encode('ascii') +
+               opts_to_str(params.opts).encode('ascii'))
+        if clock_thread is not None:
+            clock_thread.start()
 
     def stamp():
         times.append(os.times())
 
-    func(params, ready_func, stamp, stamp)
+    responder_stats = func(params, ready_func, stamp, stamp) or {}
+    # the rest of control stream is loader result
+    if clock_thread is not None and clock_thread.ident is not None:
+        clock_thread.join()
 
     utime = times[1].user - times[0].user
     stime = times[1].system - times[0].system
     ctime = times[1].elapsed - times[0].elapsed
 
-    result = s.recv(1024 * 64)
+    chunks = []
+    while True:
+        chunk = s.recv(1024 * 64)
+        if not chunk:
+            break
+        chunks.append(chunk)
+    result = b"".join(chunks)
     s.close()
 
-    msg_processed, lat_base, *lat_distribution_and_percentiles_s = result.split()
-    lat_distribution_and_percentiles = list(map(int, lat_distribution_and_percentiles_s))
+    return (utime, stime, ctime) + parse_loader_result(result) + (responder_stats,)
 
-    lats_size = lat_distribution_and_percentiles[0]
-    lat_distribution_raw = lat_distribution_and_percentiles[1: 1 + lats_size * 2]
-    raw_msg_percentiles = lat_distribution_and_percentiles[1 + lats_size * 2:]
 
+def parse_loader_result(result):
+    msg_processed, lat_base, *rest = result.split()
+
+    lats_size = int(rest[0])
+    lat_distribution_raw = list(map(int, rest[1: 1 + lats_size * 2]))
     lat_distribution = dict(zip(lat_distribution_raw[::2], lat_distribution_raw[1::2]))
-    perc_size = raw_msg_percentiles[0]
-    assert len(raw_msg_percentiles) == perc_size + 1
-    percentiles = raw_msg_percentiles[1:]
+    rest = rest[1 + lats_size * 2:]
+
+    perc_size = int(rest[0])
+    percentiles = list(map(int, rest[1: 1 + perc_size]))
+    assert len(percentiles) == perc_size
+
+    loader_stats, _ = parse_stats(rest[1 + perc_size:])
+
+    return int(msg_processed), float(lat_base), lat_distribution, percentiles, loader_stats
+
+
+# --sweep KEY=V1,V2,... - steps are all combinations, the first key changes slowest.
+# Loader keeps connections between steps and only adds/closes the difference,
+# responder is cpp_epoll (run_test_sweep in libclient.so)
+SWEEP_KEYS = ('count', 'msize', 'workers', 'timeout', 'nodelay')
+
+
+def parse_sweep(specs):
+    axes = []
+    for spec in specs:
+        key, vals = spec.split('=', 1)
+        if key not in SWEEP_KEYS:
+            raise ValueError("Can't sweep over {!r}, only {}".format(key, ", ".join(SWEEP_KEYS)))
+        axes.append([(key, int(val)) for val in vals.split(',')])
+    return [dict(step) for step in itertools.product(*axes)]
+
+
+def sweep_step_params(params, step):
+    step_params = TestParams()
+    step_params.__dict__.update(params.__dict__)
+    step_params.opts = dict(params.opts, sweep='1')
+    step_params.count = step.get('count', params.count)
+    step_params.msize = step.get('msize', params.msize)
+    if 'timeout' in step:
+        step_params.timeout = (step['timeout'], step['timeout'])
+    for key in ('workers', 'nodelay'):
+        if key in step:
+            step_params.opts[key] = str(step[key])
+    return step_params
+
+
+def recv_sweep_result(sock):
+    "sweep results are 'SIZE\\n' + result"
+    data = b""
+    while b"\n" not in data:
+        chunk = sock.recv(1024 * 64)
+        if not chunk:
+            raise RuntimeError("Loader closed control connection")
+        data += chunk
+    size, data = data.split(b"\n", 1)
+    while len(data) < int(size):
+        chunk = sock.recv(1024 * 64)
+        if not chunk:
+            raise RuntimeError("Loader closed control connection")
+        data += chunk
+    return data
+
+
+def get_sweep_stats(params, steps):
+    "returns list of (step, run stats as from get_run_stats) for finished steps and error"
+    so = ctypes.cdll.LoadLibrary("./bin/libclient.so")
+    first = sweep_step_params(params, steps[0])
+
+    set_opts = getattr(so, "set_test_options")
+    set_opts.restype = ctypes.c_int
+    set_opts.argtypes = [ctypes.c_char_p]
+    if 0 != set_opts(opts_to_str(first.opts).encode('ascii')):
+        raise ValueError("libclient.so rejects options {!r}".format(first.opts))
+
+    sweep_step = so.sweep_step
+    sweep_step.restype = ctypes.c_int
+    sweep_step.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_char_p, ctypes.c_int]
+
+    results = []
+    errors = []
 
-    return utime, stime, ctime, int(msg_processed), float(lat_base), lat_distribution, percentiles
+    def control():
+        s = socket.socket()
+        try:
+            s.connect(params.loader_addr)
+            for idx, step in enumerate(steps):
+                step_params = sweep_step_params(params, step)
+                start = os.times()
+                s.send(("{0.local_addr[0]} {0.local_addr[1]} {0.count} " +
+                        "{0.runtime} {0.timeout[0]} {0.timeout[1]} {0.msize} ").format(step_params).encode('ascii') +
+                       opts_to_str(step_params.opts).encode('ascii'))
+                loader_res = parse_loader_result(recv_sweep_result(s))
+                done = os.times()
+
+                # loader is idle now, switch responder to the next step
+                next_params = sweep_step_params(params, steps[min(idx + 1, len(steps) - 1)])
+                buff = ctypes.create_string_buffer(64 * 1024)
+                size = sweep_step(next_params.msize, int(next_params.opts.get('nodelay', -1)), buff, len(buff))
+                if size < 0 or size >= len(buff):
+                    raise RuntimeError("Can't get responder stats for step {}".format(step))
+                responder_stats = parse_stats(buff.value.split())[0]
+
+                results.append((step, (done.user - start.user, done.system - start.system,
+                                       done.elapsed - start.elapsed) + loader_res + (responder_stats,)))
+            s.send(b"end")
+        except Exception:
+            errors.append(traceback.format_exc())
+            so.sweep_abort()
+        finally:
+            s.close()
+
+    thread = threading.Thread(target=control)
+    max_count = max(step.get('count', params.count) for step in steps)
+
+    func = so.run_test_sweep
+    func.restype = ctypes.c_int
+    func.argtypes = [ctypes.POINTER(ctypes.c_char), ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                     TIME_CB, TIME_CB, TIME_CB]
+    if 0 != func(params.local_addr[0].encode(), params.local_addr[1], max_count, first.msize,
+                 get_listen_param(max_count), TIME_CB(thread.start), TIME_CB(lambda: None), TIME_CB(lambda: None)):
+        errors.append("run_test_sweep failed")
+    if thread.ident is not None:
+        thread.join()
+
+    return results, (errors[0] if errors else None)
+
+
+def make_result(func_name, run_stats):
+    utime, stime, ctime, msg_processed, lat_base, \
+        lat_distribution, msg_percentiles, loader_stats, responder_stats = run_stats
+
+    assert len(msg_percentiles) == 19
+
+    lat_50, lat_75, lat_95 = get_lats(lat_distribution, lat_base)
+
+    curr_res = dict(
+        func=func_name,
+        utime="{:.2f}".format(utime),
+        stime="{:.2f}".format(stime),
+        ctime="{:.2f}".format(ctime),
+        lat_50=ns_to_readable(lat_50),
+        lat_95=ns_to_readable(lat_95),
+        msg_5perc=msg_percentiles[0],
+        msg_95perc=msg_percentiles[-1],
+        messages=msg_processed)
+    if loader_stats:
+        curr_res['loader'] = loader_stats
+    if responder_stats:
+        curr_res['responder'] = responder_stats
+    # both are exact means of raw RTTs, not histogram estimates
+    if 'relay_upstream_rtt_avg_ns' in responder_stats and 'avg_lat_ns' in loader_stats:
+        curr_res['relay_added_lat_ns'] = \
+            int(loader_stats['avg_lat_ns'] - responder_stats['relay_upstream_rtt_avg_ns'])
+    return curr_res
 
 
 def print_lat_stats(lats, log_base):
@@ -443,7 +684,7 @@ def print_lat_stats(lats, log_base):
 
 def get_lats(lats, log_base, percs=(0.5, 0.75, 0.95)):
 
-    all_mess = sum(lats)
+    all_mess = sum(lats.values())
     if 0 == all_mess:
         return [0] * len(percs)
 
@@ -486,6 +727,11 @@ def main(argv):
     parser.add_argument('--timeout', '-t', type=int, default=0)
     parser.add_argument('--max-timeout', type=int, default=None)
     parser.add_argument('--min-timeout', type=int, default=None)
+    parser.add_argument('--opt', '-o', type=str, nargs='*', default=[],
+                        help="KEY=VAL test options for loader and cpp tests, e.g. transport=unix")
+    parser.add_argument('--sweep', type=str, nargs='*', default=[],
+                        help="KEY=V1,V2,... run all combinations in one session reusing connections, " +
+                             "keys: " + ", ".join(SWEEP_KEYS) + ", cpp_epoll only")
 
     opts = parser.parse_args(argv[1:])
 
@@ -496,6 +742,10 @@ def main(argv):
     params.count = opts.count
     params.runtime = opts.runtime
 
+    for data in opts.opt:
+        key, val = data.split('=', 1)
+        params.opts[key] = val
+
     if opts.timeout and (opts.max_timeout or opts.min_timeout):
         print("--runtime option is conflict with --max-timeout/--min-timeout")
         return 1
@@ -529,6 +779,17 @@ def main(argv):
 
     run_tests.sort(key=lambda x: x.__name__)
 
+    steps = None
+    if opts.sweep:
+        if run_tests != [cpp_epoll_test]:
+            print("--sweep supports cpp_epoll only")
+            return 1
+        try:
+            steps = parse_sweep(opts.sweep)
+        except ValueError as exc:
+            print(exc)
+            return 1
+
     results_struct = dict(
         workers=opts.count,
         server="{0.loader_ip}:{0.loader_port}".format(opts),
@@ -539,6 +800,9 @@ def main(argv):
         data=[],
     )
 
+    if params.opts:
+        results_struct['opts'] = params.opts
+
     if opts.meta != []:
         results_struct['meta'] = {}
         for data in opts.meta:
@@ -555,25 +819,19 @@ def main(argv):
 
     for func in run_tests:
         for i in range(opts.rounds):
+            if steps:
+                step_results, err = get_sweep_stats(params, steps)
+                for step, run_stats in step_results:
+                    curr_res = make_result(func.test_name, run_stats)
+                    curr_res['step'] = step
+                    results_struct['data'].append(curr_res)
+                if err:
+                    print(err, file=sys.stderr)
+                    results_struct['data'].append(dict(func=func.test_name, err=err.strip().split("\n")[-1]))
+                continue
+
             try:
-                utime, stime, ctime, msg_processed, lat_base, \
-                    lat_distribution, msg_percentiles = get_run_stats(func, params)
-
-                assert len(msg_percentiles) == 19
-
-                lat_50, lat_75, lat_95 = get_lats(lat_distribution, lat_base)
-
-                curr_res = dict(
-                    func=func.__name__.replace("_test", ''),
-                    utime="{:.2f}".format(utime),
-                    stime="{:.2f}".format(stime),
-                    ctime="{:.2f}".format(ctime),
-                    lat_50=ns_to_readable(lat_50),
-                    lat_95=ns_to_readable(lat_95),
-                    msg_5perc=msg_percentiles[0],
-                    msg_95perc=msg_percentiles[-1],
-                    messages=msg_processed)
-                results_struct['data'].append(curr_res)
+                results_struct['data'].append(make_result(func.test_name, get_run_stats(func, params)))
             except Exception as exc:
                 traceback.print_exc()
                 curr_res = dict(func=func.test_name,
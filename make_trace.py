@@ -0,0 +1,124 @@
+"""
+Make binary trace for loader trace=FILE option.
+
+    make_trace.py text IN OUT - IN lines are 'TIME_NS CONN REQ_SIZE RESP_SIZE', sorted by time
+    make_trace.py poisson OUT --conns N --rate R --duration S --req-size N --resp-size N
+    make_trace.py info TRACE
+
+Format (little endian): header - magic 'NPTRACE1', u32 conn_count, u32 reserved,
+u64 event_count, then events - u64 time_ns, u32 conn, u32 req_size, u32 resp_size,
+u32 reserved. Events must be sorted by time_ns.
+"""
+
+import sys
+import heapq
+import random
+import struct
+import argparse
+
+
+MAGIC = b'NPTRACE1'
+header_fmt = struct.Struct("<8sIIQ")
+event_fmt = struct.Struct("<QIIII")
+CHUNK = 64 * 1024
+
+
+def write_trace(fname, events):
+    conn_count = 0
+    event_count = 0
+    last_time = 0
+
+    with open(fname, "wb") as fd:
+        fd.write(header_fmt.pack(MAGIC, 0, 0, 0))
+        chunk = []
+        for time_ns, conn, req_size, resp_size in events:
+            if time_ns < last_time:
+                raise ValueError("Events aren't sorted by time: {} after {}".format(time_ns, last_time))
+            last_time = time_ns
+            conn_count = max(conn_count, conn + 1)
+            event_count += 1
+            chunk.append(event_fmt.pack(time_ns, conn, req_size, resp_size, 0))
+            if len(chunk) == CHUNK:
+                fd.write(b"".join(chunk))
+                chunk = []
+        fd.write(b"".join(chunk))
+
+        fd.seek(0)
+        fd.write(header_fmt.pack(MAGIC, conn_count, 0, event_count))
+
+    return conn_count, event_count
+
+
+def text_events(fname):
+    for line in open(fname):
+        line = line.strip()
+        if line and not line.startswith('#'):
+            time_ns, conn, req_size, resp_size = map(int, line.split())
+            yield time_ns, conn, req_size, resp_size
+
+
+def poisson_events(conns, rate, duration, req_size, resp_size):
+    end_ns = int(duration * 1E9)
+    mean_ns = 1E9 / rate
+    heap = [(int(random.expovariate(1.0) * mean_ns), conn) for conn in range(conns)]
+    heapq.heapify(heap)
+
+    while heap[0][0] < end_ns:
+        time_ns, conn = heap[0]
+        yield time_ns, conn, req_size, resp_size
+        heapq.heapreplace(heap, (time_ns + int(random.expovariate(1.0) * mean_ns), conn))
+
+
+def info(fname):
+    with open(fname, "rb") as fd:
+        magic, conn_count, _, event_count = header_fmt.unpack(fd.read(header_fmt.size))
+        if magic != MAGIC:
+            raise ValueError("{!r} isn't a trace file".format(fname))
+        print("connections: {}".format(conn_count))
+        print("events: {}".format(event_count))
+        if event_count:
+            first = event_fmt.unpack(fd.read(event_fmt.size))
+            fd.seek(header_fmt.size + (event_count - 1) * event_fmt.size)
+            last = event_fmt.unpack(fd.read(event_fmt.size))
+            print("duration_ns: {}".format(last[0] - first[0]))
+
+
+def main(argv):
+    parser = argparse.ArgumentParser()
+    subparsers = parser.add_subparsers(dest='cmd')
+
+    text = subparsers.add_parser('text')
+    text.add_argument('input')
+    text.add_argument('output')
+
+    poisson = subparsers.add_parser('poisson')
+    poisson.add_argument('output')
+    poisson.add_argument('--conns', type=int, required=True)
+    poisson.add_argument('--rate', type=float, required=True, help="requests per second per connection")
+    poisson.add_argument('--duration', type=float, required=True, help="seconds")
+    poisson.add_argument('--req-size', type=int, default=64)
+    poisson.add_argument('--resp-size', type=int, default=64)
+
+    info_cmd = subparsers.add_parser('info')
+    info_cmd.add_argument('trace')
+
+    opts = parser.parse_args(argv[1:])
+
+    if opts.cmd == 'text':
+        res = write_trace(opts.output, text_events(opts.input))
+    elif opts.cmd == 'poisson':
+        res = write_trace(opts.output, poisson_events(opts.conns, opts.rate, opts.duration,
+                                                      opts.req_size, opts.resp_size))
+    elif opts.cmd == 'info':
+        info(opts.trace)
+        return 0
+    else:
+        parser.print_help()
+        return 1
+
+    print("connections: {}\nevents: {}".format(*res))
+    return 0
+
+
+if __name__ == "__main__":
+    exit(main(sys.argv))
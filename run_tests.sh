@@ -14,6 +14,34 @@ RESULT_FILE=10k_60k.yaml
 FUNCS=selector,cpp_epoll,uvloop_proto,go
 
 SERVER_IP=172.16.40.37
+
+# cpp_epoll only: all points in one session, connections are reused between them
+# for i in $(seq 1 $ROUNDS); do
+#     taskset -c 0 python3.5 main.py -i $BIND_IP --runtime $RUNTIME -s $SIZE $SERVER_IP 15000 cpp_epoll \
+#         --sweep count=15000,20000,25000,30000,35000,40000,45000,50000,55000 2>&1 | tee -a $RESULT_FILE
+# done
+
+# idle population: 100 active connections, growing number of idle ones
+# for THCOUNT in 1000 10000 100000; do
+#     for FUNC in cpp_epoll cpp_poll cpp_th; do
+#         taskset -c 0 python3.5 main.py -i $BIND_IP --runtime $RUNTIME -s $SIZE $SERVER_IP $THCOUNT $FUNC \
+#             -o active=$(python3 -c "print(100 / $THCOUNT)") churn=1000 2>&1 | tee -a $RESULT_FILE
+#     done
+# done
+
+# spike and return: phase0 and phase2 msgs_per_s should be ~0.1 * 1000 * 100, phase1 ~10x that
+# taskset -c 0 python3.5 main.py -i $BIND_IP --runtime 10 -s $SIZE $SERVER_IP 1000 cpp_epoll \
+#     -o schedule=step:0.1:4@100,spike:1:1@100 2>&1 | tee -a $RESULT_FILE
+
+# frames far larger than SO_SNDBUF + SO_RCVBUF, several connections per loader worker;
+# a hang here (timeout) means a write blocked on one connection while replies pile up on another
+# for FUNC in cpp_epoll cpp_th; do
+#     for PIPELINE in 1 4; do
+#         timeout -k 5s 2m taskset -c 0 python3.5 main.py -i $BIND_IP --runtime $RUNTIME $SERVER_IP 8 $FUNC \
+#             -o framing=lp req_size=8388608 resp_size=8388608 workers=1 pipeline=$PIPELINE 2>&1 | tee -a $RESULT_FILE
+#     done
+# done
+
 for i in $(seq 1 $ROUNDS); do
     for THCOUNT in 15000 20000 25000 30000 35000 40000 45000 50000 55000; do
         date
@@ -1,4 +1,5 @@
 #include <map>
+#include <array>
 #include <queue>
 #include <mutex>
 #include <atomic>
@@ -10,12 +11,12 @@
 #include <sstream>
 #include <iomanip>
 #include <iostream>
+#include <deque>
+#include <memory>
 #include <algorithm>
 #include <unordered_map>
-
-#ifndef LOG2_LAT
 #include <cmath>
-#endif
+#include <cctype>
 
 #include <poll.h>
 #include <fcntl.h>
@@ -23,22 +24,425 @@
 #include <signal.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 
 #include "common.h"
 
 const int DEFAULT_PORT = 33331;
 const int MAX_CLIENT_MESSAGE = 1024;
 
+// request/reply sizes for framing=lp, option value is one of
+//   N                      - fixed size
+//   uniform:MIN:MAX        - uniform in [MIN, MAX]
+//   bimodal:SMALL:LARGE:P  - LARGE with probability P, else SMALL
+//   empirical:FILE         - FILE lines are 'SIZE WEIGHT', FILE is a plain
+//                            name in loader's -l DIR
+class SizeDistribution {
+protected:
+    bool is_uniform;
+    std::uniform_int_distribution<uint32_t> uniform;
+    std::vector<uint32_t> sizes;
+    std::discrete_distribution<int> pick;
+
+public:
+    SizeDistribution(): is_uniform(false), sizes(1, 0) {}
+
+    bool parse(const std::string & spec);
+
+    uint32_t operator()(std::mt19937 & gen) {
+        if (is_uniform)
+            return uniform(gen);
+        if (1 == sizes.size())
+            return sizes[0];
+        return sizes[pick(gen)];
+    }
+
+    double mean() const {
+        if (is_uniform)
+            return (uniform.a() + (double)uniform.b()) / 2;
+        if (1 == sizes.size())
+            return sizes[0];
+        double res = 0;
+        auto probs = pick.probabilities();
+        for(size_t i = 0; i < sizes.size(); ++i)
+            res += probs[i] * sizes[i];
+        return res;
+    }
+};
+
+// size from str, digits only: strtoul takes "-1" as ULONG_MAX. Returns
+// end of the number, nullptr if it's not a size up to MAX_FRAME_LEN
+static const char * parse_size(const char * str, uint32_t & size) {
+    if (not std::isdigit((unsigned char)*str))
+        return nullptr;
+    char * end;
+    errno = 0;
+    unsigned long val = std::strtoul(str, &end, 10);
+    if (0 != errno or val > MAX_FRAME_LEN)
+        return nullptr;
+    size = (uint32_t)val;
+    return end;
+}
+
+bool opt_log_name(const char * key, std::string & name);
+
+// whole regular file to data. O_NONBLOCK so a FIFO can't block the caller
+static bool read_regular_file(const std::string & fname, std::string & data) {
+    int fd = open(fname.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (-1 == fd) {
+        perror(("open " + fname).c_str());
+        return false;
+    }
+    struct stat st;
+    if (-1 == fstat(fd, &st) or not S_ISREG(st.st_mode)) {
+        std::cerr << "'" << fname << "' is not a regular file\n";
+        close(fd);
+        return false;
+    }
+    data.clear();
+    char buffer[64 * 1024];
+    ssize_t len;
+    while(0 < (len = read(fd, buffer, sizeof(buffer))))
+        data.append(buffer, len);
+    if (-1 == len)
+        perror(("read " + fname).c_str());
+    close(fd);
+    return -1 != len;
+}
+
+bool SizeDistribution::parse(const std::string & spec) {
+    uint32_t v1, v2;
+    double prob;
+    int consumed = 0;
+    const char * cspec = spec.c_str();
+    const char * rest;
+
+    is_uniform = false;
+    sizes.clear();
+
+    if (nullptr != (rest = parse_size(cspec, v1)) and '\0' == *rest) {
+        sizes.push_back(v1);
+    } else if (0 == spec.compare(0, 8, "uniform:") and
+               nullptr != (rest = parse_size(cspec + 8, v1)) and ':' == *rest and
+               nullptr != (rest = parse_size(rest + 1, v2)) and '\0' == *rest and v1 <= v2) {
+        is_uniform = true;
+        uniform = std::uniform_int_distribution<uint32_t>(v1, v2);
+    } else if (0 == spec.compare(0, 8, "bimodal:") and
+               nullptr != (rest = parse_size(cspec + 8, v1)) and ':' == *rest and
+               nullptr != (rest = parse_size(rest + 1, v2)) and
+               1 == std::sscanf(rest, ":%lf%n", &prob, &consumed) and '\0' == rest[consumed] and
+               prob >= 0 and prob <= 1) {
+        sizes = {v1, v2};
+        pick = std::discrete_distribution<int>({1 - prob, prob});
+    } else if (0 == spec.compare(0, 10, "empirical:")) {
+        std::string fname = spec.substr(10), data;
+        if (not opt_log_name("empirical:FILE", fname) or
+                not read_regular_file(fname, data))
+            return false;
+        std::istringstream fd(data);
+        std::vector<double> weights;
+        std::string size;
+        double weight;
+        while(fd >> size >> weight) {
+            rest = parse_size(size.c_str(), v1);
+            if (nullptr == rest or '\0' != *rest or weight < 0) {
+                std::cerr << "Bad line '" << size << " " << weight << "' in '" << fname << "', ";
+                std::cerr << "SIZE should be in [0, " << MAX_FRAME_LEN << "], WEIGHT >= 0\n";
+                return false;
+            }
+            sizes.push_back(v1);
+            weights.push_back(weight);
+        }
+        if (not fd.eof() or sizes.empty()) {
+            std::cerr << "Can't read 'SIZE WEIGHT' lines from '" << fname << "'\n";
+            return false;
+        }
+        pick = std::discrete_distribution<int>(weights.begin(), weights.end());
+    } else {
+        std::cerr << "Can't parse size distribution '" << spec << "', sizes should be in [0, ";
+        std::cerr << MAX_FRAME_LEN << "]\n";
+        return false;
+    }
+    return true;
+}
+
+// schedule=PHASE,PHASE,... - fraction of connections with request in flight
+// over time, phases go one after another, the last level is kept till the
+// end of the run. PHASE is one of
+//   step:F:SEC             - F for SEC seconds
+//   spike:F:SEC            - F for SEC seconds, then back to the level (and
+//                            rate) of the last phase before it, which isn't
+//                            a spike. At the end of the schedule that return
+//                            is one more phase, so recovery is reported apart
+//   ramp:F0:F1:SEC         - linear from F0 to F1
+//   sine:F0:F1:PERIOD:SEC  - between F0 and F1, starts at F0
+// and optional '@RATE' suffix - requests per second per active connection,
+// without it connection sends next request right after the reply.
+struct LoadPhase {
+    std::string kind;
+    double from, to, period_s;
+    unsigned long start_ns, duration_ns;
+    double rate;
+};
+
+class LoadSchedule {
+public:
+    std::vector<LoadPhase> phases;
+
+    bool parse(const std::string & spec);
+
+    bool empty() const {
+        return phases.empty();
+    }
+
+    // phase of run time T, the last one after the schedule end
+    size_t phase_at(unsigned long t_ns) const {
+        size_t idx = 0;
+        while(idx + 1 < phases.size() and t_ns >= phases[idx + 1].start_ns)
+            ++idx;
+        return idx;
+    }
+
+    double level_at(size_t idx, unsigned long t_ns) const {
+        const LoadPhase & phase = phases[idx];
+        double pos = std::min(1.0, (double)(t_ns - phase.start_ns) / phase.duration_ns);
+        if ("ramp" == phase.kind)
+            return phase.from + (phase.to - phase.from) * pos;
+        if ("sine" == phase.kind) {
+            double angle = 2 * M_PI * (t_ns - phase.start_ns) / (phase.period_s * BILLION);
+            return phase.from + (phase.to - phase.from) * (1 - std::cos(angle)) / 2;
+        }
+        return phase.from;
+    }
+};
+
+bool LoadSchedule::parse(const std::string & spec) {
+    phases.clear();
+
+    std::stringstream items(spec);
+    std::string item;
+    unsigned long start_ns = 0;
+    // level and rate at the end of the last phase, which isn't a spike
+    double base_level = -1, base_rate = 0;
+    while(std::getline(items, item, ',')) {
+        LoadPhase phase{"", 0, 0, 0, start_ns, 0, 0};
+        double seconds = 0;
+        int consumed = 0;
+        const char * citem = item.c_str();
+        bool ok = false;
+
+        size_t at = item.find('@');
+        std::string body = item.substr(0, at);
+        if (std::string::npos != at) {
+            ok = (1 == std::sscanf(citem + at + 1, "%lf%n", &phase.rate, &consumed) and
+                  (int)(item.size() - at - 1) == consumed and phase.rate > 0);
+            if (not ok) {
+                std::cerr << "Can't parse rate of schedule phase '" << item << "'\n";
+                return false;
+            }
+        }
+
+        const char * cbody = body.c_str();
+        if (2 == std::sscanf(cbody, "step:%lf:%lf%n", &phase.from, &seconds, &consumed) and
+                (int)body.size() == consumed) {
+            phase.kind = "step";
+            phase.to = phase.from;
+        } else if (2 == std::sscanf(cbody, "spike:%lf:%lf%n", &phase.from, &seconds, &consumed) and
+                   (int)body.size() == consumed) {
+            phase.kind = "spike";
+            phase.to = phase.from;
+        } else if (3 == std::sscanf(cbody, "ramp:%lf:%lf:%lf%n", &phase.from, &phase.to, &seconds, &consumed) and
+                   (int)body.size() == consumed) {
+            phase.kind = "ramp";
+        } else if (4 == std::sscanf(cbody, "sine:%lf:%lf:%lf:%lf%n", &phase.from, &phase.to, &phase.period_s,
+                                    &seconds, &consumed) and
+                   (int)body.size() == consumed and phase.period_s > 0) {
+            phase.kind = "sine";
+        } else {
+            std::cerr << "Can't parse schedule phase '" << item << "'\n";
+            return false;
+        }
+
+        if (phase.from < 0 or phase.from > 1 or phase.to < 0 or phase.to > 1 or seconds <= 0) {
+            std::cerr << "Schedule phase '" << item << "': levels should be in [0, 1], duration > 0\n";
+            return false;
+        }
+
+        if ("spike" == phase.kind and base_level < 0) {
+            std::cerr << "Schedule phase '" << item << "': spike needs a phase before it\n";
+            return false;
+        }
+
+        phase.duration_ns = std::llround(seconds * BILLION);
+        start_ns += phase.duration_ns;
+        phases.push_back(phase);
+        if ("spike" != phase.kind) {
+            base_level = level_at(phases.size() - 1, start_ns);
+            base_rate = phase.rate;
+        }
+    }
+
+    if (phases.empty()) {
+        std::cerr << "Empty schedule '" << spec << "'\n";
+        return false;
+    }
+
+    // last level is kept till the end of the run, so spike returns here
+    if ("spike" == phases.back().kind)
+        phases.push_back(LoadPhase{"step", base_level, base_level, 0, start_ns, BILLION, base_rate});
+    return true;
+}
+
+// trace=FILE - binary trace of requests, replayed by the loader with
+// framing=lp. Little endian TraceHeader, then event_count TraceEvent
+// sorted by time_ns. See make_trace.py.
+const char TRACE_MAGIC[8] = {'N', 'P', 'T', 'R', 'A', 'C', 'E', '1'};
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t conn_count;
+    uint32_t reserved;
+    uint64_t event_count;
+};
+
+struct TraceEvent {
+    uint64_t time_ns;   // from replay start
+    uint32_t conn;      // loader connection index, < conn_count
+    uint32_t req_size;
+    uint32_t resp_size;
+    uint32_t reserved;
+};
+
+// read only mmap of trace file, events are paged in on access
+// and split() keeps only pointers to them
+class TraceFile {
+protected:
+    void * data;
+    size_t size;
+    const TraceHeader * header;
+
+public:
+    TraceFile(): data(MAP_FAILED), size(0), header(nullptr) {}
+    TraceFile(const TraceFile &) = delete;
+
+    ~TraceFile() {
+        if (MAP_FAILED != data)
+            munmap(data, size);
+    }
+
+    bool open(const std::string & fname);
+
+    uint32_t conn_count() const { return header->conn_count; }
+    const TraceEvent * begin() const { return (const TraceEvent *)(header + 1); }
+    const TraceEvent * end() const { return begin() + header->event_count; }
+
+    // events of each worker in time order, connection I belongs to
+    // worker I % worker_count
+    std::vector<std::vector<const TraceEvent *>> split(size_t worker_count) const {
+        std::vector<std::vector<const TraceEvent *>> res(worker_count);
+        for(auto event = begin(); event != end(); ++event)
+            res[event->conn % worker_count].push_back(event);
+        return res;
+    }
+};
+
+bool TraceFile::open(const std::string & fname) {
+    // O_NONBLOCK - FIFO shouldn't block control thread, it's rejected below
+    int fd = ::open(fname.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (-1 == fd) {
+        std::perror(("open('" + fname + "')").c_str());
+        return false;
+    }
+
+    struct stat st;
+    if (0 != fstat(fd, &st)) {
+        std::perror("fstat(trace_fd)");
+        close(fd);
+        return false;
+    }
+    if (not S_ISREG(st.st_mode)) {
+        std::cerr << "Trace '" << fname << "' is not a regular file\n";
+        close(fd);
+        return false;
+    }
+    size = st.st_size;
+
+    if (size < sizeof(TraceHeader)) {
+        std::cerr << "Trace '" << fname << "' is too small\n";
+        close(fd);
+        return false;
+    }
+
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == data) {
+        std::perror("mmap(trace_fd)");
+        return false;
+    }
+
+    // split() reads the trace once, front to back
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    header = (const TraceHeader *)data;
+    if (0 != std::memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC))) {
+        std::cerr << "'" << fname << "' isn't a trace file\n";
+        return false;
+    }
+
+    if ((size - sizeof(TraceHeader)) / sizeof(TraceEvent) < header->event_count) {
+        std::cerr << "Trace '" << fname << "' is truncated\n";
+        return false;
+    }
+    return true;
+}
+
+class ClockSync;
+
 struct TestParams {
     int port, num_conn, runtime, message_len;
     unsigned long int min_timeout, max_timeout;
     char ip[MAX_CLIENT_MESSAGE + 1];
+    Transport transport;
+    OptionsMap opts;
+    bool framed;
+    SizeDistribution req_size, resp_size;
+    int pipeline;
+    bool record_latency;
+    long lat_sample;    // RTT of one in N messages, 1 - all
+    double active;      // fraction of connections with request in flight
+    double churn;       // active connections per second, which go idle
+    LoadSchedule schedule; // empty - active level is fixed
+    std::shared_ptr<TraceFile> trace;
+    std::string lat_log;
+    long lat_log_sample, lat_log_mb;
+    bool kernel_ts;
+    TcpInfoOptions tcp_info;
+    int workers;
+    int nodelay;    // -1 - not set, socket default
+    bool sweep;
+    RtOptions rt;
+    bool owd;
+    std::shared_ptr<ClockSync> clock; // owd=1, exchange over control socket
+    ConnOptions conn;
+    std::vector<sockaddr_in> src_addrs; // src_ips, overrides command line IPs
 };
 
+// active=F, churn=R and schedule - idle worker sends to its window only
+bool window_mode(const TestParams & params) {
+    return params.active < 1 or 0 != params.churn or not params.schedule.empty();
+}
+
 class FDList {
 public:
     std::vector<int> fds;
@@ -56,11 +460,11 @@ public:
     }
 };
 
-std::vector<epoll_event>::iterator begin(EventsList & elist) {
+EventVector::iterator begin(EventsList & elist) {
     return elist.events.begin();
 }
 
-std::vector<epoll_event>::iterator end(EventsList & elist) {
+EventVector::iterator end(EventsList & elist) {
     return elist.events.begin() + elist.num_ready;
 }
 
@@ -70,19 +474,165 @@ const int LAT_ARR_SIZE = 30;
 const int LAT_ARR_SIZE = 300;
 #endif
 
+// lat_log=PREFIX - raw latency samples for outliers investigation. Every
+// worker appends LatRecord-s to own PREFIX.WORKER file, which is
+// preallocated and mmap-ed with MAP_POPULATE, so a sample is a store to
+// memory, without locks and syscalls. One of lat_log_sample messages is
+// logged, records above lat_log_mb are dropped. Header counters are written
+// on close. Files are merged by lat_log.py.
+const char LAT_LOG_MAGIC[8] = {'N', 'P', 'L', 'A', 'T', 'L', 'G', '1'};
+
+struct LatLogHeader {
+    char magic[8];
+    uint32_t worker;
+    uint32_t sample;
+    uint64_t record_count;
+    uint64_t dropped;
+};
+
+struct LatRecord {
+    uint64_t time_ns;   // reply time, CLOCK_REALTIME
+    uint64_t lat_ns;
+    uint32_t fd;
+    uint32_t size;      // reply size
+};
+
+class LatLog {
+protected:
+    int fd;
+    void * data;
+    size_t size;
+    LatRecord * records;
+    uint64_t capacity, count, dropped;
+    uint32_t sample, countdown;
+
+public:
+    LatLog(): fd(-1), data(MAP_FAILED), size(0), records(nullptr),
+              capacity(0), count(0), dropped(0), sample(1), countdown(1) {}
+    LatLog(const LatLog &) = delete;
+
+    ~LatLog() {
+        close();
+    }
+
+    bool open(const std::string & fname, uint32_t worker, uint32_t _sample, size_t max_size);
+    void close();
+
+    void add(unsigned long time_ns, int sockfd, unsigned long lat_ns, uint32_t msg_size) {
+        if (0 != --countdown)
+            return;
+        countdown = sample;
+
+        if (count == capacity) {
+            ++dropped;
+            return;
+        }
+        records[count++] = LatRecord{time_ns, lat_ns, (uint32_t)sockfd, msg_size};
+    }
+};
+
+bool LatLog::open(const std::string & fname, uint32_t worker, uint32_t _sample, size_t max_size) {
+    fd = ::open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (-1 == fd) {
+        std::perror(("open('" + fname + "')").c_str());
+        return false;
+    }
+
+    capacity = (std::max(max_size, sizeof(LatLogHeader)) - sizeof(LatLogHeader)) / sizeof(LatRecord);
+    size = sizeof(LatLogHeader) + capacity * sizeof(LatRecord);
+    if (0 != ftruncate(fd, size)) {
+        std::perror("ftruncate(lat_log_fd)");
+        return false;
+    }
+
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (MAP_FAILED == data) {
+        std::perror("mmap(lat_log_fd)");
+        return false;
+    }
+
+    LatLogHeader * header = (LatLogHeader *)data;
+    std::memcpy(header->magic, LAT_LOG_MAGIC, sizeof(LAT_LOG_MAGIC));
+    header->worker = worker;
+    header->sample = sample = countdown = _sample;
+    records = (LatRecord *)(header + 1);
+    return true;
+}
+
+void LatLog::close() {
+    if (MAP_FAILED != data) {
+        LatLogHeader * header = (LatLogHeader *)data;
+        header->record_count = count;
+        header->dropped = dropped;
+        munmap(data, size);
+        data = MAP_FAILED;
+
+        if (0 != ftruncate(fd, sizeof(LatLogHeader) + count * sizeof(LatRecord)))
+            std::perror("ftruncate(lat_log_fd)");
+    }
+
+    if (-1 != fd) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+// histogram of trace replay lag or of kernel timestamps based RTT parts
+struct LatHist {
+    unsigned long events, sum_ns, max_ns;
+    std::unordered_map<unsigned long, unsigned long> hist; // lat_bucket -> count
+
+    LatHist(): events(0), sum_ns(0), max_ns(0) {}
+
+    void add(unsigned long ns);
+    void merge(const LatHist & other);
+    unsigned long p99_ns() const;
+    // PREFIX_avg_ns, PREFIX_p99_ns, PREFIX_max_ns
+    void add_to(StatsList & stats, const std::string & prefix) const;
+};
+
+// kernel_ts=1: RTT = send + wire + recv + user
+//   send - write() call to TX software timestamp (syscall and TCP stack)
+//   wire - TX to RX software timestamp (network, responder and its stack)
+//   recv - RX timestamp to loader epoll wakeup (RX stack, wakeup)
+//   user - wakeup to recvmsg() of this socket (loader event loop)
+struct KernelTsParts {
+    LatHist send, wire, recv, user;
+    unsigned long missing; // replies without TX or RX timestamp
+
+    KernelTsParts(): missing(0) {}
+};
+
+// owd=1: RTT = fwd + hold + ret, one way delays are corrected by responder
+// clock offset estimate, negative ones (offset error) are counted and added
+// as zero
+struct OwdParts {
+    LatHist fwd, ret, hold;
+    unsigned long negative;
+
+    OwdParts(): negative(0) {}
+};
+
 struct TestResult{
     unsigned long mcount;
     unsigned long avg_lat_ns;
     std::array<unsigned long, 19> percentiles;
     std::unordered_map<unsigned long, unsigned long> lat_map;
+    unsigned long lat_sum_ns = 0, lat_count = 0; // exact mean, lat_map buckets are ~3.5% wide
     std::unordered_map<int, unsigned long> mess_count_for_sock;
-};
-
-class DecOnExit {
-public:
-    std::atomic_int * counter;
-    DecOnExit(std::atomic_int * _counter):counter(_counter){}
-    ~DecOnExit() {--(*counter);}
+    SelectorStats sel_stats;
+    ThreadCounters counters;
+    StatsList stats;
+    LatHist trace_lag;
+    KernelTsParts kernel_ts;
+    OwdParts owd;
+    std::unique_ptr<LatLog> lat_log; // lat_log=PREFIX only
+    unsigned long churned;           // active=F: connections activated by churn
+    unsigned long start_ns, end_ns;  // worker run window, merged - whole run
+    std::vector<LatHist> phase_lat;  // schedule: RTT by phase of reply
+    std::vector<SendQueue> send_queues; // framing=lp, pipeline: by fd, requests socket didn't take
+
+    void add_lat(unsigned long lat_ns);
 };
 
 struct FdTimout {
@@ -95,10 +645,106 @@ struct FdTimout {
     }
 };
 
-struct Sync {
-   std::atomic_bool done;
-   std::mutex run_lola_run;
-   std::atomic_int active_count;
+inline long futex(std::atomic_int * word, int op, int val, const timespec * timeout=nullptr) {
+    static_assert(sizeof(std::atomic_int) == sizeof(int), "futex word is int");
+    return syscall(SYS_futex, reinterpret_cast<int *>(word), op | FUTEX_PRIVATE_FLAG, val, timeout, nullptr, 0);
+}
+
+// Start barrier and stop signal. Workers check in and sleep on futex till
+// start(), controller sleeps on active_count futex, which workers wake on
+// check in and exit. stop() wakes all workers at once through stop_fd
+// eventfd, registered in every selector, workers check done after wait.
+class Sync {
+public:
+    std::atomic_bool done;
+    std::atomic_int active_count;
+    std::atomic_int started;
+    unsigned long start_time;   // get_fast_time(), set before start
+    unsigned long stop_time;
+    int stop_fd;
+
+    Sync(): done(false), active_count(0), started(0), start_time(0), stop_time(0) {
+        stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (-1 == stop_fd)
+            std::perror("eventfd(stop_fd)");
+    }
+
+    ~Sync() {
+        if (-1 != stop_fd)
+            close(stop_fd);
+    }
+
+    bool ok() const {
+        return -1 != stop_fd;
+    }
+
+    // worker side
+    void check_in() {
+        active_count++;
+        futex(&active_count, FUTEX_WAKE, 1);
+        while(0 == started.load())
+            futex(&started, FUTEX_WAIT, 0);
+    }
+
+    void check_out() {
+        active_count--;
+        futex(&active_count, FUTEX_WAKE, 1);
+    }
+
+    // controller side, false on deadline (get_mono_time(), 0 - none)
+    bool wait_active(int count, unsigned long deadline=0) {
+        for(;;) {
+            int curr = active_count.load();
+            if (count == curr)
+                return true;
+
+            timespec timeout, * ptimeout = nullptr;
+            if (0 != deadline) {
+                unsigned long now = get_mono_time();
+                if (now >= deadline)
+                    return false;
+                timeout.tv_sec = (deadline - now) / BILLION;
+                timeout.tv_nsec = (deadline - now) % BILLION;
+                ptimeout = &timeout;
+            }
+            futex(&active_count, FUTEX_WAIT, curr, ptimeout);
+        }
+    }
+
+    void start() {
+        start_time = get_fast_time();
+        started.store(1);
+        futex(&started, FUTEX_WAKE, INT_MAX);
+    }
+
+    // workers, which wait for start, exit on done as well
+    void stop() {
+        stop_time = get_fast_time();
+        done.store(true);
+        uint64_t one = 1;
+        if ((ssize_t)sizeof(one) != write(stop_fd, &one, sizeof(one)))
+            std::perror("write(stop_fd)");
+        if (0 == started.load())
+            start();
+    }
+};
+
+// worker check in and out, start_ns - end_ns is worker measurement window
+class WorkerScope {
+public:
+    Sync * sync;
+    TestResult * result;
+
+    WorkerScope(Sync * _sync, TestResult * _result):sync(_sync), result(_result) {
+        result->start_ns = 0;
+        result->end_ns = 0;
+        sync->check_in();
+        result->start_ns = get_fast_time();
+    }
+    ~WorkerScope() {
+        result->end_ns = get_fast_time();
+        sync->check_out();
+    }
 };
 
 std::string serialize_to_str(const TestResult & res) {
@@ -119,7 +765,69 @@ std::string serialize_to_str(const TestResult & res) {
     for(auto val: res.percentiles)
         serialized << " " << val;
 
-    return serialized.str();
+    std::string out = serialized.str();
+    res.stats.serialize(out);
+    return out;
+}
+
+// src_ips=A.B.C.D-A.B.C.E or comma separated list
+bool parse_src_ips(const std::string & spec, std::vector<sockaddr_in> & addrs) {
+    addrs.clear();
+    if (spec.empty())
+        return true;
+
+    sockaddr_in addr;
+    bzero((char *)&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    std::string first, last;
+    std::size_t dash = spec.find('-');
+    if (std::string::npos != dash) {
+        in_addr from, to;
+        if (1 != inet_pton(AF_INET, spec.substr(0, dash).c_str(), &from) or
+                1 != inet_pton(AF_INET, spec.substr(dash + 1).c_str(), &to) or
+                ntohl(from.s_addr) > ntohl(to.s_addr) or ntohl(to.s_addr) - ntohl(from.s_addr) >= 65536) {
+            std::cerr << "Bad src_ips range '" << spec << "'\n";
+            return false;
+        }
+        for(uint32_t i = 0; i <= ntohl(to.s_addr) - ntohl(from.s_addr); ++i) {
+            addr.sin_addr.s_addr = htonl(ntohl(from.s_addr) + i);
+            addrs.push_back(addr);
+        }
+        return true;
+    }
+
+    std::stringstream items(spec);
+    std::string item;
+    while(std::getline(items, item, ',')) {
+        if (1 != inet_pton(AF_INET, item.c_str(), &addr.sin_addr)) {
+            std::cerr << "Bad src_ips address '" << item << "'\n";
+            return false;
+        }
+        addrs.push_back(addr);
+    }
+    return true;
+}
+
+// -l DIR: loader log files directory, also trace and empirical:FILE inputs
+// are read from it. Names come over the control connection from anyone,
+// who can reach the port, so they are plain file names in it, not paths.
+// Without -l these options are disabled.
+std::string log_dir;
+
+bool opt_log_name(const char * key, std::string & name) {
+    if (name.empty())
+        return true;
+    if (log_dir.empty()) {
+        std::cerr << key << " requires loader started with -l DIR\n";
+        return false;
+    }
+    if (std::string::npos != name.find('/') or "." == name or ".." == name) {
+        std::cerr << key << " should be a plain file name, got '" << name << "'\n";
+        return false;
+    }
+    name = log_dir + "/" + name;
+    return true;
 }
 
 bool load_from_str(const char * data, TestParams & params) {
@@ -127,76 +835,369 @@ bool load_from_str(const char * data, TestParams & params) {
         std::cerr << "Message too large\n";
         return false;
     }
-    int num_scanned = std::sscanf(data, "%s %d %d %d %lu %lu %d",
+    int opts_offset = 0;
+    int num_scanned = std::sscanf(data, "%s %d %d %d %lu %lu %d%n",
                                   params.ip,
                                   &params.port,
                                   &params.num_conn,
                                   &params.runtime,
                                   &params.min_timeout,
                                   &params.max_timeout,
-                                  &params.message_len);
+                                  &params.message_len,
+                                  &opts_offset);
     if (num_scanned != 7) {
         std::cerr << "Message from client is broken '" << data << "'\n";
         return false;
     }
 
-    if (params.min_timeout > params.max_timeout) {
-        std::cerr << "Message from client is broken. (min_timeout)" << params.min_timeout;
-        std::cerr << " > (max_timeout) " << params.min_timeout << "\n";
-        std::cerr << " data = '" << data << "'\n";
+    // optional KEY=VALUE tail
+    params.opts.clear();
+    if (not parse_options(data + opts_offset, params.opts))
         return false;
-    }
 
-    return true;
-}
+    if (not opt_transport(params.opts, params.transport))
+        return false;
 
-int log2_64(uint64_t value) {
-    const int tab64[64] = {
-        63,  0, 58,  1, 59, 47, 53,  2,
-        60, 39, 48, 27, 54, 33, 42,  3,
-        61, 51, 37, 40, 49, 18, 28, 20,
-        55, 30, 34, 11, 43, 14, 22,  4,
-        62, 57, 46, 52, 38, 26, 32, 41,
-        50, 36, 17, 19, 29, 10, 13, 21,
-        56, 45, 25, 31, 35, 16,  9, 12,
-        44, 24, 15,  8, 23,  7,  6,  5};
+    if (not opt_framing(params.opts, params.framed))
+        return false;
 
-    value |= value >> 1;
-    value |= value >> 2;
-    value |= value >> 4;
-    value |= value >> 8;
-    value |= value >> 16;
-    value |= value >> 32;
+    if (params.framed) {
+        if (TRANSPORT_UDP == params.transport or TRANSPORT_UNIX_SEQPACKET == params.transport) {
+            std::cerr << "framing=lp requires stream transport\n";
+            return false;
+        }
 
-    return tab64[((uint64_t)((value - (value >> 1))*0x07EDD5E59A4E28C2)) >> 58];
-}
+        std::string req_size = std::to_string(params.message_len);
+        std::string resp_size = req_size;
+        opt_str(params.opts, "req_size", req_size);
+        opt_str(params.opts, "resp_size", resp_size);
+        if (not params.req_size.parse(req_size) or not params.resp_size.parse(resp_size))
+            return false;
+    }
 
+    if (not opt_pipeline(params.opts, params.pipeline))
+        return false;
 
-bool check_socket_ready(int sockfd) {
-    int error = 0;
-    socklen_t len = sizeof(error);
-    int retval = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
-    if (0 > retval) {
-        perror("getsockopt(...):");
+    long latency = 1;
+    if (not opt_long(params.opts, "latency", latency))
+        return false;
+    params.record_latency = (0 != latency);
+    if (not params.record_latency and (0 != params.min_timeout or 0 != params.max_timeout)) {
+        std::cerr << "latency=0 doesn't support timeouts\n";
         return false;
     }
 
-    if (error != 0) {
-        std::cerr << "Socket failed to connect ERROR\n";
+    if (params.pipeline > 1) {
+        // requests are coalesced, which would merge datagrams
+        if (TRANSPORT_UDP == params.transport or TRANSPORT_UNIX_SEQPACKET == params.transport) {
+            std::cerr << "pipeline requires stream transport\n";
+            return false;
+        }
+        if (0 != params.min_timeout or 0 != params.max_timeout) {
+            std::cerr << "pipeline doesn't support timeouts\n";
+            return false;
+        }
+    }
+
+    params.lat_log.clear();
+    params.lat_log_sample = 1;
+    params.lat_log_mb = 64;
+    opt_str(params.opts, "lat_log", params.lat_log);
+    if (not opt_log_name("lat_log", params.lat_log))
+        return false;
+    if (not opt_long(params.opts, "lat_log_sample", params.lat_log_sample) or
+            not opt_long(params.opts, "lat_log_mb", params.lat_log_mb))
+        return false;
+    if (params.lat_log_sample < 1 or params.lat_log_mb < 1) {
+        std::cerr << "lat_log_sample and lat_log_mb should be >= 1\n";
+        return false;
+    }
+    if (not params.lat_log.empty() and not params.record_latency) {
+        std::cerr << "lat_log requires latency measurement, it's disabled by latency=0\n";
+        return false;
+    }
+
+    std::string trace;
+    opt_str(params.opts, "trace", trace);
+    params.trace.reset();
+    if (not opt_log_name("trace", trace))
+        return false;
+    if (not trace.empty()) {
+        if (not params.framed or params.pipeline > 1 or not params.record_latency or
+                0 != params.min_timeout or 0 != params.max_timeout) {
+            std::cerr << "trace requires framing=lp, pipeline=1 and no timeouts\n";
+            return false;
+        }
+
+        params.trace = std::make_shared<TraceFile>();
+        if (not params.trace->open(trace))
+            return false;
+
+        if ((int)params.trace->conn_count() > params.num_conn) {
+            std::cerr << "Trace has " << params.trace->conn_count() << " connections, test only ";
+            std::cerr << params.num_conn << "\n";
+            return false;
+        }
+    }
+
+    if (not opt_tcp_info(params.opts, params.transport, params.tcp_info) or
+            not opt_log_name("tcp_info_log", params.tcp_info.log_prefix))
+        return false;
+
+    long workers = 3, nodelay = -1, sweep = 0;
+    if (not opt_long(params.opts, "workers", workers) or not opt_long(params.opts, "nodelay", nodelay) or
+            not opt_long(params.opts, "sweep", sweep))
+        return false;
+    if (workers < 1 or workers > 256) {
+        std::cerr << "workers should be in [1, 256], got " << workers << "\n";
+        return false;
+    }
+    if (-1 != nodelay and TRANSPORT_TCP != params.transport) {
+        std::cerr << "nodelay requires tcp transport\n";
+        return false;
+    }
+    if (0 != sweep and TRANSPORT_UDP == params.transport) {
+        std::cerr << "sweep doesn't support udp\n";
+        return false;
+    }
+    params.workers = workers;
+    params.nodelay = (-1 == nodelay ? -1 : (0 != nodelay));
+    params.sweep = (0 != sweep);
+
+    if (not opt_rt(params.opts, params.rt))
+        return false;
+    // MCL_FUTURE would lock and fault in the whole trace and lat_log buffers
+    if (params.rt.enabled and (params.trace or not params.lat_log.empty())) {
+        std::cerr << "rt doesn't support trace and lat_log\n";
+        return false;
+    }
+
+    long kernel_ts = 0;
+    if (not opt_long(params.opts, "kernel_ts", kernel_ts))
+        return false;
+    params.kernel_ts = (0 != kernel_ts);
+    // sweep steps reuse sockets, while OPT_ID byte keys count from the first step
+    if (params.kernel_ts and (TRANSPORT_TCP != params.transport or params.framed or params.pipeline > 1 or
+                              params.trace or params.sweep or not params.record_latency or
+                              0 != params.min_timeout or 0 != params.max_timeout)) {
+        std::cerr << "kernel_ts requires tcp, raw framing, pipeline=1, latency, no timeouts and no sweep\n";
+        return false;
+    }
+
+    if (not opt_conn(params.opts, params.transport, params.conn) or not params.conn.fits(params.port))
+        return false;
+
+    std::string src_ips;
+    opt_str(params.opts, "src_ips", src_ips);
+    if (not parse_src_ips(src_ips, params.src_addrs))
+        return false;
+    if (not params.src_addrs.empty() and TRANSPORT_TCP != params.transport) {
+        std::cerr << "src_ips requires tcp transport\n";
+        return false;
+    }
+
+    long owd = 0;
+    if (not opt_long(params.opts, "owd", owd))
+        return false;
+    params.owd = (0 != owd);
+    params.clock.reset();
+    if (params.owd and (TRANSPORT_UDP == params.transport or params.framed or params.pipeline > 1 or
+                        params.trace or params.kernel_ts or params.sweep or not params.record_latency or
+                        0 != params.min_timeout or 0 != params.max_timeout)) {
+        std::cerr << "owd requires stream transport, raw framing, pipeline=1, latency, no timeouts, ";
+        std::cerr << "trace, kernel_ts and sweep\n";
+        return false;
+    }
+    if (params.owd and params.message_len < (int)sizeof(OwdStamp)) {
+        std::cerr << "owd requires message at least " << sizeof(OwdStamp) << " bytes long\n";
+        return false;
+    }
+
+    params.active = 1;
+    params.churn = 0;
+    if (not opt_double(params.opts, "active", params.active) or not opt_double(params.opts, "churn", params.churn))
+        return false;
+    if (not (params.active > 0 and params.active <= 1) or params.churn < 0) {
+        std::cerr << "active should be in (0, 1], churn >= 0\n";
+        return false;
+    }
+    std::string schedule;
+    opt_str(params.opts, "schedule", schedule);
+    params.schedule.phases.clear();
+    if (not schedule.empty()) {
+        if (not params.schedule.parse(schedule))
+            return false;
+        if (params.active < 1 or not params.record_latency) {
+            std::cerr << "schedule sets active level itself and requires latency\n";
+            return false;
+        }
+    }
+    if (window_mode(params) and
+            (TRANSPORT_UDP == params.transport or params.framed or params.pipeline > 1 or params.trace or
+             params.kernel_ts or params.owd or 0 != params.min_timeout or 0 != params.max_timeout)) {
+        std::cerr << "active, churn and schedule require stream transport, raw framing, pipeline=1, no timeouts, ";
+        std::cerr << "trace, kernel_ts and owd\n";
+        return false;
+    }
+
+    params.lat_sample = 1;
+    if (not opt_long(params.opts, "lat_sample", params.lat_sample))
+        return false;
+    if (params.lat_sample < 1) {
+        std::cerr << "lat_sample should be >= 1\n";
+        return false;
+    }
+    if (params.lat_sample > 1 and (TRANSPORT_UDP == params.transport or params.framed or params.pipeline > 1 or
+                                   params.trace or params.kernel_ts or params.owd or params.active < 1 or
+                                   0 != params.churn or not params.schedule.empty() or not params.record_latency or
+                                   0 != params.min_timeout or 0 != params.max_timeout)) {
+        std::cerr << "lat_sample requires stream transport, raw framing, pipeline=1, latency, no timeouts, ";
+        std::cerr << "trace, kernel_ts and owd\n";
+        return false;
+    }
+
+    if (params.min_timeout > params.max_timeout) {
+        std::cerr << "Message from client is broken. (min_timeout)" << params.min_timeout;
+        std::cerr << " > (max_timeout) " << params.min_timeout << "\n";
+        std::cerr << " data = '" << data << "'\n";
         return false;
     }
 
     return true;
 }
 
-bool connect_all(int sock_count,
-                 std::vector<int> & sockets,
-                 const char * ip,
-                 const int port,
-                 const std::vector<sockaddr_in> & client_ip_addrs,
-                 int conn_q_size=32,
-                 int conn_timeout_ms=1000)
+int log2_64(uint64_t value) {
+    const int tab64[64] = {
+        63,  0, 58,  1, 59, 47, 53,  2,
+        60, 39, 48, 27, 54, 33, 42,  3,
+        61, 51, 37, 40, 49, 18, 28, 20,
+        55, 30, 34, 11, 43, 14, 22,  4,
+        62, 57, 46, 52, 38, 26, 32, 41,
+        50, 36, 17, 19, 29, 10, 13, 21,
+        56, 45, 25, 31, 35, 16,  9, 12,
+        44, 24, 15,  8, 23,  7,  6,  5};
+
+    value |= value >> 1;
+    value |= value >> 2;
+    value |= value >> 4;
+    value |= value >> 8;
+    value |= value >> 16;
+    value |= value >> 32;
+
+    return tab64[((uint64_t)((value - (value >> 1))*0x07EDD5E59A4E28C2)) >> 58];
+}
+
+// index in lat_map for latency
+inline int lat_bucket(unsigned long lat_ns) {
+    #ifdef LOG2_LAT
+    return (int)log2_64(lat_ns);
+    #else
+    return std::lround(std::log2((float)lat_ns) * 10);
+    #endif
+}
+
+inline void TestResult::add_lat(unsigned long lat_ns) {
+    lat_map.emplace(lat_bucket(lat_ns), 0).first->second++;
+    lat_sum_ns += lat_ns;
+    ++lat_count;
+}
+
+inline void LatHist::add(unsigned long ns) {
+    ++events;
+    sum_ns += ns;
+    max_ns = std::max(max_ns, ns);
+    hist.emplace(lat_bucket(std::max(ns, 1UL)), 0).first->second++;
+}
+
+void LatHist::merge(const LatHist & other) {
+    events += other.events;
+    sum_ns += other.sum_ns;
+    max_ns = std::max(max_ns, other.max_ns);
+    for(const auto & item: other.hist)
+        hist.emplace(item.first, 0).first->second += item.second;
+}
+
+unsigned long LatHist::p99_ns() const {
+    #ifdef LOG2_LAT
+    double base = 2.0;
+    #else
+    double base = std::pow(2L, 0.1L);
+    #endif
+
+    std::map<unsigned long, unsigned long> sorted(hist.begin(), hist.end());
+    unsigned long seen = 0;
+    double p99 = 0;
+    for(const auto & item: sorted) {
+        seen += item.second;
+        if (seen * 100 >= events * 99) {
+            p99 = std::pow(base, item.first);
+            break;
+        }
+    }
+    return (unsigned long)p99;
+}
+
+void LatHist::add_to(StatsList & stats, const std::string & prefix) const {
+    if (0 == events)
+        return;
+
+    stats.add(prefix + "_avg_ns", sum_ns / events);
+    stats.add(prefix + "_p99_ns", p99_ns());
+    stats.add(prefix + "_max_ns", max_ns);
+}
+
+bool check_socket_ready(int sockfd) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    int retval = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (0 > retval) {
+        perror("getsockopt(...):");
+        return false;
+    }
+
+    if (error != 0) {
+        std::cerr << "Socket failed to connect ERROR\n";
+        return false;
+    }
+
+    return true;
+}
+
+// unix sockets connects immediately or block till responder accept,
+// so no need for connection queue here
+bool connect_all_unix(int sock_count,
+                      std::vector<int> & sockets,
+                      const int port,
+                      Transport transport)
 {
+    sockaddr_un serv_addr;
+    socklen_t serv_addr_len = make_unix_addr(port, serv_addr);
+    sockets.clear();
+
+    for(int i = 0; i < sock_count; ++i) {
+        int sockfd = socket(AF_UNIX, transport_socktype(transport), 0);
+        if (sockfd < 0) {
+            std::perror("Socket creation:");
+            return false;
+        }
+
+        sockets.push_back(sockfd); // external code would close all ports from sockets
+
+        if (0 > connect(sockfd, (struct sockaddr *) &serv_addr, serv_addr_len)) {
+            std::perror("Connecting:");
+            return false;
+        }
+
+        int flags = fcntl(sockfd, F_GETFL, 0);
+        if (flags < 0 or fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            std::perror("fcntl(sockfd, F_SETFL, flags | O_NONBLOCK)");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool resolve_addr(const char * ip, const int port, sockaddr_in & serv_addr) {
     const struct hostent * host = gethostbyname(ip);
     if (NULL == host) {
         std::string message("No such host: '");
@@ -206,16 +1207,37 @@ bool connect_all(int sock_count,
         return false;
     }
 
-    struct sockaddr_in serv_addr;
     bzero((char *)&serv_addr, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     bcopy((const char *)host->h_addr, (char *)&serv_addr.sin_addr.s_addr, host->h_length);
     serv_addr.sin_port = htons(port);
+    return true;
+}
+
+// connection K goes from client_ip_addrs[K % IPS] to port + (K / IPS) % conn.ports,
+// so all source IP and port pairs are used evenly
+bool connect_all(int sock_count,
+                 std::vector<int> & sockets,
+                 const char * ip,
+                 const int port,
+                 Transport transport,
+                 const ConnOptions & conn,
+                 const std::vector<sockaddr_in> & client_ip_addrs,
+                 int conn_q_size=32,
+                 int conn_timeout_ms=5000)
+{
+    if (TRANSPORT_TCP != transport)
+        return connect_all_unix(sock_count, sockets, port, transport);
+
+    std::vector<sockaddr_in> serv_addrs(conn.ports);
+    for(int i = 0; i < conn.ports; ++i)
+        if (not resolve_addr(ip, port + i, serv_addrs[i]))
+            return false;
     sockets.clear();
+    sockets.reserve(sock_count);
 
-    auto curr_it = client_ip_addrs.begin();
-    auto end_it = client_ip_addrs.end();
-    bool need_bind = (curr_it != end_it);
+    const int ip_count = std::max((int)client_ip_addrs.size(), 1);
+    bool need_bind = not client_ip_addrs.empty();
     int waiting_to_connect = 0;
     EPollRSelector sel(conn_q_size);
 
@@ -239,16 +1261,23 @@ bool connect_all(int sock_count,
             if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
                 perror("setsockopt(SO_REUSEADDR) failed");
 
+            if (0 != conn.sock_buf)
+                set_sock_buffers(sockfd, conn.sock_buf);
+
+            const int idx = sockets.size() - 1;
             if (need_bind) {
-                if (curr_it == end_it)
-                    curr_it = client_ip_addrs.begin();
-                if ( 0 > bind(sockfd, (struct sockaddr *)&*curr_it, sizeof(*curr_it))) {
+                // port is picked by connect, so one source port serves every
+                // destination port, not only the first bound one
+                if (setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &enable, sizeof(enable)) < 0)
+                    perror("setsockopt(IP_BIND_ADDRESS_NO_PORT) failed");
+                const sockaddr_in & local = client_ip_addrs[idx % ip_count];
+                if ( 0 > bind(sockfd, (struct sockaddr *)&local, sizeof(local))) {
                     std::perror("Client bind:");
                     return false;
                 }
-                ++curr_it;
             }
 
+            const sockaddr_in & serv_addr = serv_addrs[(idx / ip_count) % conn.ports];
             if (0 > connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr))) {
                 if (errno != EINPROGRESS) {
                     std::perror("Connecting:");
@@ -262,7 +1291,7 @@ bool connect_all(int sock_count,
             ++waiting_to_connect;
         }
 
-        if (not sel.wait(conn_timeout_ms))
+        if (not sel.wait((long)conn_timeout_ms * 1000 * 1000))
             return false;
 
         if (0 == sel.ready_count()) {
@@ -286,14 +1315,14 @@ bool connect_all(int sock_count,
     return true;
 }
 
-#ifdef EPOLL_CALL_STATS
-std::atomic<unsigned long int> socket_count_from_wait;
-std::atomic<unsigned int> epoll_wait_calls;
-#endif
-
-bool ping(int fd, char * buff, int buff_sz) {
+bool ping(int fd, char * buff, int buff_sz, SelectorStats & stats) {
     int bc = recv(fd, buff, buff_sz, 0);
-    if (0 > bc and ECONNRESET == errno) {
+    ++stats.syscalls;
+    if (0 > bc and (EAGAIN == errno or EWOULDBLOCK == errno)) {
+        // spurious wakeup, nothing to answer yet
+        ++stats.recv_eagain;
+        return true;
+    } else if (0 > bc and ECONNRESET == errno) {
         return false;
     } else if (0 > bc) {
         std::perror("recv(fd, &buffer[0], buff_sz, 0)");
@@ -305,38 +1334,54 @@ bool ping(int fd, char * buff, int buff_sz) {
         std::perror("partial message");
         return false;
     }
+    stats.bytes_in += bc;
 
+    ++stats.syscalls;
     if (buff_sz != write(fd, buff, buff_sz)) {
+        if (EAGAIN == errno or EWOULDBLOCK == errno)
+            ++stats.write_eagain;
         std::perror("write(fd, &buffer[0], buff_sz)");
         return false;
     }
+    stats.bytes_out += buff_sz;
     return true;
 }
 
+// lat_sample=N: no per message lookups, send time is taken for random one
+// in N requests (gap is uniform in [1, 2N - 1], so it doesn't lock on fd
+// order) and clock is read once per wakeup while samples are in flight
 void worker_thread_fast(EPollRSelector * sel,
                         int message_len,
                         int,
                         unsigned long int timeout_ns_min,
                         unsigned long int timeout_ns_max,
                         Sync * sync,
-                        TestResult * result)
+                        TestResult * result,
+                        const TestParams * params)
 {
     if (0 != timeout_ns_min or 0 != timeout_ns_max) {
         std::cerr << "worker_thread_fast doesn't support timeouts\n";
         return;
     }
 
-    DecOnExit exitor(&sync->active_count);
     result->mcount = 0;
 
     std::vector<char> buffer;
     buffer.resize(message_len);
 
-    sync->active_count++;
+    std::vector<unsigned long> sent_at;     // by fd, 0 - not sampled
+    unsigned long in_flight = 0;
+    std::minstd_rand rand_gen(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    std::uniform_int_distribution<long> rand_gap(1, 2 * params->lat_sample - 1);
+    long countdown = rand_gap(rand_gen);
+    LatLog * lat_log = result->lat_log.get();
+
+    PerfCounters perf(&result->counters);
 
-    // inhouse barrier implementation
-    sync->run_lola_run.lock();
-    sync->run_lola_run.unlock();
+    // checks in, blocks till start
+    WorkerScope scope(sync, result);
+
+    perf.start();
 
     for(;;) {
         if (not sel->wait(100 * 1000 * 1000))
@@ -345,160 +1390,1558 @@ void worker_thread_fast(EPollRSelector * sel,
         if (sync->done.load())
             return;
 
+        unsigned long curr_time = 0 != in_flight ? get_fast_time() : 0;
+
         int fd;
         result->mcount += sel->ready_count();
         while(sel->next(fd)) {
-            if (not ping(fd, &buffer[0], message_len))
+            if (fd < (int)sent_at.size() and 0 != sent_at[fd]) {
+                unsigned long lat = curr_time - sent_at[fd];
+                result->add_lat(lat);
+                if (nullptr != lat_log)
+                    lat_log->add(curr_time, fd, lat, message_len);
+                sent_at[fd] = 0;
+                --in_flight;
+            }
+
+            if (not ping(fd, &buffer[0], message_len, sel->stats))
                 return;
+
+            if (0 == --countdown) {
+                countdown = rand_gap(rand_gen);
+                if (fd >= (int)sent_at.size())
+                    sent_at.resize(fd + 1, 0);
+                sent_at[fd] = get_fast_time();
+                ++in_flight;
+            }
         }
     }
 }
 
+// HasTimeout - sockets wait random timeout in [timeout_ns_min, timeout_ns_max]
+// between reply and next request. RecordLatency - per message latency goes
+// to lat_map, latency=0 option disables it together with send time lookups.
+// run_test picks one of explicitly instantiated combinations, so per message
+// loop has no branches and lookups for disabled features.
+template<bool HasTimeout, bool RecordLatency>
 void worker_thread(EPollRSelector * sel,
                    int message_len,
                    int sock_count,
                    unsigned long timeout_ns_min,
                    unsigned long timeout_ns_max,
                    Sync * sync,
-                   TestResult * result)
+                   TestResult * result,
+                   const TestParams * params)
 {
-    std::unordered_map<int, unsigned long> last_time_for_socket;
+    static_assert(RecordLatency or not HasTimeout, "timeouts are counted from last send time");
+
+    std::vector<unsigned long> last_time_for_socket;    // by fd, 0 - sent by run_test
     result->mcount = 0;
 
     std::mt19937 rand_gen;
     std::uniform_int_distribution<unsigned long> rand_timeout(timeout_ns_min, timeout_ns_max);
 
-    bool has_timeout = (0 != timeout_ns_min) or (0 != timeout_ns_max);
+    // framing=lp: reply may take several wakeups, parsers are indexed by fd.
+    // Request, which socket didn't take, is written on EPOLLOUT and reply
+    // time is counted from its end.
+    const bool framed = params->framed;
+    std::vector<FrameParser> parsers;
+    std::vector<SendQueue> & queues = result->send_queues;
+    SizeDistribution req_size = params->req_size;
+    SizeDistribution resp_size = params->resp_size;
 
     std::vector<char> buffer;
-    buffer.resize(message_len);
+    buffer.resize(framed ? std::max(message_len, 64 * 1024) : message_len);
 
     std::vector<int> ready_fds;
     ready_fds.reserve(sock_count);
 
-    std::priority_queue<FdTimout> wait_queue;
+    std::priority_queue<FdTimout> wait_queue;
+
+    LatLog * lat_log = result->lat_log.get();
+    uint32_t reply_size = message_len;
+
+    PerfCounters perf(&result->counters);
+
+    // checks in, blocks till start
+    WorkerScope scope(sync, result);
+
+    perf.start();
+
+    for(;;) {
+        ready_fds.clear();
+        unsigned long curr_time = 0;
+
+        // if there a ready sockets, waiting for timeout
+        // need to not sleep too long in epoll
+        if (HasTimeout and wait_queue.size() > 0) {
+            curr_time = get_fast_time();
+            long int poll_timeout = wait_queue.top().ready_time - curr_time;
+
+            if (poll_timeout < 0)
+                poll_timeout = 0;
+
+            if (not sel->wait(poll_timeout))
+                return;
+
+            // fill ready_fds with sockets
+            // with expired timeouts
+            curr_time = get_fast_time();
+            while(wait_queue.size() > 0) {
+                auto & item = wait_queue.top();
+                // if timeout expires - remove from timeout_wait_queue
+                // and put to ready_fds
+                if (item.ready_time <= curr_time) {
+                    ready_fds.push_back(item.fd);
+                    wait_queue.pop();
+                } else
+                    break;
+            }
+        } else {
+            if (not sel->wait(100 * 1000 * 1000))
+                return;
+            if constexpr (RecordLatency)
+                curr_time = get_fast_time();
+        }
+
+
+        if (sync->done.load())
+            return;
+
+        // go throught all polled fds, calculated latency
+        // and move some to wait_queue
+
+        if (not framed)
+            result->mcount += sel->ready_count();
+
+        int fd;
+        uint32_t events;
+        while(sel->next(fd, events)) {
+            if (framed) {
+                if (fd >= (int)parsers.size())
+                    parsers.resize(fd + 1, FrameParser());
+                if (fd >= (int)queues.size())
+                    queues.resize(fd + 1);
+
+                if (events & EPOLLOUT) {
+                    bool was_queued = not queues[fd].empty();
+                    if (not queues[fd].flush(fd, *sel, sel->stats))
+                        return;
+                    if constexpr (RecordLatency)
+                        if (was_queued and queues[fd].empty()) {
+                            if (fd >= (int)last_time_for_socket.size())
+                                last_time_for_socket.resize(fd + 1, 0);
+                            last_time_for_socket[fd] = get_fast_time();
+                        }
+                }
+                if (not (events & EPOLLIN))
+                    continue;
+
+                int frames = read_frames(fd, parsers[fd], &buffer[0], buffer.size(), sel->stats, false, 1,
+                                         [&](const FrameHeader & reply) {
+                                             reply_size = reply.body_len;
+                                             return true;
+                                         });
+                if (0 > frames)
+                    return;
+
+                // reply isn't complete yet
+                if (0 == frames)
+                    continue;
+                ++result->mcount;
+            }
+
+            if constexpr (RecordLatency) {
+                if (fd >= (int)last_time_for_socket.size())
+                    last_time_for_socket.resize(fd + 1, 0);
+
+                // previous write time for curr socket
+                auto ltime = last_time_for_socket[fd];
+
+                // if have previous write time for curr socket
+                if (0 != ltime) {
+                    result->add_lat(curr_time - ltime);
+                    if (nullptr != lat_log)
+                        lat_log->add(curr_time, fd, curr_time - ltime, reply_size);
+                }
+
+                if constexpr (HasTimeout) {
+                    unsigned long timeout_ns = 0;
+                    if (timeout_ns_max != timeout_ns_min) {
+                        timeout_ns = rand_timeout(rand_gen);
+                    } else {
+                        timeout_ns = timeout_ns_max;
+                    }
+
+                    // if socket isn't ready for new ping yet
+                    // put it into wait_queue
+                    if (ltime + timeout_ns > curr_time) {
+                        wait_queue.emplace(fd, ltime + timeout_ns);
+                        continue;
+                    }
+                }
+            }
+
+            ready_fds.push_back(fd);
+            if (HasTimeout and sync->done.load())
+                return;
+        }
+
+        for(auto fd: ready_fds) {
+            if (HasTimeout and sync->done.load())
+                return;
+
+            if (framed) {
+                FrameHeader request{req_size(rand_gen), resp_size(rand_gen)};
+                queues[fd].add_frames(&request, 1);
+                if (not queues[fd].flush(fd, *sel, sel->stats))
+                    return;
+            } else if (not ping(fd, &buffer[0], message_len, sel->stats))
+                return;
+
+            // request, which is still queued, is timed on EPOLLOUT
+            if constexpr (RecordLatency)
+                last_time_for_socket[fd] = (framed and not queues[fd].empty()) ? 0 : get_fast_time();
+            result->mess_count_for_sock.emplace(fd, 0).first->second++;
+        }
+    }
+}
+
+typedef void (*WorkerFunc)(EPollRSelector *, int, int, unsigned long, unsigned long,
+                           Sync *, TestResult *, const TestParams *);
+
+template void worker_thread<false, false>(EPollRSelector *, int, int, unsigned long, unsigned long,
+                                          Sync *, TestResult *, const TestParams *);
+template void worker_thread<false, true>(EPollRSelector *, int, int, unsigned long, unsigned long,
+                                         Sync *, TestResult *, const TestParams *);
+template void worker_thread<true, true>(EPollRSelector *, int, int, unsigned long, unsigned long,
+                                        Sync *, TestResult *, const TestParams *);
+
+WorkerFunc select_worker(const TestParams & params) {
+    bool has_timeout = (0 != params.min_timeout) or (0 != params.max_timeout);
+    if (has_timeout)
+        return worker_thread<true, true>;
+    if (params.lat_sample > 1)
+        return worker_thread_fast;
+    if (params.record_latency)
+        return worker_thread<false, true>;
+    return worker_thread<false, false>;
+}
+
+// kernel_ts=1: software TX/RX timestamps. TX timestamps come via error
+// queue, with OPT_ID they are keyed by number of bytes sent minus one, so
+// stale ones are skipped. Error queue wakes epoll with EPOLLERR.
+bool enable_kernel_ts(int fd) {
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE |
+                SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (0 != setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags))) {
+        std::perror("setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, ...)");
+        return false;
+    }
+    return true;
+}
+
+struct KernelTsState {
+    unsigned long sent_at;  // 0 - sent by run_test
+    unsigned long tx_at;    // 0 - no TX timestamp yet
+    uint64_t bytes_sent;
+};
+
+inline unsigned long ts_to_ns(const timespec & ts) {
+    return ts.tv_sec * 1000UL * 1000UL * 1000UL + ts.tv_nsec;
+}
+
+// drain error queue, take TX timestamp of the last write
+bool read_tx_timestamps(int fd, KernelTsState & state, SelectorStats & stats) {
+    char control[256];
+    for(;;) {
+        msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ++stats.syscalls;
+        if (0 > recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT)) {
+            if (EAGAIN == errno or EWOULDBLOCK == errno)
+                return true;
+            std::perror("recvmsg(fd, ..., MSG_ERRQUEUE)");
+            return false;
+        }
+
+        unsigned long tx_at = 0;
+        const sock_extended_err * err = nullptr;
+        for(cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); nullptr != cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (SOL_SOCKET == cmsg->cmsg_level and SCM_TIMESTAMPING == cmsg->cmsg_type)
+                tx_at = ts_to_ns(((const scm_timestamping *)CMSG_DATA(cmsg))->ts[0]);
+            else if ((SOL_IP == cmsg->cmsg_level and IP_RECVERR == cmsg->cmsg_type) or
+                     (SOL_IPV6 == cmsg->cmsg_level and IPV6_RECVERR == cmsg->cmsg_type))
+                err = (const sock_extended_err *)CMSG_DATA(cmsg);
+        }
+
+        if (nullptr != err and ENOMSG == err->ee_errno and SO_EE_ORIGIN_TIMESTAMPING == err->ee_origin and
+                SCM_TSTAMP_SND == err->ee_info and (uint32_t)(state.bytes_sent - 1) == err->ee_data)
+            state.tx_at = tx_at;
+    }
+}
+
+// recv with RX timestamp, returns recv() result
+int recv_rx_timestamp(int fd, char * buff, int buff_sz, unsigned long & rx_at, SelectorStats & stats) {
+    char control[256];
+    iovec iov = {buff, (size_t)buff_sz};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ++stats.syscalls;
+    int bc = recvmsg(fd, &msg, 0);
+    if (0 >= bc)
+        return bc;
+
+    rx_at = 0;
+    for(cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); nullptr != cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (SOL_SOCKET == cmsg->cmsg_level and SCM_TIMESTAMPING == cmsg->cmsg_type)
+            rx_at = ts_to_ns(((const scm_timestamping *)CMSG_DATA(cmsg))->ts[0]);
+    return bc;
+}
+
+// clamped difference, timestamps may be taken by different CPUs
+inline unsigned long ts_diff(unsigned long from, unsigned long to) {
+    return to > from ? to - from : 0;
+}
+
+void worker_thread_kernel_ts(EPollRSelector * sel, Sync * sync, TestResult * result, const TestParams * params) {
+    const int message_len = params->message_len;
+    std::vector<char> buffer(message_len);
+    std::vector<KernelTsState> states;
+    KernelTsParts & parts = result->kernel_ts;
+    LatLog * lat_log = result->lat_log.get();
+    result->mcount = 0;
+
+    PerfCounters perf(&result->counters);
+
+    // checks in, blocks till start
+    WorkerScope scope(sync, result);
+
+    perf.start();
+
+    for(;;) {
+        if (not sel->wait(100 * 1000 * 1000))
+            return;
+
+        unsigned long wakeup_at = get_fast_time();
+        if (sync->done.load())
+            return;
+
+        int fd;
+        uint32_t flags;
+        while(sel->next(fd, flags)) {
+            // first request was sent by run_test
+            if (fd >= (int)states.size())
+                states.resize(fd + 1, KernelTsState{0, 0, (uint64_t)message_len});
+            auto & state = states[fd];
+
+            if ((flags & EPOLLERR) and not read_tx_timestamps(fd, state, sel->stats))
+                return;
+
+            if (not (flags & EPOLLIN))
+                continue;
+
+            unsigned long rx_at = 0;
+            int bc = recv_rx_timestamp(fd, &buffer[0], message_len, rx_at, sel->stats);
+            if (0 > bc and (EAGAIN == errno or EWOULDBLOCK == errno)) {
+                ++sel->stats.recv_eagain;
+                continue;
+            } else if (0 > bc) {
+                if (ECONNRESET != errno)
+                    std::perror("recvmsg(fd, ...)");
+                return;
+            } else if (message_len != bc) {
+                std::cerr << "partial message " << bc << " of " << message_len << " bytes\n";
+                return;
+            }
+            sel->stats.bytes_in += bc;
+
+            unsigned long recv_at = get_fast_time();
+            ++result->mcount;
+
+            if (0 != state.sent_at) {
+                // TX timestamp may be queued without separate wakeup yet
+                if (0 == state.tx_at and not read_tx_timestamps(fd, state, sel->stats))
+                    return;
+
+                result->add_lat(recv_at - state.sent_at);
+                if (nullptr != lat_log)
+                    lat_log->add(recv_at, fd, recv_at - state.sent_at, bc);
+
+                if (0 != state.tx_at and 0 != rx_at) {
+                    parts.send.add(ts_diff(state.sent_at, state.tx_at));
+                    parts.wire.add(ts_diff(state.tx_at, rx_at));
+                    parts.recv.add(ts_diff(rx_at, wakeup_at));
+                    parts.user.add(ts_diff(std::max(rx_at, wakeup_at), recv_at));
+                } else
+                    ++parts.missing;
+            }
+
+            state.sent_at = get_fast_time();
+            state.tx_at = 0;
+            ++sel->stats.syscalls;
+            if (message_len != write(fd, &buffer[0], message_len)) {
+                std::perror("write(fd, &buffer[0], message_len)");
+                return;
+            }
+            sel->stats.bytes_out += message_len;
+            state.bytes_sent += message_len;
+            result->mess_count_for_sock.emplace(fd, 0).first->second++;
+        }
+    }
+}
+
+// owd=1: NTP style exchange with main.py over the control socket. Loader
+// sends 'C', main.py answers with its receive and send times (two u64,
+// CLOCK_MONOTONIC of the responder host), 'E' ends the exchange. Offset of
+// a burst is taken from the probe with the shortest round trip, drift is
+// least squares fit of burst offsets over time.
+struct ClockModel {
+    unsigned long base_ns;  // loader clock
+    double offset_ns;       // responder minus loader clock at base_ns
+    double drift;           // offset change per loader ns
+
+    double offset_at(unsigned long loader_ns) const {
+        return offset_ns + drift * ((double)loader_ns - (double)base_ns);
+    }
+};
+
+class ClockSync {
+protected:
+    int sock;
+    unsigned long origin_ns;                        // first burst time
+    std::vector<std::pair<double, double>> points;  // burst time since origin, offset
+    unsigned long min_rtt_ns;
+    // single writer: burst appends new model and publishes pointer to it.
+    // Models are immutable and live as long as ClockSync, so workers may
+    // read the old one while a new one is added.
+    std::deque<ClockModel> models;
+    std::atomic<const ClockModel *> current;
+
+    bool probe(unsigned long & at_ns, unsigned long & rtt_ns, double & offset_ns);
+
+public:
+    ClockSync(int _sock): sock(_sock), origin_ns(0), min_rtt_ns(ULONG_MAX) {
+        models.push_back(ClockModel{0, 0, 0});
+        current.store(&models.back());
+        set_nodelay(sock);
+    }
+
+    bool burst(int probes=16);
+    bool finish();
+
+    ClockModel model() const {
+        return *current.load(std::memory_order_acquire);
+    }
+
+    void add_to(StatsList & stats) const;
+};
+
+bool ClockSync::probe(unsigned long & at_ns, unsigned long & rtt_ns, double & offset_ns) {
+    unsigned long sent_at = get_mono_time();
+    if (1 != write(sock, "C", 1)) {
+        std::perror("write(control_sock, clock probe)");
+        return false;
+    }
+
+    uint64_t times[2];
+    size_t got = 0;
+    while(got < sizeof(times)) {
+        pollfd pfd = {sock, POLLIN, 0};
+        if (1 != poll(&pfd, 1, 1000)) {
+            std::cerr << "No clock probe reply, owd requires main.py run with owd=1\n";
+            return false;
+        }
+        int bc = recv(sock, (char *)times + got, sizeof(times) - got, 0);
+        if (0 >= bc) {
+            std::cerr << "Control connection closed during clock probe\n";
+            return false;
+        }
+        got += bc;
+    }
+    unsigned long recv_at = get_mono_time();
+
+    at_ns = sent_at + (recv_at - sent_at) / 2;
+    rtt_ns = recv_at - sent_at - std::min(recv_at - sent_at, (unsigned long)ts_diff(times[0], times[1]));
+    offset_ns = ((double)(long)(times[0] - sent_at) + (double)(long)(times[1] - recv_at)) / 2;
+    return true;
+}
+
+bool ClockSync::burst(int probes) {
+    unsigned long best_at = 0, best_rtt = ULONG_MAX;
+    double best_offset = 0;
+    for(int i = 0; i < probes; ++i) {
+        unsigned long at, rtt;
+        double offset;
+        if (not probe(at, rtt, offset))
+            return false;
+        if (rtt < best_rtt) {
+            best_at = at;
+            best_rtt = rtt;
+            best_offset = offset;
+        }
+    }
+
+    if (points.empty())
+        origin_ns = best_at;
+    points.emplace_back((double)(best_at - origin_ns), best_offset);
+    min_rtt_ns = std::min(min_rtt_ns, best_rtt);
+
+    double mean_t = 0, mean_offset = 0;
+    for(const auto & point: points) {
+        mean_t += point.first / points.size();
+        mean_offset += point.second / points.size();
+    }
+    double cov = 0, var = 0;
+    for(const auto & point: points) {
+        cov += (point.first - mean_t) * (point.second - mean_offset);
+        var += (point.first - mean_t) * (point.first - mean_t);
+    }
+
+    models.push_back(ClockModel{origin_ns + (unsigned long)mean_t, mean_offset, 0 == var ? 0 : cov / var});
+    current.store(&models.back(), std::memory_order_release);
+    return true;
+}
+
+bool ClockSync::finish() {
+    if (1 != write(sock, "E", 1)) {
+        std::perror("write(control_sock, clock end)");
+        return false;
+    }
+    return true;
+}
+
+void ClockSync::add_to(StatsList & stats) const {
+    if (points.empty())
+        return;
+    ClockModel last = model();
+    stats.add("owd_clock_bursts", (unsigned long)points.size());
+    stats.add("owd_clock_rtt_ns", min_rtt_ns);
+    stats.add("owd_clock_offset_ns", last.offset_at(origin_ns + (unsigned long)points.back().first));
+    stats.add("owd_clock_drift_ppb", last.drift * BILLION);
+}
+
+void worker_thread_owd(EPollRSelector * sel, Sync * sync, TestResult * result, const TestParams * params) {
+    const int message_len = params->message_len;
+    std::vector<char> buffer(message_len);
+    std::vector<unsigned long> sent_at;     // by fd, 0 - sent by run_test
+    OwdParts & owd = result->owd;
+    const ClockSync & clock = *params->clock;
+    LatLog * lat_log = result->lat_log.get();
+    result->mcount = 0;
+
+    PerfCounters perf(&result->counters);
+
+    // checks in, blocks till start
+    WorkerScope scope(sync, result);
+
+    perf.start();
+
+    for(;;) {
+        if (not sel->wait(100 * 1000 * 1000))
+            return;
+
+        if (sync->done.load())
+            return;
+
+        int fd;
+        while(sel->next(fd)) {
+            ++sel->stats.syscalls;
+            int bc = recv(fd, &buffer[0], message_len, 0);
+            if (0 > bc and (EAGAIN == errno or EWOULDBLOCK == errno)) {
+                ++sel->stats.recv_eagain;
+                continue;
+            } else if (0 > bc) {
+                if (ECONNRESET != errno)
+                    std::perror("recv(fd, ...)");
+                return;
+            } else if (message_len != bc) {
+                std::cerr << "partial message " << bc << " of " << message_len << " bytes\n";
+                return;
+            }
+            sel->stats.bytes_in += bc;
+
+            unsigned long recv_at = get_mono_time();
+            ++result->mcount;
+
+            if (fd >= (int)sent_at.size())
+                sent_at.resize(fd + 1, 0);
+
+            if (0 != sent_at[fd]) {
+                result->add_lat(recv_at - sent_at[fd]);
+                if (nullptr != lat_log)
+                    lat_log->add(recv_at, fd, recv_at - sent_at[fd], bc);
+
+                OwdStamp stamp;
+                std::memcpy(&stamp, &buffer[0], sizeof(stamp));
+                double offset = clock.model().offset_at(recv_at);
+                double fwd = (double)(long)(stamp.recv_ns - sent_at[fd]) - offset;
+                double ret = (double)(long)(recv_at - stamp.send_ns) + offset;
+                if (fwd < 0 or ret < 0)
+                    ++owd.negative;
+                owd.fwd.add((unsigned long)std::max(fwd, 0.0));
+                owd.ret.add((unsigned long)std::max(ret, 0.0));
+                owd.hold.add(ts_diff(stamp.recv_ns, stamp.send_ns));
+            }
+
+            sent_at[fd] = get_mono_time();
+            ++sel->stats.syscalls;
+            if (message_len != write(fd, &buffer[0], message_len)) {
+                std::perror("write(fd, &buffer[0], message_len)");
+                return;
+            }
+            sel->stats.bytes_out += message_len;
+            result->mess_count_for_sock.emplace(fd, 0).first->second++;
+        }
+    }
+}
+
+// active=F, churn=R: only a window of F * own connections has a request in
+// flight, the rest stay idle, to see how engines scale with idle population.
+// Window moves by R connections per second (over all workers): connection
+// leaving it goes idle after its reply, entering one gets a request at once.
+// schedule=...: window size follows the schedule level, phase rate paces
+// requests of each connection, RTT is kept per phase as well.
+enum ConnActivity : uint8_t {
+    CONN_IDLE,
+    CONN_ACTIVE,
+    CONN_RETIRING,  // left window, reply or paced send is pending
+};
+
+void worker_thread_idle(EPollRSelector * sel,
+                        const std::vector<int> * fds,
+                        int worker_idx,
+                        int worker_count,
+                        Sync * sync,
+                        TestResult * result,
+                        const TestParams * params)
+{
+    result->mcount = 0;
+    result->churned = 0;
+
+    std::vector<int> own;
+    for(size_t i = worker_idx; i < fds->size(); i += worker_count)
+        own.push_back((*fds)[i]);
+
+    const LoadSchedule & schedule = params->schedule;
+    const bool scheduled = not schedule.empty();
+    size_t window = scheduled ? 0 : std::min(own.size(),
+                                             (size_t)std::max(1L, std::lround(own.size() * params->active)));
+    const double churn_per_ns = params->churn * own.size() / fds->size() / BILLION;
+    const bool record_latency = params->record_latency;
+    LatLog * lat_log = result->lat_log.get();
+    result->phase_lat.assign(schedule.phases.size(), LatHist());
+
+    const int message_len = params->message_len;
+    std::vector<char> buffer(message_len, 'X');
+
+    int max_fd = 0;
+    for(auto fd: own)
+        max_fd = std::max(max_fd, fd);
+    std::vector<ConnActivity> state(max_fd + 1, CONN_IDLE);
+    std::vector<unsigned long> sent_at(max_fd + 1, 0);
+    std::priority_queue<FdTimout> paced;   // schedule with rate: next sends
+
+    auto send_request = [&](int fd) {
+        sent_at[fd] = record_latency ? get_fast_time() : 0;
+        ++sel->stats.syscalls;
+        if (message_len != write(fd, &buffer[0], message_len)) {
+            std::perror("write(fd, &buffer[0], message_len)");
+            return false;
+        }
+        sel->stats.bytes_out += message_len;
+        return true;
+    };
+
+    // reply of the previous activation may be still in flight
+    auto activate = [&](int fd) {
+        if (CONN_RETIRING == state[fd]) {
+            state[fd] = CONN_ACTIVE;
+            return true;
+        }
+        state[fd] = CONN_ACTIVE;
+        return send_request(fd);
+    };
+
+    PerfCounters perf(&result->counters);
+
+    // checks in, blocks till start
+    WorkerScope scope(sync, result);
+
+    perf.start();
+
+    const unsigned long start_time = sync->start_time;
+    size_t phase = 0;
+
+    for(size_t i = 0; i < window; ++i)
+        if (not activate(own[i]))
+            return;
+
+    size_t head = 0;    // window is own[head, head + window) modulo own.size()
+    double churn_budget = 0;
+    unsigned long last_churn = get_fast_time();
+
+    for(;;) {
+        // short wait, so churn and schedule go on while replies are slow
+        long timeout_ns = (0 == churn_per_ns and not scheduled ? 100 : 10) * 1000 * 1000;
+        if (not paced.empty()) {
+            unsigned long now = get_fast_time();
+            unsigned long ready_time = paced.top().ready_time;
+            timeout_ns = std::min(timeout_ns, ready_time > now ? (long)(ready_time - now) : 0L);
+        }
+        if (not sel->wait(timeout_ns))
+            return;
+
+        unsigned long curr_time = get_fast_time();
+        if (sync->done.load())
+            return;
+
+        unsigned long run_time = curr_time - std::min(curr_time, start_time);
+        if (scheduled)
+            phase = schedule.phase_at(run_time);
+        const double rate = scheduled ? schedule.phases[phase].rate : 0;
+
+        int fd;
+        while(sel->next(fd)) {
+            ++sel->stats.syscalls;
+            int bc = recv(fd, &buffer[0], message_len, 0);
+            if (0 > bc and (EAGAIN == errno or EWOULDBLOCK == errno)) {
+                ++sel->stats.recv_eagain;
+                continue;
+            } else if (0 > bc) {
+                if (ECONNRESET != errno)
+                    std::perror("recv(fd, ...)");
+                return;
+            } else if (message_len != bc) {
+                std::cerr << "partial message " << bc << " of " << message_len << " bytes\n";
+                return;
+            }
+            sel->stats.bytes_in += bc;
+            ++result->mcount;
+
+            if (record_latency) {
+                result->add_lat(curr_time - sent_at[fd]);
+                if (scheduled)
+                    result->phase_lat[phase].add(curr_time - sent_at[fd]);
+                if (nullptr != lat_log)
+                    lat_log->add(curr_time, fd, curr_time - sent_at[fd], bc);
+            }
+            result->mess_count_for_sock.emplace(fd, 0).first->second++;
+
+            if (CONN_RETIRING == state[fd]) {
+                state[fd] = CONN_IDLE;
+                continue;
+            }
+            if (0 != rate) {
+                paced.emplace(fd, sent_at[fd] + (unsigned long)(BILLION / rate));
+                continue;
+            }
+            if (not send_request(fd))
+                return;
+        }
+
+        while(not paced.empty() and paced.top().ready_time <= curr_time) {
+            fd = paced.top().fd;
+            paced.pop();
+            if (CONN_RETIRING == state[fd]) {
+                state[fd] = CONN_IDLE;
+                continue;
+            }
+            if (not send_request(fd))
+                return;
+        }
+
+        if (scheduled) {
+            size_t target = std::min(own.size(), (size_t)std::lround(own.size() *
+                                                                    schedule.level_at(phase, run_time)));
+            for(; window < target; ++window)
+                if (not activate(own[(head + window) % own.size()]))
+                    return;
+            for(; window > target; --window) {
+                state[own[head]] = CONN_RETIRING;
+                head = (head + 1) % own.size();
+            }
+        }
+
+        if (0 == churn_per_ns)
+            continue;
+
+        churn_budget += (curr_time - last_churn) * churn_per_ns;
+        last_churn = curr_time;
+        // nothing to swap, while schedule keeps window empty or full
+        if (0 == window or window == own.size())
+            churn_budget = 0;
+        for(; churn_budget >= 1; churn_budget -= 1) {
+            int leaving = own[head];
+            int entering = own[(head + window) % own.size()];
+            head = (head + 1) % own.size();
+
+            state[leaving] = CONN_RETIRING;
+            ++result->churned;
+            if (not activate(entering))
+                return;
+        }
+    }
+}
+
+// pipeline=N: N requests in flight per socket. Replies come in order, so
+// send times are kept in ring of N slots. run_test sends only the first
+// request, pipeline is filled after its reply. Zero time - request was
+// sent by run_test, latency is unknown.
+struct PipelineState {
+    unsigned long partial;  // raw: bytes of incomplete reply
+    int head;               // oldest request in flight
+    int in_flight;
+    std::vector<unsigned long> sent_at;
+};
+
+void worker_thread_pipeline(EPollRSelector * sel,
+                            Sync * sync,
+                            TestResult * result,
+                            const TestParams * params)
+{
+    result->mcount = 0;
+
+    const int depth = params->pipeline;
+    const int message_len = params->message_len;
+    const bool framed = params->framed;
+
+    std::mt19937 rand_gen;
+    SizeDistribution req_size = params->req_size;
+    SizeDistribution resp_size = params->resp_size;
+
+    std::vector<PipelineState> states;
+    std::vector<FrameParser> parsers;
+    std::vector<SendQueue> & queues = result->send_queues;
+    std::vector<FrameHeader> requests(depth);
+    std::string message((size_t)message_len, 'X');
+
+    // all replies in flight fit into buffer, if they aren't too large
+    std::vector<char> buffer;
+    buffer.resize(std::max(std::min((size_t)depth * message_len, (size_t)1024 * 1024),
+                           (size_t)std::max(message_len, 64 * 1024)));
+
+    LatLog * lat_log = result->lat_log.get();
+    std::vector<uint32_t> reply_sizes;
+
+    // read replies, returns number of completed requests or -1
+    auto complete = [&](int fd, PipelineState & state) {
+        int completed;
+        if (framed) {
+            reply_sizes.clear();
+            completed = read_frames(fd, parsers[fd], &buffer[0], buffer.size(), sel->stats, false, 0,
+                                    [&](const FrameHeader & reply) {
+                                        if (nullptr != lat_log)
+                                            reply_sizes.push_back(reply.body_len);
+                                        return true;
+                                    });
+        } else {
+            long bc = recv_available(fd, &buffer[0], buffer.size(), sel->stats, false);
+            if (0 > bc)
+                return -1;
+            state.partial += bc;
+            completed = state.partial / message_len;
+            state.partial %= message_len;
+        }
+
+        if (0 >= completed)
+            return completed;
+
+        if (completed > state.in_flight) {
+            std::cerr << "Got " << completed << " replies with " << state.in_flight << " requests in flight\n";
+            return -1;
+        }
+
+        unsigned long curr_time = get_fast_time();
+        for(int i = 0; i < completed; ++i) {
+            unsigned long sent_at = state.sent_at[state.head];
+            if (0 != sent_at) {
+                result->add_lat(curr_time - sent_at);
+                if (nullptr != lat_log)
+                    lat_log->add(curr_time, fd, curr_time - sent_at, framed ? reply_sizes[i] : message_len);
+            }
+            state.head = (state.head + 1) % depth;
+        }
+        state.in_flight -= completed;
+        result->mcount += completed;
+        result->mess_count_for_sock.emplace(fd, 0).first->second += completed;
+        return completed;
+    };
+
+    PerfCounters perf(&result->counters);
+
+    // checks in, blocks till start
+    WorkerScope scope(sync, result);
+
+    perf.start();
+
+    for(;;) {
+        if (not sel->wait(100 * 1000 * 1000))
+            return;
+
+        if (sync->done.load())
+            return;
+
+        int fd;
+        uint32_t events;
+        while(sel->next(fd, events)) {
+            if (fd >= (int)states.size()) {
+                states.resize(fd + 1);
+                parsers.resize(fd + 1, FrameParser());
+            }
+            if (fd >= (int)queues.size())
+                queues.resize(fd + 1);
+
+            auto & state = states[fd];
+            int to_send = 0;
+            if (state.sent_at.empty()) {
+                state.sent_at.resize(depth, 0);
+                state.in_flight = 1;
+                to_send = depth - 1;
+            }
+
+            if ((events & EPOLLOUT) and not queues[fd].flush(fd, *sel, sel->stats))
+                return;
+
+            int completed = (events & EPOLLIN) ? complete(fd, state) : 0;
+            if (0 > completed)
+                return;
+            to_send += completed;
+            if (0 == to_send)
+                continue;
+
+            // requests are timed from the queueing, as they wait behind
+            // previous ones anyway
+            unsigned long sent_time = get_fast_time();
+            for(int i = 0; i < to_send; ++i)
+                state.sent_at[(state.head + state.in_flight + i) % depth] = sent_time;
+            state.in_flight += to_send;
+
+            if (framed) {
+                for(int i = 0; i < to_send; ++i)
+                    requests[i] = FrameHeader{req_size(rand_gen), resp_size(rand_gen)};
+                queues[fd].add_frames(&requests[0], to_send);
+            } else {
+                queues[fd].add_copies(message.c_str(), message_len, to_send);
+            }
+
+            if (not queues[fd].flush(fd, *sel, sel->stats))
+                return;
+        }
+    }
+}
+
+// trace=FILE replay. Trace connection I is socket I, worker owns the same
+// connections as in run_test - I % worker_count == worker_idx, and gets
+// their events, split by run_test before start. Request is sent at its time
+// or, if previous request of the connection has no reply yet, right after
+// the reply. Request, which socket didn't take, is written on EPOLLOUT and
+// its RTT starts when it's fully written. Delay against schedule is
+// reported as trace lag.
+struct TraceConn {
+    bool busy;
+    unsigned long sent_at;
+    std::deque<const TraceEvent *> backlog;
+
+    TraceConn(): busy(false), sent_at(0) {}
+};
+
+void worker_thread_trace(EPollRSelector * sel,
+                         const std::vector<int> * fds,
+                         const std::vector<const TraceEvent *> * events,
+                         int worker_idx,
+                         int worker_count,
+                         Sync * sync,
+                         TestResult * result,
+                         const TestParams * params)
+{
+    result->mcount = 0;
+
+    auto curr = events->begin();
+    const auto end = events->end();
+
+    int max_fd = 0;
+    for(size_t conn = worker_idx; conn < params->trace->conn_count(); conn += worker_count)
+        max_fd = std::max(max_fd, (*fds)[conn]);
+
+    std::vector<TraceConn> conns(max_fd + 1);
+    std::vector<FrameParser> parsers(max_fd + 1, FrameParser());
+    std::vector<SendQueue> & queues = result->send_queues;
+    queues.resize(max_fd + 1);
+    std::vector<char> buffer(64 * 1024);
+    int busy_count = 0;
+
+    LatLog * lat_log = result->lat_log.get();
+    uint32_t reply_size = 0;
+
+    auto send = [&](int fd, const TraceEvent & event, unsigned long curr_time) {
+        result->trace_lag.add(curr_time - std::min(curr_time, sync->start_time + event.time_ns));
+
+        FrameHeader request{event.req_size, event.resp_size};
+        queues[fd].add_frames(&request, 1);
+        if (not queues[fd].flush(fd, *sel, sel->stats))
+            return false;
+
+        conns[fd].busy = true;
+        conns[fd].sent_at = queues[fd].empty() ? get_fast_time() : 0;
+        ++busy_count;
+        return true;
+    };
+
+    PerfCounters perf(&result->counters);
+
+    // checks in, blocks till start
+    WorkerScope scope(sync, result);
+
+    perf.start();
+
+    for(;;) {
+        if (sync->done.load())
+            return;
+
+        // send all due requests
+        unsigned long curr_time = get_fast_time();
+        while(curr != end and sync->start_time + (*curr)->time_ns <= curr_time) {
+            int fd = (*fds)[(*curr)->conn];
+            if (conns[fd].busy)
+                conns[fd].backlog.push_back(*curr);
+            else if (not send(fd, **curr, curr_time))
+                return;
+            ++curr;
+        }
+
+        // replay is finished
+        if (curr == end and 0 == busy_count)
+            return;
+
+        long timeout_ns = 100 * 1000 * 1000;
+        if (curr != end)
+            timeout_ns = std::min(timeout_ns, (long)(sync->start_time + (*curr)->time_ns - curr_time));
+
+        if (not sel->wait(timeout_ns))
+            return;
+
+        if (sync->done.load())
+            return;
+        if (0 == sel->ready_count())
+            continue;
+
+        curr_time = get_fast_time();
+        int fd;
+        uint32_t events;
+        while(sel->next(fd, events)) {
+            if (events & EPOLLOUT) {
+                bool was_queued = not queues[fd].empty();
+                if (not queues[fd].flush(fd, *sel, sel->stats))
+                    return;
+                if (was_queued and queues[fd].empty())
+                    conns[fd].sent_at = get_fast_time();
+            }
+            if (not (events & EPOLLIN))
+                continue;
+
+            int frames = read_frames(fd, parsers[fd], &buffer[0], buffer.size(), sel->stats, false, 1,
+                                     [&](const FrameHeader & reply) {
+                                         reply_size = reply.body_len;
+                                         return true;
+                                     });
+            if (0 > frames)
+                return;
+            if (0 == frames)
+                continue;
+
+            auto & conn = conns[fd];
+            ++result->mcount;
+            result->add_lat(curr_time - conn.sent_at);
+            if (nullptr != lat_log)
+                lat_log->add(curr_time, fd, curr_time - conn.sent_at, reply_size);
+            result->mess_count_for_sock.emplace(fd, 0).first->second++;
+            conn.busy = false;
+            --busy_count;
+
+            if (not conn.backlog.empty()) {
+                const TraceEvent * event = conn.backlog.front();
+                conn.backlog.pop_front();
+                if (not send(fd, *event, curr_time))
+                    return;
+            }
+        }
+    }
+}
+
+struct UdpFlow {
+    int fd;
+    uint32_t seq;
+    unsigned long send_time;
+    unsigned long received, lost, late;
+    LatHist lat;
+
+    UdpFlow(int _fd): fd(_fd), seq(0), send_time(0), received(0), lost(0), late(0) {}
+};
+
+const int UDP_BATCH = 64;
+
+bool send_udp_ping(UdpFlow & flow, uint32_t flow_idx, char * buff, int buff_sz, SelectorStats & stats)
+{
+    flow.send_time = get_fast_time();
+    UdpHeader hdr{flow_idx, flow.seq, flow.send_time};
+    std::memcpy(buff, &hdr, sizeof(hdr));
+
+    ++stats.syscalls;
+    if (buff_sz != send(flow.fd, buff, buff_sz, 0)) {
+        // lost ping would be resent by loss timeout
+        if (EAGAIN == errno or EWOULDBLOCK == errno or ENOBUFS == errno) {
+            ++stats.write_eagain;
+            return true;
+        }
+        std::perror("send(flow.fd, buff, buff_sz, 0)");
+        return false;
+    }
+    stats.bytes_out += buff_sz;
+    return true;
+}
+
+// one outstanding datagram per flow, any amount of flows per socket.
+// Datagram without responce in loss_timeout_ns considered lost and
+// flow continues with next seq, late responces are ignored.
+void worker_thread_udp(EPollRSelector * sel,
+                       std::vector<UdpFlow> * flows,
+                       int message_len,
+                       unsigned long loss_timeout_ns,
+                       Sync * sync,
+                       TestResult * result)
+{
+    result->mcount = 0;
+
+    std::vector<char> rbuff(UDP_BATCH * message_len);
+    std::vector<char> sbuff(UDP_BATCH * message_len, 'X');
+    std::array<mmsghdr, UDP_BATCH> rmsgs, smsgs;
+    std::array<iovec, UDP_BATCH> riovs, siovs;
+    std::array<uint32_t, UDP_BATCH> send_flows;
+
+    std::memset(&rmsgs[0], 0, sizeof(rmsgs));
+    std::memset(&smsgs[0], 0, sizeof(smsgs));
+    for(int i = 0; i < UDP_BATCH; ++i) {
+        riovs[i].iov_base = &rbuff[i * message_len];
+        riovs[i].iov_len = message_len;
+        rmsgs[i].msg_hdr.msg_iov = &riovs[i];
+        rmsgs[i].msg_hdr.msg_iovlen = 1;
+
+        siovs[i].iov_base = &sbuff[i * message_len];
+        siovs[i].iov_len = message_len;
+        smsgs[i].msg_hdr.msg_iov = &siovs[i];
+        smsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    SelectorStats & stats = sel->stats;
+    PerfCounters perf(&result->counters);
+
+    // checks in, blocks till start
+    WorkerScope scope(sync, result);
+
+    perf.start();
+
+    unsigned long curr_time = get_fast_time();
+    for(uint32_t idx = 0; idx < flows->size(); ++idx)
+        if (not send_udp_ping((*flows)[idx], idx, &sbuff[0], message_len, stats))
+            return;
+
+    unsigned long next_loss_check = curr_time + loss_timeout_ns;
+
+    for(;;) {
+        if (not sel->wait(loss_timeout_ns / 2))
+            return;
+
+        if (sync->done.load())
+            return;
+
+        curr_time = get_fast_time();
+
+        int fd;
+        while(sel->next(fd)) {
+            // edge triggered - drain socket
+            for(;;) {
+                int count = recvmmsg(fd, &rmsgs[0], UDP_BATCH, MSG_DONTWAIT, nullptr);
+                ++stats.syscalls;
+                if (0 > count) {
+                    if (EAGAIN == errno or EWOULDBLOCK == errno)
+                        break;
+                    std::perror("recvmmsg(fd, ...)");
+                    return;
+                }
+
+                unsigned long recv_time = get_fast_time();
+                int to_send = 0;
+                for(int i = 0; i < count; ++i) {
+                    stats.bytes_in += rmsgs[i].msg_len;
+                    if (rmsgs[i].msg_len < sizeof(UdpHeader))
+                        continue;
+
+                    UdpHeader hdr;
+                    std::memcpy(&hdr, riovs[i].iov_base, sizeof(hdr));
+                    if (hdr.flow >= flows->size())
+                        continue;
+
+                    auto & flow = (*flows)[hdr.flow];
+                    if (flow.fd != fd or hdr.seq != flow.seq) {
+                        ++flow.late;
+                        continue;
+                    }
+
+                    unsigned long lat = recv_time - std::min(recv_time, (unsigned long)hdr.send_time);
+                    result->add_lat(lat);
+                    flow.lat.add(lat);
+                    if (nullptr != result->lat_log)
+                        result->lat_log->add(recv_time, fd, lat, rmsgs[i].msg_len);
+                    ++flow.received;
+                    ++result->mcount;
+
+                    ++flow.seq;
+                    hdr.seq = flow.seq;
+                    std::memcpy(siovs[to_send].iov_base, &hdr, sizeof(hdr));
+                    send_flows[to_send] = hdr.flow;
+                    ++to_send;
+                }
+
+                for(int sent = 0; sent < to_send;) {
+                    // datagrams are stamped right before the call, which sends them
+                    unsigned long send_time = get_fast_time();
+                    for(int i = sent; i < to_send; ++i) {
+                        std::memcpy((char *)siovs[i].iov_base + offsetof(UdpHeader, send_time),
+                                    &send_time, sizeof(send_time));
+                        (*flows)[send_flows[i]].send_time = send_time;
+                    }
+                    int rv = sendmmsg(fd, &smsgs[sent], to_send - sent, 0);
+                    ++stats.syscalls;
+                    if (0 > rv) {
+                        // would be resent by loss timeout
+                        if (EAGAIN == errno or EWOULDBLOCK == errno or ENOBUFS == errno) {
+                            ++stats.write_eagain;
+                            break;
+                        }
+                        std::perror("sendmmsg(fd, ...)");
+                        return;
+                    }
+                    stats.bytes_out += rv * message_len;
+                    sent += rv;
+                }
+
+                if (count < UDP_BATCH)
+                    break;
+            }
+        }
+
+        if (curr_time >= next_loss_check) {
+            for(uint32_t idx = 0; idx < flows->size(); ++idx) {
+                auto & flow = (*flows)[idx];
+                // send_time may be after curr_time, it's taken per datagram
+                if (flow.send_time + loss_timeout_ns <= curr_time) {
+                    ++flow.lost;
+                    ++flow.seq;
+                    if (not send_udp_ping(flow, idx, &sbuff[0], message_len, stats))
+                        return;
+                }
+            }
+            next_loss_check = curr_time + loss_timeout_ns / 2;
+        }
+    }
+}
+
+bool open_lat_logs(const TestParams & params, std::vector<TestResult> & tresults) {
+    if (params.lat_log.empty())
+        return true;
+
+    for(size_t i = 0; i < tresults.size(); ++i) {
+        tresults[i].lat_log.reset(new LatLog());
+        std::string fname = params.lat_log + "." + std::to_string(i);
+        if (not tresults[i].lat_log->open(fname, i, params.lat_log_sample, params.lat_log_mb << 20))
+            return false;
+    }
+    return true;
+}
+
+void merge_results(int num_conn,
+                   const std::vector<EPollRSelector> & selectors,
+                   const std::vector<TestResult> & tresults,
+                   TestResult & res)
+{
+    res.mcount = 0;
+
+    for(const auto & sel: selectors)
+        res.sel_stats += sel.stats;
+    res.sel_stats.add_to(res.stats, "sel_");
+
+    KernelTsParts & kts = res.kernel_ts;
+    for(const auto & ires: tresults) {
+        res.mcount += ires.mcount;
+        res.counters += ires.counters;
+        for(const auto & lat_ref: ires.lat_map)
+            res.lat_map.emplace(lat_ref.first, 0).first->second += lat_ref.second;
+        res.lat_sum_ns += ires.lat_sum_ns;
+        res.lat_count += ires.lat_count;
+
+        res.trace_lag.merge(ires.trace_lag);
+        kts.send.merge(ires.kernel_ts.send);
+        kts.wire.merge(ires.kernel_ts.wire);
+        kts.recv.merge(ires.kernel_ts.recv);
+        kts.user.merge(ires.kernel_ts.user);
+        kts.missing += ires.kernel_ts.missing;
+        res.owd.fwd.merge(ires.owd.fwd);
+        res.owd.ret.merge(ires.owd.ret);
+        res.owd.hold.merge(ires.owd.hold);
+        res.owd.negative += ires.owd.negative;
+    }
+
+    std::vector<unsigned long> mps;
+    mps.reserve(num_conn);
 
-    sync->active_count++;
-    DecOnExit exitor(&sync->active_count);
+    for(const auto & ires: tresults) {
+        for(const auto & item: ires.mess_count_for_sock)
+            mps.push_back(item.second);
+    }
 
-    // inhouse barrier implementation
-    sync->run_lola_run.lock();
-    sync->run_lola_run.unlock();
+    std::sort(begin(mps), end(mps));
 
-    for(;;) {
-        ready_fds.clear();
-        unsigned long curr_time;
+    // workers may fail before touching all the sockets
+    res.percentiles.fill(0);
+    for(int i = 0 ; i < (int)res.percentiles.size() and not mps.empty() ; ++i) {
+        int idx = mps.size() * (i + 1) / (res.percentiles.size() + 1);
+        res.percentiles[i] = mps[idx];
+    }
 
-        // if there a ready sockets, waiting for timeout
-        // need to not sleep too long in epoll
-        if (wait_queue.size() > 0) {
-            curr_time = get_fast_time();
-            long int poll_timeout = wait_queue.top().ready_time - curr_time;
+    res.avg_lat_ns = (0 == res.lat_count ? 0 : res.lat_sum_ns / res.lat_count);
+    res.stats.add("avg_lat_ns", (unsigned long)res.avg_lat_ns);
 
-            if (poll_timeout < 0)
-                poll_timeout = 0;
+    if (0 != res.trace_lag.events) {
+        res.stats.add("trace_events", res.trace_lag.events);
+        res.trace_lag.add_to(res.stats, "trace_lag");
+    }
 
-            if (not sel->wait(poll_timeout))
-                return;
+    if (0 != kts.send.events or 0 != kts.missing) {
+        res.stats.add("kts_samples", kts.send.events);
+        res.stats.add("kts_missing", kts.missing);
+        kts.send.add_to(res.stats, "kts_send");
+        kts.wire.add_to(res.stats, "kts_wire");
+        kts.recv.add_to(res.stats, "kts_recv");
+        kts.user.add_to(res.stats, "kts_user");
+    }
 
-            // fill ready_fds with sockets
-            // with expired timeouts
-            curr_time = get_fast_time();
-            while(wait_queue.size() > 0) {
-                auto & item = wait_queue.top();
-                // if timeout expires - remove from timeout_wait_queue
-                // and put to ready_fds
-                if (item.ready_time <= curr_time) {
-                    ready_fds.push_back(item.fd);
-                    wait_queue.pop();
-                } else
-                    break;
-            }
-        } else {
-            if (not sel->wait(100 * 1000 * 1000))
-                return;
-            curr_time = get_fast_time();
-        }
+    if (0 != res.owd.fwd.events) {
+        res.stats.add("owd_samples", res.owd.fwd.events);
+        res.stats.add("owd_negative", res.owd.negative);
+        res.owd.fwd.add_to(res.stats, "owd_fwd");
+        res.owd.ret.add_to(res.stats, "owd_ret");
+        res.owd.hold.add_to(res.stats, "owd_hold");
+    }
 
+    res.counters.add_to(res.stats, "perf_", res.mcount);
+    if (0 != res.mcount)
+        res.stats.add("sel_syscalls_per_msg", (double)res.sel_stats.syscalls / res.mcount);
+    if (0 != res.sel_stats.wait_calls)
+        res.stats.add("sel_cpu_ns_per_wakeup",
+                      (double)(res.counters.utime_us + res.counters.stime_us) * 1000 / res.sel_stats.wait_calls);
+}
 
-        if (sync->done.load())
-            return;
+// grow or shrink connection set to params.num_conn. Sweep steps reuse
+// connections of previous steps, only the difference is (dis)connected.
+bool resize_connections(const TestParams & params, FDList & sockets,
+                        const char ** first_ip, const char ** last_ip)
+{
+    while((int)sockets.fds.size() > params.num_conn) {
+        close(sockets.fds.back());
+        sockets.fds.pop_back();
+    }
 
-        // go throught all polled fds, calculated latency
-        // and move some to wait_queue
+    if ((int)sockets.fds.size() < params.num_conn) {
+        std::vector<sockaddr_in> client_ip_addrs = params.src_addrs;
 
-        result->mcount += sel->ready_count();
+        struct sockaddr_in localaddr;
+        localaddr.sin_family = AF_INET;
+        localaddr.sin_port = 0;
 
-        int fd;
-        while(sel->next(fd)) {
-            auto item = last_time_for_socket.emplace(fd, 0);
+        for(; client_ip_addrs.empty() and first_ip != last_ip; ++first_ip) {
+            localaddr.sin_addr.s_addr = inet_addr(*first_ip);
+            client_ip_addrs.push_back(localaddr);
+        }
 
-            // previous write time for curr socket
-            auto ltime = item.first->second;
+        FDList added;
+        if (not connect_all(params.num_conn - sockets.fds.size(), added.fds, params.ip, params.port,
+                            params.transport, params.conn, client_ip_addrs))
+            return false;
+        sockets.fds.insert(sockets.fds.end(), added.fds.begin(), added.fds.end());
+        added.fds.clear();
+    }
 
-            // if have previous write time for curr socket
-            if (not item.second) {
+    if (-1 != params.nodelay)
+        for(auto fd: sockets.fds)
+            if (not set_nodelay(fd, params.nodelay))
+                return false;
+    return true;
+}
 
-                #ifdef LOG2_LAT
-                int tout_l2 = (int)log2_64(curr_time - ltime);
-                #else
-                int tout_l2 = std::lround(std::log2((float)(curr_time - ltime)) * 10);
-                #endif
+// sweep: write the rest of requests, which workers left queued, and read
+// replies to requests, which were in flight when workers stopped, so the
+// next step starts on clean streams. Connection is quiet when nothing
+// came for quiet_ms.
+bool drain_connections(const std::vector<int> & fds, std::vector<TestResult> & tresults,
+                       SelectorStats & stats, int quiet_ms=200) {
+    EPollRSelector sel(fds.size());
+    if (not sel.ok())
+        return false;
+    for(auto fd: fds)
+        if (not sel.add_fd(fd, EPOLLIN | EPOLLOUT | EPOLLET))
+            return false;
 
-                result->lat_map.emplace(tout_l2, 0).first->second++;
+    // socket belongs to one worker
+    std::vector<SendQueue *> queues;
+    for(auto & ires: tresults)
+        for(size_t fd = 0; fd < ires.send_queues.size(); ++fd)
+            if (not ires.send_queues[fd].empty()) {
+                queues.resize(std::max(queues.size(), fd + 1), nullptr);
+                queues[fd] = &ires.send_queues[fd];
             }
+    size_t queued = 0;
+    for(auto queue: queues)
+        queued += (nullptr != queue);
 
-            // if has timeout
-            if (has_timeout) {
-                unsigned long timeout_ns = 0;
-                if (timeout_ns_max != timeout_ns_min) {
-                    timeout_ns = rand_timeout(rand_gen);
-                } else {
-                    timeout_ns = timeout_ns_max;
-                }
+    std::vector<char> buffer(64 * 1024);
+    for(;;) {
+        if (not sel.wait((long)quiet_ms * 1000 * 1000))
+            return false;
+        if (0 == sel.ready_count() and 0 == queued)
+            return true;
 
-                // if socket isn't ready for new ping yet
-                // put it into wait_queue
-                if (ltime + timeout_ns > curr_time) {
-                    wait_queue.emplace(fd, ltime + timeout_ns);
-                    continue;
+        int fd;
+        uint32_t events;
+        while(sel.next(fd, events)) {
+            if ((events & EPOLLOUT) and fd < (int)queues.size() and nullptr != queues[fd]) {
+                if (not queues[fd]->flush(fd, sel, stats))
+                    return false;
+                if (queues[fd]->empty()) {
+                    queues[fd] = nullptr;
+                    --queued;
                 }
             }
-
-            ready_fds.push_back(fd);
-            if (sync->done.load())
-                return;
+            if ((events & EPOLLIN) and 0 > recv_available(fd, &buffer[0], buffer.size(), stats, false)) {
+                std::cerr << "Connection closed by responder between sweep steps\n";
+                return false;
+            }
         }
+    }
+}
 
-        for(auto fd: ready_fds) {
-            if (sync->done.load())
-                return;
+// rt=1: memory is locked for one run_test*, from before selectors are
+// allocated till results are merged, workers get RT_THREAD_STACK stacks
+class RtMemory {
+    bool enabled;
+public:
+    RtMemory(const RtOptions & rt): enabled(rt.enabled) {
+        if (enabled)
+            rt_memory_enable();
+    }
+    ~RtMemory() {
+        if (enabled)
+            rt_memory_disable();
+    }
+};
 
-            if (not ping(fd, &buffer[0], message_len))
-                return;
+// workers wait for start, so they get rt policy before first event.
+// Threads exit after run, nothing to restore.
+bool set_rt_sched(const RtOptions & rt, std::vector<std::thread> & workers) {
+    bool ok = true;
+    for(auto & worker: workers) {
+        RtThreadSched sched;
+        ok = sched.set(worker.native_handle(), rt) and ok;
+    }
+    return ok;
+}
 
-            last_time_for_socket[fd] = get_fast_time();
-            result->mess_count_for_sock.emplace(fd, 0).first->second++;
-        }
+// runs workers for params.runtime seconds or till all of them exit,
+// owd=1 - clock offset burst every second
+bool run_workers(const TestParams & params, Sync & sync, int worker_threads) {
+    sync.wait_active(worker_threads);
+    sync.start();
+
+    const unsigned long start = get_mono_time();
+    const unsigned long deadline = start + (unsigned long)params.runtime * BILLION;
+    unsigned long next_burst = start + BILLION;
+    for(;;) {
+        unsigned long until = params.owd ? std::min(deadline, next_burst) : deadline;
+        if (sync.wait_active(0, until) or deadline == until)
+            return true;
+        if (not params.clock->burst())
+            return false;
+        next_burst += BILLION;
     }
 }
 
-bool run_test(const TestParams & params, TestResult & res, int worker_threads,
-              const char ** first_ip, const char ** last_ip)
-{
-    FDList sockets;
-    std::vector<sockaddr_in> client_ip_addrs;
+// measured run window - from the first worker start to the last worker end,
+// rates are counted over it, not over nominal runtime
+void add_window_stats(const TestParams & params, const Sync & sync, const std::vector<TestResult> & tresults,
+                      TestResult & res) {
+    unsigned long first_start = 0, last_start = 0, last_end = 0;
+    for(const auto & ires: tresults) {
+        if (0 == ires.start_ns)
+            continue;
+        first_start = (0 == first_start ? ires.start_ns : std::min(first_start, ires.start_ns));
+        last_start = std::max(last_start, ires.start_ns);
+        last_end = std::max(last_end, ires.end_ns);
+    }
 
-    struct sockaddr_in localaddr;
-    localaddr.sin_family = AF_INET;
-    localaddr.sin_port = 0;
+    res.start_ns = first_start;
+    res.end_ns = last_end;
+    if (0 == first_start)
+        return;
+
+    const double runtime_ns = (double)params.runtime * BILLION;
+    res.stats.add("run_window_ms", (double)(last_end - first_start) / MICRO);
+    res.stats.add("runtime_error_ppm", ((last_end - first_start) - runtime_ns) * MICRO / runtime_ns);
+    res.stats.add("start_lag_us", (double)(last_start - std::min(last_start, sync.start_time)) / 1000);
+    res.stats.add("start_skew_us", (double)(last_start - first_start) / 1000);
+    res.stats.add("stop_lag_us", (double)(last_end - std::min(last_end, sync.stop_time)) / 1000);
+}
+
+// schedule: phaseI_lat_* and phaseI_msgs_per_s, the last phase lasts till
+// the end of the run (RUN_NS from start)
+void add_phase_stats(const TestParams & params, const std::vector<TestResult> & tresults, unsigned long run_ns,
+                     StatsList & stats) {
+    const auto & phases = params.schedule.phases;
+    stats.add("schedule_phases", (unsigned long)phases.size());
+
+    for(size_t idx = 0; idx < phases.size(); ++idx) {
+        LatHist lat;
+        for(const auto & ires: tresults)
+            if (idx < ires.phase_lat.size())
+                lat.merge(ires.phase_lat[idx]);
+
+        unsigned long end_ns = (idx + 1 == phases.size() ? run_ns : phases[idx].start_ns + phases[idx].duration_ns);
+        end_ns = std::min(end_ns, run_ns);
+        if (end_ns <= phases[idx].start_ns)
+            break;
 
-    for(; first_ip != last_ip; ++first_ip) {
-        localaddr.sin_addr.s_addr = inet_addr(*first_ip);
-        client_ip_addrs.push_back(localaddr);
+        std::string prefix = "phase" + std::to_string(idx);
+        stats.add(prefix + "_msgs_per_s", (double)lat.events * BILLION / (end_ns - phases[idx].start_ns));
+        lat.add_to(stats, prefix + "_lat");
     }
+}
+
+bool run_test(const TestParams & params, const std::vector<int> & fds, TestResult & res, int worker_threads)
+{
+    RtMemory rt_memory(params.rt);
 
-    if (not connect_all(params.num_conn, sockets.fds, params.ip, params.port, client_ip_addrs))
+    if (params.kernel_ts)
+        for(auto fd: fds)
+            if (not enable_kernel_ts(fd))
+                return false;
+
+    TcpInfoSampler tcp_info;
+    if (params.tcp_info.enabled() and not tcp_info.start(fds, params.tcp_info, "loader"))
         return false;
 
     std::vector<EPollRSelector> selectors;
@@ -514,7 +2957,7 @@ bool run_test(const TestParams & params, TestResult & res, int worker_threads,
     }
 
     int idx = 0;
-    for(auto fd: sockets.fds) {
+    for(auto fd: fds) {
         auto & sel = selectors[idx % worker_threads];
         if (not sel.add_fd(fd))
             return false;
@@ -523,150 +2966,406 @@ bool run_test(const TestParams & params, TestResult & res, int worker_threads,
 
     std::vector<TestResult> tresults;
     tresults.resize(worker_threads);
+    if (not open_lat_logs(params, tresults))
+        return false;
+
+    std::vector<std::vector<const TraceEvent *>> trace_events;
+    if (params.trace)
+        trace_events = params.trace->split(worker_threads);
 
     std::vector<std::thread> workers;
     Sync sync;
+    if (not sync.ok())
+        return false;
+    for(auto & sel: selectors)
+        if (not sel.add_fd(sync.stop_fd))
+            return false;
 
-    sync.done = false;
-    sync.active_count = 0;
-    sync.run_lola_run.lock();
-
+    WorkerFunc worker = select_worker(params);
     for(int i = 0; i < worker_threads ; ++i)
-        workers.emplace_back(worker_thread,
+        if (params.trace)
+            workers.emplace_back(worker_thread_trace, &selectors[i], &fds, &trace_events[i], i, worker_threads,
+                                 &sync, &tresults[i], &params);
+        else if (window_mode(params))
+            workers.emplace_back(worker_thread_idle, &selectors[i], &fds, i, worker_threads,
+                                 &sync, &tresults[i], &params);
+        else if (params.pipeline > 1)
+            workers.emplace_back(worker_thread_pipeline, &selectors[i], &sync, &tresults[i], &params);
+        else if (params.kernel_ts)
+            workers.emplace_back(worker_thread_kernel_ts, &selectors[i], &sync, &tresults[i], &params);
+        else if (params.owd)
+            workers.emplace_back(worker_thread_owd, &selectors[i], &sync, &tresults[i], &params);
+        else
+            workers.emplace_back(worker,
                              &selectors[i],
                              params.message_len,
                              max_sock_count_per_worker,
                              params.min_timeout,
                              params.max_timeout,
                              &sync,
-                             &tresults[i]);
+                             &tresults[i],
+                             &params);
 
+    bool rt_sched_ok = params.rt.enabled and set_rt_sched(params.rt, workers);
     bool failed = false;
     std::string message((size_t)params.message_len, 'X');
 
-    for(auto sock: sockets.fds) {
-        if (params.message_len != write(sock, message.c_str(), message.length())) {
+    // first requests, workers' generators are independent from this one
+    std::mt19937 rand_gen(params.num_conn);
+    SizeDistribution req_size = params.req_size;
+    SizeDistribution resp_size = params.resp_size;
+    SelectorStats first_stats;
+
+    for(size_t idx = 0; idx < fds.size(); ++idx) {
+        // trace replay sends all requests by schedule, idle mode worker
+        // sends to its active window only
+        if (params.trace or window_mode(params))
+            break;
+
+        // frames, which sockets don't take, are left to workers, as
+        // responder may wait till its reply on other connection is read
+        int sock = fds[idx];
+        if (params.framed) {
+            auto & queues = tresults[idx % worker_threads].send_queues;
+            if (sock >= (int)queues.size())
+                queues.resize(sock + 1);
+            FrameHeader request{req_size(rand_gen), resp_size(rand_gen)};
+            queues[sock].add_frames(&request, 1);
+            if (not queues[sock].flush(sock, selectors[idx % worker_threads], first_stats)) {
+                failed = true;
+                break;
+            }
+        } else if (params.message_len != write(sock, message.c_str(), message.length())) {
             std::perror("write(sock, message, ...)");
             failed = true;
             break;
         }
     }
 
-    if (not failed) {
-        while (sync.active_count.load() != worker_threads)
-                usleep(100 * 1000); // 100ms sleep
-
-        sync.run_lola_run.unlock();
+    // clock offset before the run, then every second to follow drift
+    if (params.owd and not params.clock->burst())
+        failed = true;
 
-        // run threads for params.runtime seconds
-        int sleeps = params.runtime * 10;
-        for(;sleeps > 0; --sleeps) {
-            usleep(100 * 1000); // 100ms sleep
-            if (sync.active_count.load() == 0)
-                break;
-        }
-    }
+    if (not failed and not run_workers(params, sync, worker_threads))
+        failed = true;
 
-    sync.done.store(true);
+    sync.stop();
     for(auto & worker: workers)
         worker.join();
+    tcp_info.stop();
+
+    if (params.owd and not failed)
+        failed = not params.clock->burst() or not params.clock->finish();
+
+    merge_results(params.num_conn, selectors, tresults, res);
+    add_window_stats(params, sync, tresults, res);
+    tcp_info.add_to(res.stats);
+    if (params.rt.enabled)
+        add_rt_report(res.stats, rt_sched_ok);
+    if (params.owd)
+        params.clock->add_to(res.stats);
+    if (window_mode(params)) {
+        unsigned long churned = 0;
+        for(const auto & ires: tresults)
+            churned += ires.churned;
+        if (params.schedule.empty())
+            res.stats.add("active_conns", (unsigned long)std::max(1L, std::lround(params.num_conn * params.active)));
+        res.stats.add("churned", churned);
+    }
+    if (not params.schedule.empty())
+        add_phase_stats(params, tresults, res.end_ns - std::min(res.end_ns, sync.start_time), res.stats);
+    if (params.lat_sample > 1) {
+        unsigned long samples = 0;
+        for(const auto & item: res.lat_map)
+            samples += item.second;
+        res.stats.add("lat_sample", (unsigned long)params.lat_sample);
+        res.stats.add("lat_samples", samples);
+    }
 
-    res.mcount = 0;
-
-    for(const auto & ires: tresults) {
-        res.mcount += ires.mcount;
-        for(const auto & lat_ref: ires.lat_map)
-            res.lat_map.emplace(lat_ref.first, 0).first->second += lat_ref.second;
+    if (params.sweep and not failed) {
+        SelectorStats drain_stats;
+        failed = not drain_connections(fds, tresults, drain_stats);
     }
+    return not failed;
+}
 
-    std::vector<unsigned long> mps;
-    mps.reserve(params.num_conn);
+// num_conn flows over udp_sockets connected UDP sockets
+bool run_test_udp(const TestParams & params, TestResult & res, int worker_threads)
+{
+    if (0 != params.min_timeout or 0 != params.max_timeout) {
+        std::cerr << "udp mode doesn't support timeouts\n";
+        return false;
+    }
 
-    for(const auto & ires: tresults) {
-        for(const auto & item: ires.mess_count_for_sock)
-            mps.push_back(item.second);
+    if (params.message_len < (int)sizeof(UdpHeader)) {
+        std::cerr << "udp mode requires message at least " << sizeof(UdpHeader) << " bytes long\n";
+        return false;
     }
 
-    std::sort(begin(mps), end(mps));
+    RtMemory rt_memory(params.rt);
 
-    for(int i = 0 ; i < (int)res.percentiles.size() ; ++i) {
-        int idx = params.num_conn * (i + 1) / (res.percentiles.size() + 1);
-        res.percentiles[i] = mps[idx];
+    long sock_count = std::min(params.num_conn, 64);
+    long loss_timeout_ms = 200;
+    long sock_buff = 4 * 1024 * 1024;
+    if (not opt_long(params.opts, "udp_sockets", sock_count) or
+        not opt_long(params.opts, "udp_loss_timeout_ms", loss_timeout_ms) or
+        not opt_long(params.opts, "udp_sock_buf", sock_buff))
+        return false;
+
+    sockaddr_in serv_addr;
+    if (not resolve_addr(params.ip, params.port, serv_addr))
+        return false;
+
+    worker_threads = std::min((int)sock_count, worker_threads);
+
+    FDList sockets;
+    std::vector<EPollRSelector> selectors;
+    selectors.reserve(worker_threads); // avoid move, as EPollRSelector would close fd
+    std::vector<std::vector<UdpFlow>> flows(worker_threads);
+
+    for(int i = 0; i < worker_threads ; ++i) {
+        selectors.emplace_back(sock_count / worker_threads + 1);
+        if (not selectors.rbegin()->ok())
+            return false;
     }
 
-    #ifdef LOG2_LAT
-    double base = 2.0;
-    #else
-    double base = std::pow(2L, 0.1L);
-    #endif
+    for(int i = 0; i < sock_count; ++i) {
+        int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (sockfd < 0) {
+            std::perror("Socket creation:");
+            return false;
+        }
+        sockets.fds.push_back(sockfd);
+        set_udp_buffers(sockfd, sock_buff);
 
-    long count = 0;
-    double lat_ns_sum = 0;
+        if (0 > connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr))) {
+            std::perror("Connecting:");
+            return false;
+        }
 
-    for(const auto & lat_ref: res.lat_map) {
-        lat_ns_sum += lat_ref.second * std::pow(base, lat_ref.first);
-        count += lat_ref.second;
+        if (not selectors[i % worker_threads].add_fd(sockfd))
+            return false;
     }
 
-    res.avg_lat_ns = (long) (lat_ns_sum / count);
-    return not failed;
-}
+    for(int i = 0; i < params.num_conn; ++i) {
+        int sockfd = sockets.fds[i % sock_count];
+        flows[(i % sock_count) % worker_threads].emplace_back(sockfd);
+    }
 
-void process_client(int sock, const char ** first_ip, const char ** last_ip, int max_wait_time_seconds=5) {
-    FDCloser fdc{sock};
-    char buff[MAX_CLIENT_MESSAGE + 1];
-    int data_len = 0;
+    std::vector<TestResult> tresults;
+    tresults.resize(worker_threads);
+    if (not open_lat_logs(params, tresults))
+        return false;
 
-    usleep(100 * 1000); // 100ms sleep
-    for(int i = 0 ; i <= max_wait_time_seconds * 10; ++i) {
-        data_len = recv(sock, buff, sizeof(buff), MSG_DONTWAIT);
-        if (data_len < 0 and not (errno == EAGAIN or errno == EWOULDBLOCK)) {
-            perror("recv failed");
-            return;
+    std::vector<std::thread> workers;
+    Sync sync;
+    if (not sync.ok())
+        return false;
+    for(auto & sel: selectors)
+        if (not sel.add_fd(sync.stop_fd))
+            return false;
+
+    for(int i = 0; i < worker_threads ; ++i)
+        workers.emplace_back(worker_thread_udp,
+                             &selectors[i],
+                             &flows[i],
+                             params.message_len,
+                             loss_timeout_ms * 1000 * 1000,
+                             &sync,
+                             &tresults[i]);
+
+    bool rt_sched_ok = params.rt.enabled and set_rt_sched(params.rt, workers);
+
+    run_workers(params, sync, worker_threads);
+    sync.stop();
+    for(auto & worker: workers)
+        worker.join();
+
+    // responder has no connections to close, notify it explicitly
+    std::string end_message((size_t)params.message_len, 'X');
+    UdpHeader end_hdr{UDP_END_FLOW, 0, 0};
+    std::memcpy(&end_message[0], &end_hdr, sizeof(end_hdr));
+    for(int i = 0; i < 3; ++i) {
+        if (0 > send(sockets.fds[0], end_message.c_str(), end_message.size(), 0))
+            std::perror("send(end_message)");
+        usleep(10 * 1000);
+    }
+
+    unsigned long lost = 0, late = 0;
+    std::vector<unsigned long> loss_ppm, p99_ns;
+    loss_ppm.reserve(params.num_conn);
+    p99_ns.reserve(params.num_conn);
+
+    for(int i = 0; i < worker_threads ; ++i) {
+        uint32_t idx = 0;
+        for(const auto & flow: flows[i]) {
+            lost += flow.lost;
+            late += flow.late;
+            tresults[i].mess_count_for_sock[idx++] = flow.received;
+            if (0 != flow.received + flow.lost)
+                loss_ppm.push_back(flow.lost * MICRO / (flow.received + flow.lost));
+            if (0 != flow.lat.events)
+                p99_ns.push_back(flow.lat.p99_ns());
         }
+    }
 
-        if (data_len > 0)
-            break;
-        usleep(100 * 1000); // 100ms sleep
+    merge_results(params.num_conn, selectors, tresults, res);
+    add_window_stats(params, sync, tresults, res);
+    if (params.rt.enabled)
+        add_rt_report(res.stats, rt_sched_ok);
+
+    res.stats.add("udp_sockets", (unsigned long)sock_count);
+    res.stats.add("udp_lost", lost);
+    res.stats.add("udp_late", late);
+    if (0 != lost + res.mcount)
+        res.stats.add("udp_loss_ppm", lost * MICRO / (lost + res.mcount));
+
+    std::sort(loss_ppm.begin(), loss_ppm.end());
+    if (not loss_ppm.empty()) {
+        res.stats.add("udp_flow_loss_ppm_50", loss_ppm[loss_ppm.size() / 2]);
+        res.stats.add("udp_flow_loss_ppm_95", loss_ppm[loss_ppm.size() * 95 / 100]);
+        res.stats.add("udp_flow_loss_ppm_max", loss_ppm.back());
+    }
+
+    // spread of RTT tails between flows, a few slow flows hide in the merged histogram
+    std::sort(p99_ns.begin(), p99_ns.end());
+    if (not p99_ns.empty()) {
+        res.stats.add("udp_flow_p99_ns_50", p99_ns[p99_ns.size() / 2]);
+        res.stats.add("udp_flow_p99_ns_95", p99_ns[p99_ns.size() * 95 / 100]);
+        res.stats.add("udp_flow_p99_ns_max", p99_ns.back());
+    }
+
+    return true;
+}
+
+// wait for test spec from control connection, false on error or timeout
+bool recv_spec(int sock, char (&buff)[MAX_CLIENT_MESSAGE + 1], int max_wait_time_seconds) {
+    pollfd pfd{sock, POLLIN, 0};
+    int ready = poll(&pfd, 1, max_wait_time_seconds * 1000);
+    if (0 > ready) {
+        perror("poll(control_sock)");
+        return false;
     }
 
-    if (data_len <= 0) {
+    if (0 == ready) {
         std::cerr << "Client communication timeout\n";
-        return;
+        return false;
+    }
+
+    int data_len = recv(sock, buff, sizeof(buff), MSG_DONTWAIT);
+    if (data_len < 0) {
+        perror("recv failed");
+        return false;
+    }
+
+    if (0 == data_len) {
+        std::cerr << "Control connection closed\n";
+        return false;
     }
 
     if (data_len == sizeof(buff)) {
         std::cerr << "Message to large\n";
-        return;
+        return false;
     }
     buff[data_len] = 0;
+    return true;
+}
 
-    std::cout << "Get test spec '" << buff << "'\n";
-
-    // MESSAGE FORMAT
-    // CLIENT_IP - CLIENT_PORT - NUM_CONNECTIONS - RUNTIME - TIMEOUT - MESS_SIZE
-    TestParams params;
-    if (not load_from_str(buff, params))
-        return;
-
-    const int worker_thread = 3;
-    TestResult res;
-    if (not run_test(params, res, worker_thread, first_ip, last_ip))
-        return;
+bool send_result(int sock, const TestParams & params, TestResult & res) {
+    double seconds = params.runtime;
+    if (res.end_ns > res.start_ns)
+        seconds = (double)(res.end_ns - res.start_ns) / BILLION;
+    double bytes_per_s = (double)(res.sel_stats.bytes_in + res.sel_stats.bytes_out) / seconds;
+    res.stats.add("msgs_per_s", (double)res.mcount / seconds);
+    res.stats.add("bytes_per_s", bytes_per_s);
+    res.stats.add("pipeline", (unsigned long)params.pipeline);
+    if (params.framed) {
+        res.stats.add("req_size_mean", params.req_size.mean());
+        res.stats.add("resp_size_mean", params.resp_size.mean());
+    }
 
     std::cout << "Test finished. Results : " << "\n";
     std::cout << "    mess_count = " << res.mcount << "\n";
-    std::cout << "    average_mps = " << res.mcount / params.runtime << "\n";
+    std::cout << "    average_mps = " << (unsigned long)(res.mcount / seconds) << "\n";
+    std::cout << "    average_bytes_per_s = " << (unsigned long)bytes_per_s << "\n";
     std::cout << "    average_lat = " << (int)(res.avg_lat_ns / 1000) << " us\n";
     std::cout << "    5% mess perc = " << res.percentiles[0] << "\n";
     std::cout << "    95% mess perc = " << res.percentiles[res.percentiles.size() - 1] << "\n";
+    std::cout << "    epoll_wait calls = " << res.sel_stats.wait_calls << "\n";
+    if (0 != res.mcount and res.counters.valid[PC_CYCLES])
+        std::cout << "    cycles per message = " << res.counters.values[PC_CYCLES] / res.mcount << "\n";
+    if (res.sel_stats.wait_calls != res.sel_stats.empty_wakeups) {
+        std::cout << "    average sockets per epoll_wait = ";
+        std::cout << res.sel_stats.events / (res.sel_stats.wait_calls - res.sel_stats.empty_wakeups) << "\n";
+    }
 
+    // single test result ends with connection close, sweep
+    // results are prefixed with size
     std::string responce = serialize_to_str(res);
+    if (params.sweep)
+        responce = std::to_string(responce.size()) + "\n" + responce;
     if( write(sock, &responce[0], responce.size()) != (int)responce.size()) {
         perror("write failed");
-        return;
+        return false;
+    }
+    return true;
+}
+
+// sweep=1 - after result control connection carries next step spec, till
+// 'end'. Connections are kept between steps, so all steps must have the same
+// responder address and transport.
+void process_client(int sock, const char ** first_ip, const char ** last_ip, int max_wait_time_seconds=5) {
+    FDCloser fdc{sock};
+    char buff[MAX_CLIENT_MESSAGE + 1];
+    FDList sockets;
+    TestParams first;
+
+    for(int step = 0;; ++step) {
+        if (not recv_spec(sock, buff, max_wait_time_seconds))
+            return;
+
+        if (0 != step and 0 == std::strcmp(buff, "end"))
+            return;
+
+        std::cout << "Get test spec '" << buff << "'\n";
+
+        // MESSAGE FORMAT
+        // CLIENT_IP - CLIENT_PORT - NUM_CONNECTIONS - RUNTIME - TIMEOUT - MESS_SIZE
+        TestParams params;
+        if (not load_from_str(buff, params))
+            return;
+
+        if (0 == step) {
+            first = params;
+        } else if (not params.sweep or std::strcmp(params.ip, first.ip) or params.port != first.port or
+                   params.transport != first.transport) {
+            std::cerr << "Sweep step should have sweep=1, the same responder address and transport\n";
+            return;
+        }
+
+        if (params.owd)
+            params.clock = std::make_shared<ClockSync>(sock);
+
+        TestResult res;
+        if (TRANSPORT_UDP == params.transport) {
+            if (not run_test_udp(params, res, params.workers))
+                return;
+        } else {
+            ConnMemProbe mem;
+            long added = params.num_conn - sockets.fds.size();
+            mem.start();
+            if (not resize_connections(params, sockets, first_ip, last_ip))
+                return;
+            mem.done();
+
+            if (not run_test(params, sockets.fds, res, params.workers))
+                return;
+            mem.add_to(res.stats, added);
+        }
+
+        if (not send_result(sock, params, res) or not params.sweep)
+            return;
     }
-    return;
 }
 
 void *get_in_addr(struct sockaddr *sa) {
@@ -718,20 +3417,8 @@ int main_loop_thread(int port, bool single_shot, const char ** first_ip, const c
             std::cout << "Client connected: " << ipstr << ":" << ntohs(client.sin_port) << "\n";
         }
 
-        #ifdef EPOLL_CALL_STATS
-        socket_count_from_wait = 0;
-        epoll_wait_calls = 0;
-        #endif
-
         process_client(client_sock, first_ip, last_ip);
 
-        #ifdef EPOLL_CALL_STATS
-        if ( 0 != epoll_wait_calls.load()) {
-            std::cout << "Average sockets from epoll_wait = ";
-            std::cout << socket_count_from_wait / epoll_wait_calls << "\n";
-        }
-        #endif
-
         if (single_shot)
             break;
     }
@@ -744,11 +3431,15 @@ int main(int argc, const char **argv) {
     const char ** first_ip = argv + 1;
     const char ** last_ip = argv + argc;
 
-    if (argc > 1) {
-        if (argv[1] == std::string("-s")) {
+    for(;;) {
+        if (first_ip < last_ip and *first_ip == std::string("-s")) {
             single_shot = true;
             ++first_ip;
-        }
+        } else if (first_ip + 1 < last_ip and *first_ip == std::string("-l")) {
+            log_dir = first_ip[1];
+            first_ip += 2;
+        } else
+            break;
     }
 
 #ifdef USERDTSC
@@ -756,5 +3447,6 @@ int main(int argc, const char **argv) {
         return 1;
 #endif
 
+    raise_fd_limit();
     return main_loop_thread(DEFAULT_PORT, single_shot, first_ip, last_ip);
 }